@@ -173,7 +173,7 @@ Map = make_game_table({}, { copy = copy },
 Sides = make_game_table({}, { copy = copy },
   function (table, key, value)
     if not (type(key) == "number" and key > 0) then error ("sides are keyed with positive integers") end
-    table[key] = engine.construct_side(key, value) -- this will update external (anura) so we don't have to call an addtional update function
+    table[key] = engine.construct_side(key, value) -- this will update external (anura) and the alliances so we don't have to call an addtional update function
   end
 )
 
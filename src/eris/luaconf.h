@@ -554,5 +554,9 @@
 #define WESNOTH_KERNEL_OFFSET sizeof(void*)
 #define LUAI_EXTRASPACE WESNOTH_KERNEL_OFFSET
 
+/* Coroutines inherit the kernel pointer of the thread which created them. */
+#define luai_userstatethread(L,L1) \
+	memcpy(((char *)(L1)) - WESNOTH_KERNEL_OFFSET, ((char *)(L)) - WESNOTH_KERNEL_OFFSET, WESNOTH_KERNEL_OFFSET)
+
 #endif
 
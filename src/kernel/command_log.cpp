@@ -0,0 +1,246 @@
+#include "command_log.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <ostream>
+
+namespace wesnoth {
+
+const size_t command_log::slot_text;
+
+static size_t round_up_pow2(size_t n) {
+	size_t result = 1;
+	while (result < n) {
+		result *= 2;
+	}
+	return result;
+}
+
+command_log::command_log(size_t capacity)
+	: slots_(new slot[round_up_pow2(std::max<size_t>(capacity, 2))])
+	, mask_(round_up_pow2(std::max<size_t>(capacity, 2)) - 1)
+	, head_(0)
+	, pending_()
+	, external_log_(NULL)
+	, drain_cursor_(0)
+	, drained_(0)
+	, stopping_(false)
+	, mutex_()
+	, wake_()
+	, drained_cv_()
+	, drain_thread_()
+{
+	for (size_t i = 0; i <= mask_; ++i) {
+		slots_[i].stamp.store(0, std::memory_order_relaxed);
+	}
+}
+
+command_log::~command_log() {
+	stop_drain();
+}
+
+command_log& command_log::operator<<(char const* str) {
+	if (str != NULL) {
+		append(str, std::strlen(str));
+	}
+	return *this;
+}
+
+void command_log::append(const char* str, size_t len) {
+	while (len > 0) {
+		const char* nl = static_cast<const char*>(std::memchr(str, '\n', len));
+		if (!nl) {
+			pending_.append(str, len);
+			return;
+		}
+		pending_.append(str, nl - str);
+		commit(INFO, pending_.data(), pending_.size());
+		pending_.clear();
+
+		len -= (nl - str) + 1;
+		str = nl + 1;
+	}
+}
+
+void command_log::write(SEVERITY severity, const std::string& message) {
+	const char* str = message.data();
+	const char* end = str + message.size();
+	for (;;) {
+		const char* nl = std::find(str, end, '\n');
+		commit(severity, str, nl - str);
+		if (nl == end || nl + 1 == end) {
+			return;
+		}
+		str = nl + 1;
+	}
+}
+
+// Only the producer calls this. It never waits for anybody.
+void command_log::commit(SEVERITY severity, const char* str, size_t len) {
+	boost::uint64_t seq = head_.load(std::memory_order_relaxed);
+	do {
+		size_t n = std::min(len, slot_text);
+		slot& s = slots_[seq & mask_];
+
+		s.stamp.store(2 * seq + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+
+		s.severity = severity;
+		s.continued = n < len;
+		s.length = n;
+		std::memcpy(s.text, str, n);
+
+		s.stamp.store(2 * seq + 2, std::memory_order_release);
+
+		str += n;
+		len -= n;
+		++seq;
+	} while (len > 0);
+
+	head_.store(seq, std::memory_order_release);
+
+	if (external_log_) {
+		wake_.notify_one();
+	}
+}
+
+// Copies the slot for entry seq, and checks that it wasn't overwritten in the meantime.
+bool command_log::read(boost::uint64_t seq, slot& out) const {
+	const slot& s = slots_[seq & mask_];
+
+	boost::uint64_t stamp = s.stamp.load(std::memory_order_acquire);
+	if (stamp != 2 * seq + 2) {
+		return false;
+	}
+
+	out.severity = s.severity;
+	out.continued = s.continued;
+	out.length = std::min<size_t>(s.length, slot_text);
+	std::memcpy(out.text, s.text, out.length);
+
+	std::atomic_thread_fence(std::memory_order_acquire);
+	return s.stamp.load(std::memory_order_relaxed) == stamp;
+}
+
+std::vector<command_log::entry> command_log::entries(boost::uint64_t since) const {
+	std::vector<entry> result;
+
+	boost::uint64_t head = head_.load(std::memory_order_acquire);
+	boost::uint64_t window = mask_ + 1;
+	boost::uint64_t seq = std::max(since, head > window ? head - window : 0);
+
+	slot s;
+	for (; seq < head; ++seq) {
+		if (read(seq, s)) {
+			entry e = { seq, static_cast<SEVERITY>(s.severity), std::string(s.text, s.length) };
+			result.push_back(e);
+		}
+	}
+	return result;
+}
+
+std::string command_log::recent() const {
+	boost::uint64_t head = head_.load(std::memory_order_acquire);
+	boost::uint64_t window = mask_ + 1;
+
+	std::string result;
+	slot s;
+	for (boost::uint64_t seq = head > window ? head - window : 0; seq < head; ++seq) {
+		if (read(seq, s)) {
+			result.append(s.text, s.length);
+			if (!s.continued) {
+				result += '\n';
+			}
+		}
+	}
+	result += pending_;
+	return result;
+}
+
+void command_log::set_external_log(std::ostream* ext) {
+	stop_drain();
+
+	external_log_ = ext;
+	if (external_log_) {
+		drain_cursor_ = head_.load(std::memory_order_acquire);
+		drained_.store(drain_cursor_);
+		stopping_ = false;
+		drain_thread_ = std::thread(&command_log::drain, this);
+	}
+}
+
+void command_log::stop_drain() {
+	if (drain_thread_.joinable()) {
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			stopping_ = true;
+		}
+		wake_.notify_one();
+		drain_thread_.join();
+	}
+	external_log_ = NULL;
+}
+
+void command_log::flush() {
+	if (!drain_thread_.joinable()) {
+		return;
+	}
+
+	boost::uint64_t target = head_.load(std::memory_order_acquire);
+	wake_.notify_one();
+
+	std::unique_lock<std::mutex> lock(mutex_);
+	drained_cv_.wait(lock, [&]() { return drained_.load() >= target; });
+}
+
+void command_log::clear() {
+	stop_drain();
+	// Invalidate every slot, so that readers stop at the new head
+	for (size_t i = 0; i <= mask_; ++i) {
+		slots_[i].stamp.store(0, std::memory_order_relaxed);
+	}
+	head_.store(0, std::memory_order_release);
+	pending_.clear();
+}
+
+// Body of the background thread.
+void command_log::drain() {
+	slot s;
+	for (;;) {
+		bool stop = stopping_.load();
+
+		boost::uint64_t head = head_.load(std::memory_order_acquire);
+		boost::uint64_t window = mask_ + 1;
+		if (head > window && drain_cursor_ < head - window) {
+			(*external_log_) << "[" << (head - window - drain_cursor_) << " log lines dropped]\n";
+			drain_cursor_ = head - window;
+		}
+
+		for (; drain_cursor_ < head; ++drain_cursor_) {
+			if (read(drain_cursor_, s)) {
+				external_log_->write(s.text, s.length);
+				if (!s.continued) {
+					(*external_log_) << '\n';
+				}
+			} else {
+				(*external_log_) << "[log line dropped]\n";
+			}
+		}
+		external_log_->flush();
+
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			drained_.store(head);
+			drained_cv_.notify_all();
+			if (stop) {
+				return;
+			}
+			if (!stopping_ && head_.load(std::memory_order_acquire) == head) {
+				wake_.wait_for(lock, std::chrono::milliseconds(50));
+			}
+		}
+	}
+}
+
+} // end namespace wesnoth
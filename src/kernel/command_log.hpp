@@ -0,0 +1,107 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <iosfwd>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/cstdint.hpp>
+#include <boost/scoped_array.hpp>
+
+namespace wesnoth {
+
+////
+// Bounded log of the kernel's output.
+//
+// Lines are kept in a ring buffer of fixed size slots, each stamped with a sequence number.
+// Once the ring is full, the oldest lines are overwritten, so a long game doesn't accumulate
+// its whole history in memory. Lines which don't fit in a slot are continued in the next ones.
+//
+// There is a single producer, the thread driving the kernel, and writing never blocks it.
+// If an external log is set, a background thread drains new lines to it. If the drain falls
+// more than a full ring behind, it reports how many lines it lost and skips ahead.
+//
+// Readers validate each slot against its stamp after copying it (a seqlock), so a slot which
+// was overwritten while being read is dropped rather than returned torn.
+////
+
+class command_log {
+public:
+	enum SEVERITY { DEBUG, INFO, WARNING, ERROR };
+
+	struct entry {
+		boost::uint64_t seq;
+		SEVERITY severity;
+		std::string text; // without the trailing newline
+	};
+
+	explicit command_log(size_t capacity = 512); // rounded up to a power of two
+	~command_log();
+
+	// Append text. Each complete line becomes an entry of INFO severity.
+	command_log& operator<<(const std::string& str) {
+		append(str.data(), str.size());
+		return *this;
+	}
+	command_log& operator<<(char const* str);
+
+	// Log a message at some severity. Each of its lines becomes an entry.
+	void write(SEVERITY, const std::string& message);
+
+	// The sequence number that the next entry will get.
+	boost::uint64_t next_seq() const { return head_.load(std::memory_order_acquire); }
+
+	// The entries still in the ring with sequence number at least 'since'.
+	std::vector<entry> entries(boost::uint64_t since = 0) const;
+
+	// The entries still in the ring, as text.
+	std::string recent() const;
+
+	// Start (or stop, if NULL) mirroring new entries to the stream, from a background thread.
+	void set_external_log(std::ostream*);
+
+	// Wait until the background thread has written everything logged so far.
+	void flush();
+
+	// Drop all entries, pending text, and the external log.
+	void clear();
+
+private:
+	command_log(const command_log&); // noncopyable
+
+	static const size_t slot_text = 116;
+
+	struct slot {
+		std::atomic<boost::uint64_t> stamp; // 2*seq + 1 while being written, 2*seq + 2 once complete
+		unsigned char severity;
+		bool continued; // the next entry continues this line
+		unsigned short length;
+		char text[slot_text];
+	};
+
+	bool read(boost::uint64_t seq, slot& out) const;
+
+	void append(const char* str, size_t len);
+	void commit(SEVERITY, const char* str, size_t len);
+	void stop_drain();
+	void drain();
+
+	boost::scoped_array<slot> slots_;
+	const size_t mask_;
+	std::atomic<boost::uint64_t> head_; // number of entries ever written
+	std::string pending_;               // the current unterminated line
+
+	std::ostream* external_log_;
+	boost::uint64_t drain_cursor_;
+	std::atomic<boost::uint64_t> drained_;
+	std::atomic<bool> stopping_;
+	std::mutex mutex_;
+	std::condition_variable wake_;
+	std::condition_variable drained_cv_;
+	std::thread drain_thread_;
+};
+
+} // end namespace wesnoth
@@ -0,0 +1,39 @@
+#include "distance_field.hpp"
+
+#include <algorithm>
+#include <cassert>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace wesnoth {
+
+const boost::uint32_t distance_field::UNREACHED;
+
+void distance_field::merge(const distance_field & other) {
+	assert(other.size() == size());
+
+	boost::uint32_t * a = values_.empty() ? NULL : &values_[0];
+	const boost::uint32_t * b = other.values_.empty() ? NULL : &other.values_[0];
+	const size_t n = values_.size();
+	size_t i = 0;
+
+#ifdef __SSE2__
+	// SSE2 only compares signed integers, so flip the top bits first to compare unsigned ones
+	const __m128i bias = _mm_set1_epi32(static_cast<int>(0x80000000u));
+	for (; i + 4 <= n; i += 4) {
+		__m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a + i));
+		__m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + i));
+		__m128i y_less = _mm_cmpgt_epi32(_mm_xor_si128(x, bias), _mm_xor_si128(y, bias));
+		__m128i m = _mm_or_si128(_mm_and_si128(y_less, y), _mm_andnot_si128(y_less, x));
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(a + i), m);
+	}
+#endif
+
+	for (; i < n; ++i) {
+		a[i] = std::min(a[i], b[i]);
+	}
+}
+
+} // end namespace wesnoth
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+#include <boost/cstdint.hpp>
+
+#include "kernel_types.hpp"
+
+namespace wesnoth {
+
+////
+// How soon each hex of a rectangle of the map can be reached, row by row.
+//
+// An entry packs the turn of arrival (1 for the current turn, as shortest_path_distance
+// counts) in its high half, and the moves left on arrival, inverted, in its low half. So
+// the smaller entry is the better one, and fields for several sources combine by taking
+// the least entry at each hex.
+////
+
+class distance_field {
+public:
+	static const boost::uint32_t UNREACHED = 0xFFFFFFFF;
+
+	distance_field() : x0_(0), y0_(0), w_(0), h_(0), values_() {}
+
+	distance_field(int x0, int y0, int w, int h)
+		: x0_(x0)
+		, y0_(y0)
+		, w_(w)
+		, h_(h)
+		, values_(static_cast<size_t>(w) * h, UNREACHED)
+	{
+	}
+
+	static boost::uint32_t encode(size_t turns, size_t moves_left) {
+		if (turns > 0xFFFE) {
+			turns = 0xFFFE;
+		}
+		if (moves_left > 0xFFFF) {
+			moves_left = 0xFFFF;
+		}
+		return static_cast<boost::uint32_t>(turns << 16 | (0xFFFF - moves_left));
+	}
+
+	size_t size() const { return values_.size(); }
+
+	// Index of a location, or -1 if it is outside the rectangle
+	int index(map_location loc) const {
+		int x = loc.x - x0_, y = loc.y - y0_;
+		if (x < 0 || y < 0 || x >= w_ || y >= h_) {
+			return -1;
+		}
+		return y * w_ + x;
+	}
+
+	boost::uint32_t operator[](size_t i) const { return values_[i]; }
+	boost::uint32_t & operator[](size_t i) { return values_[i]; }
+
+	bool reached(map_location loc) const {
+		int i = index(loc);
+		return i >= 0 && values_[i] != UNREACHED;
+	}
+	// These are only meaningful for hexes reached
+	size_t turns(map_location loc) const { return values_[index(loc)] >> 16; }
+	size_t moves_left(map_location loc) const { return 0xFFFF - (values_[index(loc)] & 0xFFFF); }
+
+	// Keep the better entry of this field and another one over the same rectangle, at each hex
+	void merge(const distance_field & other);
+
+	const std::vector<boost::uint32_t> & values() const { return values_; }
+
+private:
+	int x0_, y0_;
+	int w_, h_;
+	std::vector<boost::uint32_t> values_;
+};
+
+} // end namespace wesnoth
@@ -1,172 +1,1042 @@
 #include "game_data.hpp"
 #include "kernel.hpp"
+#include "string_utils.hpp"
+#include "vision.hpp"
 
+#include <algorithm>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <boost/bind.hpp>
 #include <boost/range/adaptor/map.hpp>
 #include <boost/range/algorithm/copy.hpp>
 
 namespace wesnoth {
 
-bool sides::are_allied(int a, int b) {
-	auto it = ally_cache_.find(std::make_pair(a,b));
-	if (it != ally_cache_.end()) {
-		return it->second;
+unit_state unit_table::state(size_t r) const {
+	unit_state s;
+	s.side = side[r];
+	s.hidden = hidden(r);
+	s.emits_zoc = emits_zoc(r);
+	s.movetype = movetype[r];
+	s.vision = vision[r];
+	s.jamming = jamming[r];
+	return s;
+}
+
+void unit_table::set(size_t r, const unit_state & s) {
+	side[r] = s.side;
+	flags[r] = (s.hidden ? HIDDEN : 0) | (s.emits_zoc ? EMITS_ZOC : 0);
+	movetype[r] = s.movetype;
+	vision[r] = s.vision;
+	jamming[r] = s.jamming;
+}
+
+void unit_table::push_back(const unit_rec & u, const unit_state & s) {
+	u.row_ = size();
+	rec.push_back(&u);
+	loc.push_back(u.loc_);
+	side.push_back(0);
+	flags.push_back(0);
+	movetype.push_back(0);
+	vision.push_back(0);
+	jamming.push_back(0);
+	set(u.row_, s);
+}
+
+void unit_table::erase(size_t r) {
+	size_t last = size() - 1;
+	if (r != last) {
+		rec[r] = rec[last];
+		loc[r] = loc[last];
+		side[r] = side[last];
+		flags[r] = flags[last];
+		movetype[r] = movetype[last];
+		vision[r] = vision[last];
+		jamming[r] = jamming[last];
+		rec[r]->row_ = r;
 	}
-	return ally_cache_[std::make_pair(a,b)] = ally_calculator_(a, b);
+	rec.pop_back();
+	loc.pop_back();
+	side.pop_back();
+	flags.pop_back();
+	movetype.pop_back();
+	vision.pop_back();
+	jamming.pop_back();
+}
+
+void unit_table::clear() {
+	rec.clear();
+	loc.clear();
+	side.clear();
+	flags.clear();
+	movetype.clear();
+	vision.clear();
+	jamming.clear();
 }
 
-typedef std::pair<map_location, pathing_node> heap_entry;
+unit_map::unit_map()
+	: units_()
+	, table_()
+	, x0_(0)
+	, y0_(0)
+	, width_(0)
+	, height_(0)
+	, slots_()
+{}
+
+unit_map::unit_map(const unit_map & other)
+	: units_(other.units_)
+	, table_(other.table_)
+	, x0_(0)
+	, y0_(0)
+	, width_(0)
+	, height_(0)
+	, slots_()
+{
+	set_area(other.x0_, other.y0_, other.width_, other.height_);
+}
 
-struct comp {
-	bool operator()(const heap_entry & a, const heap_entry & b) {
-		return a.second.turns_left > b.second.turns_left ||
-			(a.second.turns_left == b.second.turns_left && a.second.moves_left > b.second.moves_left);
+unit_map & unit_map::operator=(const unit_map & other) {
+	if (this != &other) {
+		units_ = other.units_;
+		table_ = other.table_;
+		set_area(other.x0_, other.y0_, other.width_, other.height_);
 	}
-};
+	return *this;
+}
 
-static path get_path(const shortest_path_tree & tree, map_location loc) {
-	auto it = tree.find(loc);
-	assert(it != tree.end());
-	std::pair<map_location, pathing_node> pos = *it;
-	path ret(1, pos.first);
-	while (!(pos.second.pred == pos.first)) {
-		ret.push_back(pos.second.pred);
-		auto it = tree.find(pos.second.pred);
-		assert(it != tree.end());
-		pos = *it;
+std::pair<unit_map::iterator, bool> unit_map::insert(const unit_rec & u, const unit_state & s) {
+	std::pair<iterator, bool> ret = units_.insert(u);
+	if (ret.second) {
+		table_.push_back(*ret.first, s);
+		occupy(*ret.first);
 	}
 	return ret;
 }
 
-// Tries to find a match for a visible enemy at some position with respect to a pathing query
-static const unit_rec * get_visible_enemy(map_location neighbor, const pathfind_context::pathing_query & query, bool must_exert_zoc) {
-	unit_map::index<by_loc>::type & u_map = query.units->get<by_loc>();
-	sides & sides = *query.sides_;
-	auto u_it = u_map.find(neighbor);
+bool unit_map::move(iterator it, map_location to) {
+	if (it->loc_ == to) {
+		return true;
+	}
+	if (count(to)) {
+		return false;
+	}
+	return modify(it, [to](unit_rec & u) { u.loc_ = to; });
+}
+
+unit_map::iterator unit_map::erase(iterator it) {
+	vacate(*it);
+	table_.erase(it->row_);
+	return units_.erase(it);
+}
 
-	if (u_it == u_map.end()) { 
-		return NULL;
+size_t unit_map::erase(int id) {
+	iterator it = units_.find(id);
+	if (it == units_.end()) {
+		return 0;
 	}
+	erase(it);
+	return 1;
+}
+
+void unit_map::clear() {
+	units_.clear();
+	table_.clear();
+	slots_.assign(slots_.size(), NULL);
+}
 
-	const unit_rec & u = *u_it;
-	if (u.dirty_) {
-		u.update();
+void unit_map::set_area(int x0, int y0, int width, int height) {
+	x0_ = x0;
+	y0_ = y0;
+	width_ = std::max(width, 0);
+	height_ = std::max(height, 0);
+	slots_.assign(static_cast<size_t>(width_) * height_, NULL);
+	BOOST_FOREACH(const unit_rec & u, units_) {
+		table_.rec[u.row_] = &u; // after a copy, the rows still point into the other map
+		occupy(u);
 	}
+}
 
-	if (u.loc_ == neighbor && // if it did not move during update
-		(!must_exert_zoc || u.emits_zoc_) && // check the must_exert_zoc flag
-		!sides.are_allied(u.side_, *query.moving_side)) // only enemy units block this unit
-	{
-		if (!query.viewing_side) { // the blocker is definitely visible since we see all
-			return & u;
+void unit_map::occupy(const unit_rec & u) {
+	int i = slot(u.loc_);
+	if (i >= 0) {
+		slots_[i] = &u;
+	}
+}
+
+void unit_map::vacate(const unit_rec & u) {
+	int i = slot(u.loc_);
+	if (i >= 0 && slots_[i] == &u) {
+		slots_[i] = NULL;
+	}
+}
+
+void sides::set_teams(int side, const std::string & teams) {
+	if (side < 1 || side > MAX_SIDES) {
+		return;
+	}
+	if (teams_.size() < static_cast<size_t>(side)) {
+		teams_.resize(side);
+	}
+	teams_[side - 1] = string_utils::split(teams);
+	allies_valid_ = false;
+	invalidate_views();
+}
+
+void sides::rebuild_allies() {
+	// The members of each team, then each side is allied with the members of its teams
+	std::map<std::string, boost::uint64_t> members;
+	for (size_t k = 0; k < teams_.size(); ++k) {
+		BOOST_FOREACH(const std::string & t, teams_[k]) {
+			members[t] |= boost::uint64_t(1) << k;
 		}
-		// we don't see all so check if the blocker is actually visible
-		if ((!u.hidden_ || sides.are_allied(u.side_, *query.viewing_side))
-				&& !sides.ally_adjusted_fog(neighbor, *query.viewing_side)) {
-			return & u;
+	}
+	for (int k = 0; k < MAX_SIDES; ++k) {
+		allies_[k] = boost::uint64_t(1) << k;
+		if (static_cast<size_t>(k) < teams_.size()) {
+			BOOST_FOREACH(const std::string & t, teams_[k]) {
+				allies_[k] |= members[t];
+			}
 		}
 	}
-	return NULL;
+	allies_valid_ = true;
 }
 
-shortest_path_tree pathfind_context::compute_tree(const pathfind_context::pathing_query & query, boost::optional<map_location> destination) {
-	shortest_path_tree result;
+////
+// sides: shroud and fog planes
+////
+
+void sides::resize_planes(int x0, int y0, int w, int h) {
+	hex_bitset bounds(x0, y0, w, h);
+	BOOST_FOREACH(vision_planes & p, planes_) {
+		hex_bitset * planes[] = { &p.shroud, &p.fog, &p.has_override, &p.override_fog };
+		BOOST_FOREACH(hex_bitset * plane, planes) {
+			hex_bitset resized(x0, y0, w, h);
+			plane->for_each([&](map_location l) {
+				if (resized.index(l) >= 0) {
+					resized.set(l);
+				}
+			});
+			*plane = resized;
+		}
+	}
+	bounds_ = bounds;
+	invalidate_views();
+}
+
+sides::vision_planes & sides::planes_for(int side) {
+	assert(side >= 0);
+	if (static_cast<size_t>(side) >= planes_.size()) {
+		vision_planes empty;
+		empty.shroud = empty.fog = empty.has_override = empty.override_fog = make_plane();
+		planes_.resize(side + 1, empty);
+	}
+	return planes_[side];
+}
+
+sides::vision_planes & sides::planes_for(int side, map_location l) {
+	if (bounds_.index(l) < 0) {
+		// Take in the hex, with some room so that the hexes around it don't each grow the planes again
+		int x0 = l.x - 8, y0 = l.y - 8, x1 = l.x + 9, y1 = l.y + 9;
+		if (bounds_.size()) {
+			x0 = std::min(x0, bounds_.x0());
+			y0 = std::min(y0, bounds_.y0());
+			x1 = std::max(x1, bounds_.x0() + bounds_.width());
+			y1 = std::max(y1, bounds_.y0() + bounds_.height());
+		}
+		resize_planes(x0, y0, x1 - x0, y1 - y0);
+	}
+	return planes_for(side);
+}
 
-	std::deque<heap_entry> priority_queue(1, heap_entry(query.start, pathing_node(query.moves, query.turns, query.start)));
+////
+// sides: what each side sees with its allies
+////
 
-	comp heap_comparator;
+// acc &= a, word by word
+static void and_words(boost::uint64_t * acc, const boost::uint64_t * a, size_t n) {
+	size_t k = 0;
+#ifdef __SSE2__
+	for (; k + 2 <= n; k += 2) {
+		__m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(acc + k));
+		__m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a + k));
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(acc + k), _mm_and_si128(x, y));
+	}
+#endif
+	for (; k < n; ++k) {
+		acc[k] &= a[k];
+	}
+}
+
+// acc &= the fog where it isn't overridden, and the override where it is
+static void and_fog_words(boost::uint64_t * acc, const boost::uint64_t * fog, const boost::uint64_t * has_override, const boost::uint64_t * override_fog, size_t n) {
+	size_t k = 0;
+#ifdef __SSE2__
+	for (; k + 2 <= n; k += 2) {
+		__m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(acc + k));
+		__m128i f = _mm_loadu_si128(reinterpret_cast<const __m128i *>(fog + k));
+		__m128i h = _mm_loadu_si128(reinterpret_cast<const __m128i *>(has_override + k));
+		__m128i o = _mm_loadu_si128(reinterpret_cast<const __m128i *>(override_fog + k));
+		__m128i adjusted = _mm_or_si128(_mm_andnot_si128(h, f), _mm_and_si128(h, o));
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(acc + k), _mm_and_si128(x, adjusted));
+	}
+#endif
+	for (; k < n; ++k) {
+		acc[k] &= (fog[k] & ~has_override[k]) | (has_override[k] & override_fog[k]);
+	}
+}
+
+const sides::view & sides::get_view(int viewing_side) {
+	assert(viewing_side >= 0);
+	if (static_cast<size_t>(viewing_side) >= views_.size()) {
+		views_.resize(viewing_side + 1);
+	}
+	view & v = views_[viewing_side];
+	if (v.valid) {
+		return v;
+	}
+
+	v.valid = true;
+	v.inputs.assign(1, viewing_side);
+	v.shroud = make_plane();
+	v.fog = make_plane();
+	const size_t n = v.shroud.words().size();
+	const vision_planes * p = planes_of(viewing_side);
+	if (!n || !p) {
+		return v; // nothing is shrouded or fogged yet
+	}
+	v.shroud = p->shroud;
+	v.fog.fill();
+	and_fog_words(&v.fog.words()[0], &p->fog.words()[0], &p->has_override.words()[0], &p->override_fog.words()[0], n);
+
+	BOOST_FOREACH(const share_table::value_type & t, share_maps_) {
+		if (t.second && t.first != viewing_side && are_allied(viewing_side, t.first)) {
+			v.inputs.push_back(t.first);
+			p = planes_of(t.first);
+			p ? and_words(&v.shroud.words()[0], &p->shroud.words()[0], n) : v.shroud.clear();
+		}
+	}
+	BOOST_FOREACH(const share_table::value_type & t, share_vision_) {
+		if (t.second && t.first != viewing_side && are_allied(viewing_side, t.first)) {
+			v.inputs.push_back(t.first);
+			p = planes_of(t.first);
+			p ? and_fog_words(&v.fog.words()[0], &p->fog.words()[0], &p->has_override.words()[0], &p->override_fog.words()[0], n) : v.fog.clear();
+		}
+	}
+	return v;
+}
+
+void sides::planes_changed(int side) {
+	BOOST_FOREACH(view & v, views_) {
+		if (v.valid && std::find(v.inputs.begin(), v.inputs.end(), side) != v.inputs.end()) {
+			v.valid = false;
+		}
+	}
+}
+
+void sides::invalidate_views() {
+	BOOST_FOREACH(view & v, views_) {
+		v.valid = false;
+	}
+}
+
+void sides::set_shroud(map_location l, int s, bool b) {
+	vision_planes & p = planes_for(s, l);
+	b ? p.shroud.set(l) : p.shroud.reset(l);
+	planes_changed(s);
+}
+
+void sides::set_fog(map_location l, int s, bool b) {
+	vision_planes & p = planes_for(s, l);
+	b ? p.fog.set(l) : p.fog.reset(l);
+	planes_changed(s);
+}
+
+void sides::set_fog_override(map_location l, int s, boost::optional<bool> b) {
+	if (!b && !get_fog_override(l, s)) {
+		return;
+	}
+	vision_planes & p = planes_for(s, l);
+	b ? p.has_override.set(l) : p.has_override.reset(l);
+	b && *b ? p.override_fog.set(l) : p.override_fog.reset(l);
+	planes_changed(s);
+}
+
+void sides::clear_fog_overrides(int s) {
+	if (s >= 0 && static_cast<size_t>(s) < planes_.size()) {
+		planes_[s].has_override.clear();
+		planes_[s].override_fog.clear();
+		planes_changed(s);
+	}
+}
+
+void sides::place_shroud(int s, const hex_bitset & hexes) {
+	planes_for(s).shroud |= hexes;
+	planes_changed(s);
+}
+
+void sides::remove_shroud(int s, const hex_bitset & hexes) {
+	planes_for(s).shroud.subtract(hexes);
+	planes_changed(s);
+}
 
-	assert(query.sides_);
-	sides & sides = *query.sides_;
+void sides::place_fog(int s, const hex_bitset & hexes) {
+	planes_for(s).fog |= hexes;
+	planes_changed(s);
+}
+
+void sides::remove_fog(int s, const hex_bitset & hexes) {
+	planes_for(s).fog.subtract(hexes);
+	planes_changed(s);
+}
 
-	while (!priority_queue.empty()) {
-		heap_entry he = priority_queue.front();
-		const map_location & loc = he.first;
+////
+// cost_grid
+////
 
-		if (destination && *destination == loc) {
-			// If we actually have a destination and we find it in the shortest path tree, we can skip the rest of the computation.
-			shortest_path_tree new_result;
-			std::pair<map_location, pathing_node> pos = he;
+cost_grid::cost_grid(const terrain_cost_fcn & f)
+	: fcn_(f)
+	, known_()
+	, by_code_()
+	, costs_()
+	, valid_(false)
+{
+	std::fill(histogram_, histogram_ + MAX_COST + 1, 0);
+}
 
-			while(!(pos.second.pred == pos.first)) {
-				new_result.insert(pos);
-				auto it = result.find(pos.second.pred);
-				assert(it != result.end());
-				pos = *it;
+unsigned char cost_grid::lookup(const terrain_id & t) {
+	auto it = known_.find(t);
+	if (it != known_.end()) {
+		return it->second;
+	}
+	size_t cost = std::min<size_t>(fcn_(t), MAX_COST);
+	return known_[t] = static_cast<unsigned char>(cost);
+}
+
+unsigned char cost_grid::lookup(terrain_code c, const terrain_codes & codes) {
+	if (c >= by_code_.size()) {
+		by_code_.resize(codes.size(), -1);
+	}
+	if (by_code_[c] < 0) {
+		by_code_[c] = lookup(codes.name(c));
+	}
+	return static_cast<unsigned char>(by_code_[c]);
+}
+
+void cost_grid::build(const terrain_map & m, const grid_layout & layout) {
+	costs_.assign(layout.size(), MAX_COST);
+	std::fill(histogram_, histogram_ + MAX_COST + 1, 0);
+	BOOST_FOREACH(const terrain_map::value_type & v, m) {
+		unsigned char c = lookup(v.second);
+		costs_[layout.index(v.first)] = c;
+		++histogram_[c];
+	}
+	valid_ = true;
+}
+
+void cost_grid::build(const terrain_grid & m, const grid_layout & layout) {
+	costs_.assign(layout.size(), MAX_COST);
+	std::fill(histogram_, histogram_ + MAX_COST + 1, 0);
+	m.for_each([&](map_location loc, terrain_code c) {
+		unsigned char cost = lookup(c, m.codes());
+		costs_[layout.index(loc)] = cost;
+		++histogram_[cost];
+	});
+	valid_ = true;
+}
+
+void cost_grid::update(int i, const terrain_id & t) {
+	--histogram_[costs_[i]];
+	costs_[i] = lookup(t);
+	++histogram_[costs_[i]];
+}
+
+void cost_grid::update(int i, terrain_code c, const terrain_codes & codes) {
+	--histogram_[costs_[i]];
+	costs_[i] = lookup(c, codes);
+	++histogram_[costs_[i]];
+}
+
+size_t cost_grid::min_cost() const {
+	for (size_t c = 0; c < MAX_COST; ++c) {
+		if (histogram_[c]) {
+			return c;
+		}
+	}
+	return MAX_COST;
+}
+
+////
+// reachable_paths
+////
+
+int reachable_paths::find(map_location loc) const {
+	std::vector<map_location>::const_iterator it = std::lower_bound(locs_.begin(), locs_.end(), loc);
+	if (it == locs_.end() || !(*it == loc)) {
+		return -1;
+	}
+	return static_cast<int>(it - locs_.begin());
+}
+
+path reachable_paths::get_path(size_t n) const {
+	path ret;
+	ret.reserve(length_[n]);
+	walk_path(n, [&](map_location loc) { ret.push_back(loc); });
+	return ret;
+}
+
+void reachable_paths::all_paths(std::vector<map_location> & buffer, std::vector<size_t> & offsets) const {
+	offsets.resize(size() + 1);
+	size_t total = 0;
+	for (size_t n = 0; n < size(); ++n) {
+		offsets[n] = total;
+		total += length_[n];
+	}
+	offsets[size()] = total;
+
+	buffer.resize(total);
+	for (size_t n = 0; n < size(); ++n) {
+		map_location * out = buffer.empty() ? NULL : &buffer[offsets[n]];
+		walk_path(n, [&](map_location loc) { *out++ = loc; });
+	}
+}
+
+// Facts about a cell with respect to a query, cached in pathing_scratch::facts
+enum {
+	KNOWN = 1,        // the cost and the following flag are set
+	SHROUDED = 2
+};
+
+class pathfind_context::step_rules {
+public:
+	static const size_t NONE = static_cast<size_t>(-1);
+
+	step_rules(const pathing_query & query, pathing_scratch & s, const side_masks & masks, const grid_layout & layout)
+		: query_(query)
+		, s_(s)
+		, masks_(masks)
+		, layout_(layout)
+		, costs_(query.costs)
+		, first_turn_costs_(query.first_turn_override_costs)
+		, first_turn_override_(query.first_turn_override_costs || query.first_turn_override_cost_map)
+		, K_(s.key_base)
+		, T_(query.turns)
+	{
+		assert(!costs_ || (costs_->valid() && costs_->size() == layout_.size()));
+		assert(!first_turn_costs_ || (first_turn_costs_->valid() && first_turn_costs_->size() == layout_.size()));
+	}
+
+	// The key on entering the on-map cell j with some turns and moves left, or NONE if that isn't possible
+	size_t enter(size_t turns_left, size_t moves_left, int j) {
+		unsigned char f = facts(j);
+		if (f & SHROUDED) {
+			return NONE;
+		}
+
+		size_t cost_of_move;
+		bool used_first_turn_override = false;
+
+		if (first_turn_override_ && turns_left == T_) {
+			cost_of_move = first_turn_cost(j);
+			used_first_turn_override = true;
+		} else {
+			cost_of_move = cost(j);
+		}
+
+		size_t tl = turns_left;
+		size_t ml = moves_left;
+
+		if (cost_of_move > ml && tl > 0) {
+			tl--;
+			ml = query_.max_moves;
+			if (used_first_turn_override) { //recalculate cost since we had to end the turn
+				cost_of_move = cost(j);
 			}
+		}
+
+		if (cost_of_move > ml) {
+			return NONE; // we can't actually afford to make the move at all, even after possibly refreshing the moves for a turn
+		}
+		ml -= cost_of_move;
 
-			new_result.insert(pos); // we need to insert the final self loop node as well to preserve the invariant of the data structure
-			return new_result;
+		if (masks_.enemy.test(static_cast<size_t>(j))) {
+			return NONE;
+		}
+		if (!query_.ignore_zoc && ml > 0 && masks_.zoc.test(static_cast<size_t>(j))) {
+			ml = 0;
 		}
 
-		result.insert(he);
+		return (T_ - tl) * K_ + (K_ - 1 - ml);
+	}
 
-		std::pop_heap(priority_queue.begin(), priority_queue.end(), heap_comparator); priority_queue.pop_back();
+	size_t enter(size_t key, int j) {
+		return enter(T_ - key / K_, K_ - 1 - key % K_, j);
+	}
 
-		BOOST_FOREACH(map_location neighbor, geom_.neighbors(loc)) {
-			if (result.find(neighbor) != result.end()) {
-				continue; //skip nodes that we already processed
+private:
+	// The cost of entering a cell and whether that's possible at all are looked up once per query, rather than once per edge.
+	unsigned char facts(int j) {
+		unsigned char & f = s_.facts(j);
+		if (!(f & KNOWN)) {
+			f |= KNOWN;
+			if (masks_.shrouded.test(static_cast<size_t>(j))) {
+				f |= SHROUDED;
+			} else {
+				map_location loc = layout_.location(j);
+				if (!costs_) {
+					s_.cost[j] = query_.cost_map ? (*query_.cost_map)(loc) : 1;
+				}
+				if (!first_turn_costs_ && query_.first_turn_override_cost_map) {
+					s_.first_turn_cost[j] = (*query_.first_turn_override_cost_map)(loc);
+				}
 			}
+		}
+		return f;
+	}
+
+	size_t cost(int j) const {
+		return costs_ ? (*costs_)[j] : s_.cost[j];
+	}
+	size_t first_turn_cost(int j) const {
+		return first_turn_costs_ ? (*first_turn_costs_)[j] : s_.first_turn_cost[j];
+	}
+
+	const pathing_query & query_;
+	pathing_scratch & s_;
+	const side_masks & masks_;
+	const grid_layout & layout_;
+	const cost_grid * costs_;
+	const cost_grid * first_turn_costs_;
+	const bool first_turn_override_;
+	const size_t K_, T_;
+};
 
-			assert(query.tmap_);
-			if (query.tmap_->find(neighbor) == query.tmap_->end()) {
-				continue; // skip nodes that are off map
+void pathfind_context::search(const pathfind_context::pathing_query & query, boost::optional<map_location> destination, pathing_scratch & s, const side_masks & masks, const std::vector<map_location> * sources) {
+	assert(query.tmap_ || query.terrain_);
+
+	s.begin(layout_.size());
+	s.key_base = std::max(query.moves, query.max_moves) + 1;
+	s.turns = query.turns;
+
+	const size_t K = s.key_base;
+	const size_t T = query.turns;
+
+	int start = -1;
+	if (sources) {
+		BOOST_FOREACH(map_location loc, *sources) {
+			start = std::max(start, layout_.index(loc));
+		}
+	} else {
+		start = layout_.index(query.start);
+	}
+	if (start < 0) {
+		return;
+	}
+	int dest = destination ? layout_.index(*destination) : -1;
+
+	// Given a destination, the queue is ordered by key plus a lower bound on the key still to be spent (A*).
+	// The hexes left to go cost at least min_cost each, and whatever doesn't fit in the moves left this turn
+	// takes whole turns of max_moves, each of which also skips the K - max_moves keys that no move reaches.
+	// The bound is consistent, so nodes are still final once they are popped, and the result is exact.
+	const cost_grid * costs = query.costs;
+	const cost_grid * first_turn_costs = query.first_turn_override_costs;
+	const bool first_turn_override = first_turn_costs || query.first_turn_override_cost_map;
+
+	size_t least_cost = 1;
+	if (costs && (first_turn_costs || !first_turn_override)) {
+		least_cost = std::min(costs->min_cost(), first_turn_costs ? first_turn_costs->min_cost() : costs->min_cost());
+	}
+	const size_t min_cost = dest < 0 ? 0 : (query.min_move_cost ? *query.min_move_cost : least_cost);
+	const size_t exit_dist = min_cost ? exit_distance(*destination) : 0;
+	const size_t M = query.max_moves;
+
+	auto steps_to_go = [&](int j) -> size_t {
+		return min_cost ? step_bound(j, dest, *destination, exit_dist) : 0;
+	};
+	auto priority = [&](int j, size_t key) -> size_t {
+		size_t to_spend = s.bound[j] * min_cost;
+		size_t moves_left = K - 1 - key % K;
+		if (to_spend <= moves_left || M == 0) {
+			return key + to_spend;
+		}
+		size_t new_turns = (to_spend - moves_left + M - 1) / M;
+		return key + to_spend + new_turns * (K - M);
+	};
+
+	// A step adds less than 2K to the key, and the bound by less than another 2K + min_cost, unless it goes
+	// through a tunnel: then the bound can grow up to its value at the tunnel exit.
+	size_t span = 2 * K + (min_cost ? 2 * K + min_cost : 0);
+	if (min_cost) {
+		BOOST_FOREACH(const neighbor_map::value_type & t, tunnels_) {
+			BOOST_FOREACH(map_location x, t.second) {
+				int j = layout_.index(x);
+				size_t to_spend = min_cost * (j >= 0 ? step_bound(j, dest, *destination, exit_dist) : tunnel_bound(x, *destination, exit_dist));
+				span = std::max(span, 4 * K + to_spend + (M ? to_spend / M + 1 : 0) * K);
 			}
+		}
+	}
 
-			if(query.viewing_side) {
-				if (sides.ally_adjusted_shroud(neighbor, *query.viewing_side)) {
-					continue; // skip shrouded nodes
-				}
+	step_rules rules(query, s, masks, layout_);
+
+	auto seed = [&](int i) {
+		grid_node & first = s.nodes[i];
+		first.key = K - 1 - query.moves;
+		first.pred = i;
+		s.bound[i] = steps_to_go(i);
+		s.mark_seen(i);
+		s.queue.push(priority(i, first.key), i);
+	};
+
+	if (sources) {
+		assert(!destination);
+		s.queue.reset(span, K - 1 - query.moves);
+		BOOST_FOREACH(map_location loc, *sources) {
+			int i = layout_.index(loc);
+			if (i >= 0 && !s.seen(i)) {
+				seed(i);
 			}
+		}
+	} else {
+		s.bound[start] = steps_to_go(start);
+		s.queue.reset(span, priority(start, K - 1 - query.moves));
+		seed(start);
+	}
 
-			size_t cost_of_move;
+	size_t popped;
+	int i;
+	while (s.queue.pop(popped, i)) {
+		if (s.done(i) || priority(i, s.nodes[i].key) != popped) {
+			continue; // a stale entry, this node was reached more cheaply since
+		}
+		s.mark_done(i);
 
-			bool used_first_turn_override = false;
+		if (i == dest) {
+			return;
+		}
 
-			if (query.first_turn_override_cost_map && (he.second.turns_left == query.turns)) {// check our node to see if it is still the first turn 
-				cost_of_move = (*query.first_turn_override_cost_map)(neighbor);
-				used_first_turn_override = true;
-			} else {
-				cost_of_move = (query.cost_map ? (*query.cost_map)(neighbor) : 1);
+		const size_t key = s.nodes[i].key;
+		const size_t turns_left = T - key / K;
+		const size_t moves_left = K - 1 - key % K;
+
+		layout_.for_each_neighbor(i, [&](int j) {
+			if (!layout_.on_map(j) || s.done(j)) {
+				return;
 			}
 
-			size_t turns_left = he.second.turns_left;
-			size_t moves_left = he.second.moves_left;
+			size_t new_key = rules.enter(turns_left, moves_left, j);
+			if (new_key == step_rules::NONE) {
+				return;
+			}
 
-			if (cost_of_move > moves_left && turns_left > 0) {
-				turns_left--;
-				moves_left = query.max_moves;
-				if (used_first_turn_override) { //recalculate cost since we had to end the turn
-					cost_of_move = (query.cost_map ? (*query.cost_map)(neighbor) : 1);
-				}
+			grid_node & n = s.nodes[j];
+			if (!s.seen(j)) {
+				s.mark_seen(j);
+				s.bound[j] = steps_to_go(j);
+			} else if (new_key >= n.key) {
+				return;
 			}
+			n.key = new_key;
+			n.pred = i;
+			s.queue.push(priority(j, new_key), j);
+		});
+	}
+}
+
+shortest_path_tree pathfind_context::compute_tree(const pathfind_context::pathing_query & query, boost::optional<map_location> destination) {
+	ensure_layout(query);
+	if (destination) {
+		ensure_oracle();
+	}
+	search(query, destination, scratch_, get_side_masks(query.moving_side, query.viewing_side, query));
 
-			if (cost_of_move > moves_left) {
-				continue; // we can't actually afford to make the move at all, even after possibly refreshing the moves for a turn
+	int dest = destination ? layout_.index(*destination) : -1;
+	if (dest < 0 || !scratch_.done(dest)) {
+		return tree_from(scratch_, query);
+	}
+
+	// We found the destination, so we skipped the rest of the computation. Keep only the path to it.
+	const pathing_scratch & s = scratch_;
+	shortest_path_tree result;
+	auto add_node = [&](int i) {
+		const grid_node & n = s.nodes[i];
+		result.insert(std::make_pair(layout_.location(i), pathing_node(s.moves_left(n), s.turns_left(n), layout_.location(n.pred))));
+	};
+	int i = dest;
+	while (s.nodes[i].pred != i) {
+		add_node(i);
+		i = s.nodes[i].pred;
+	}
+	add_node(i); // we need to insert the final self loop node as well to preserve the invariant of the data structure
+	return result;
+}
+
+shortest_path_tree pathfind_context::tree_from(const pathing_scratch & s, const pathing_query & query) {
+	shortest_path_tree result;
+	if (layout_.index(query.start) < 0) {
+		result.insert(std::make_pair(query.start, pathing_node(query.moves, query.turns, query.start)));
+		return result;
+	}
+	for (int i = 0; i < static_cast<int>(layout_.size()); ++i) {
+		if (s.done(i)) {
+			const grid_node & n = s.nodes[i];
+			result.insert(result.end(), std::make_pair(layout_.location(i), pathing_node(s.moves_left(n), s.turns_left(n), layout_.location(n.pred))));
+		}
+	}
+	return result;
+}
+
+reachable_paths pathfind_context::paths_from(const pathing_scratch & s, const pathing_query & query) {
+	reachable_paths result;
+	if (layout_.index(query.start) < 0) {
+		result.locs_.push_back(query.start);
+		result.pred_.push_back(0);
+		result.length_.push_back(1);
+		return result;
+	}
+
+	// Number the hexes reached column by column, which is the order of their locations
+	std::vector<size_t> & number = path_numbers_;
+	number.resize(layout_.size());
+	for (int c = 0; c < layout_.stride(); ++c) {
+		for (int i = c; i < static_cast<int>(layout_.size()); i += layout_.stride()) {
+			if (s.done(i)) {
+				number[i] = result.locs_.size();
+				result.locs_.push_back(layout_.location(i));
 			}
-			moves_left = moves_left - cost_of_move;
+		}
+	}
 
-			// If we should think of the move as being done by a unit as some side, and check for blockers / zocs
-			if (query.moving_side) {
-				if (get_visible_enemy(neighbor, query, false)) {
-					continue;
-				}
-				// If our unit can get zocced, check if it will be by this move
-				if (!query.ignore_zoc && moves_left > 0) {
-					BOOST_FOREACH(map_location neighbor2, geom_.neighbors(neighbor)) {
-						if (get_visible_enemy(neighbor2, query, true)) {
-							moves_left = 0;
-							break;
-						}
-					}
+	const size_t n = result.locs_.size();
+	result.pred_.resize(n);
+	for (size_t k = 0; k < n; ++k) {
+		result.pred_[k] = number[s.nodes[layout_.index(result.locs_[k])].pred];
+	}
+
+	// The length of a path is one more than that of its predecessor's; go up to the first hex whose length is known
+	result.length_.assign(n, 0);
+	std::vector<size_t> & stack = path_stack_;
+	for (size_t k = 0; k < n; ++k) {
+		size_t m = k;
+		while (!result.length_[m] && result.pred_[m] != m) {
+			stack.push_back(m);
+			m = result.pred_[m];
+		}
+		if (!result.length_[m]) {
+			result.length_[m] = 1;
+		}
+		for (; !stack.empty(); stack.pop_back()) {
+			result.length_[stack.back()] = result.length_[result.pred_[stack.back()]] + 1;
+		}
+	}
+	return result;
+}
+
+////
+// distance fields
+////
+
+void pathfind_context::add_to_field(const pathing_scratch & s, const pathing_query & query, distance_field & field) {
+	for (int i = 0; i < static_cast<int>(layout_.size()); ++i) {
+		if (s.done(i)) {
+			const grid_node & n = s.nodes[i];
+			field[i] = std::min(field[i], distance_field::encode(query.turns - s.turns_left(n) + 1, s.moves_left(n)));
+		}
+	}
+}
+
+distance_field pathfind_context::distance_field_from(const std::vector<map_location> & sources, const pathing_query & query) {
+	ensure_layout(query);
+	search(query, boost::none, scratch_, get_side_masks(query.moving_side, query.viewing_side, query), &sources);
+
+	distance_field result = layout_.make_field();
+	add_to_field(scratch_, query, result);
+	return result;
+}
+
+distance_field pathfind_context::merged_distance_field(const std::vector<pathing_query> & queries, thread_pool * pool) {
+	if (queries.empty()) {
+		return distance_field();
+	}
+	ensure_layout(queries.front());
+
+	// The masks are all computed here, so that the searches only read them
+	std::vector<const side_masks *> masks;
+	BOOST_FOREACH(const pathing_query & q, queries) {
+		assert(q.tmap_ == queries.front().tmap_ && q.terrain_ == queries.front().terrain_ && q.units == queries.front().units && q.sides_ == queries.front().sides_);
+		masks.push_back(&get_side_masks(q.moving_side, q.viewing_side, q));
+	}
+
+	// Each worker keeps the earliest arrivals of its own searches, then those are merged
+	const size_t workers = pool ? pool->size() : 1;
+	if (worker_scratch_.size() < workers) {
+		worker_scratch_.resize(workers);
+	}
+	std::vector<distance_field> fields(workers, layout_.make_field());
+
+	auto body = [&](size_t n, size_t w) {
+		search(queries[n], boost::none, worker_scratch_[w], *masks[n]);
+		add_to_field(worker_scratch_[w], queries[n], fields[w]);
+	};
+
+	if (pool) {
+		pool->parallel_for(queries.size(), body);
+	} else {
+		for (size_t n = 0; n < queries.size(); ++n) {
+			body(n, 0);
+		}
+	}
+
+	for (size_t w = 1; w < workers; ++w) {
+		fields[0].merge(fields[w]);
+	}
+	return fields[0];
+}
+
+////
+// dynamic_tree
+////
+
+pathfind_context::dynamic_tree::dynamic_tree()
+	: query_()
+	, scratch_()
+	, layout_version_(0)
+	, first_child_()
+	, next_sibling_()
+	, stack_()
+	, candidates_()
+{
+}
+
+void pathfind_context::build_tree(const pathing_query & query, dynamic_tree & out) {
+	ensure_layout(query);
+	out.query_ = query;
+	out.layout_version_ = layout_version_;
+	search(out.query_, boost::none, out.scratch_, get_side_masks(query.moving_side, query.viewing_side, query));
+}
+
+shortest_path_tree pathfind_context::get_tree(const dynamic_tree & t) {
+	assert(t.layout_version_ == layout_version_);
+	return tree_from(t.scratch_, t.query_);
+}
+
+void pathfind_context::repair_tree(dynamic_tree & t, const std::vector<map_location> & changed) {
+	const pathing_query & query = t.query_;
+	ensure_layout(query);
+	if (t.layout_version_ != layout_version_) {
+		build_tree(pathing_query(query), t);
+		return;
+	}
+
+	pathing_scratch & s = t.scratch_;
+	const int start = layout_.index(query.start);
+	if (start < 0) {
+		return;
+	}
+	step_rules rules(query, s, get_side_masks(query.moving_side, query.viewing_side, query), layout_);
+	const int n = static_cast<int>(layout_.size());
+
+	// The cells whose steps in changed: those listed, for the units and terrain on them, and their neighbors, for zoc
+	std::vector<int> & candidates = t.candidates_;
+	candidates.clear();
+	BOOST_FOREACH(map_location loc, changed) {
+		int i = layout_.index(loc);
+		if (i < 0) {
+			continue;
+		}
+		s.forget_facts(i);
+		if (layout_.on_map(i)) {
+			candidates.push_back(i);
+			layout_.for_each_adjacent(i, [&](int j) {
+				if (layout_.on_map(j)) {
+					candidates.push_back(j);
 				}
+			});
+		}
+	}
+
+	// Tear down the subtrees hanging from them, which may have been reached more cheaply than they can be now
+	t.first_child_.assign(n, -1);
+	t.next_sibling_.resize(n);
+	for (int i = 0; i < n; ++i) {
+		if (s.done(i) && s.nodes[i].pred != i) {
+			int p = s.nodes[i].pred;
+			t.next_sibling_[i] = t.first_child_[p];
+			t.first_child_[p] = i;
+		}
+	}
+	std::vector<int> & stack = t.stack_;
+	stack.clear();
+	BOOST_FOREACH(int i, candidates) {
+		if (i != start && s.done(i)) {
+			s.unmark(i);
+			stack.push_back(i);
+		}
+	}
+	while (!stack.empty()) {
+		int i = stack.back();
+		stack.pop_back();
+		for (int c = t.first_child_[i]; c >= 0; c = t.next_sibling_[c]) {
+			if (s.done(c)) {
+				s.unmark(c);
+				stack.push_back(c);
+				candidates.push_back(c);
+			}
+		}
+	}
+
+	// Each cell torn down starts over from its best step in from the rest of the tree. Those still reached
+	// then grow back with dijkstra, and take over any part of the rest of the tree they reach more cheaply.
+	const size_t K = s.key_base;
+	s.queue.reset((query.turns + 2) * K);
+	BOOST_FOREACH(int j, candidates) {
+		if (j == start || s.done(j)) {
+			continue;
+		}
+		layout_.for_each_predecessor(j, [&](int i) {
+			if (!layout_.on_map(i) || !s.done(i)) {
+				return;
+			}
+			size_t key = rules.enter(s.nodes[i].key, j);
+			if (key != step_rules::NONE && (!s.seen(j) || key < s.nodes[j].key)) {
+				s.mark_seen(j);
+				s.nodes[j].key = key;
+				s.nodes[j].pred = i;
 			}
+		});
+		if (s.seen(j)) {
+			s.queue.push(s.nodes[j].key, j);
+		}
+	}
 
-			pathing_node node(moves_left, turns_left, loc);
-			priority_queue.push_back(std::make_pair(neighbor, node));
-			std::push_heap(priority_queue.begin(), priority_queue.end(), heap_comparator);
+	size_t popped;
+	int i;
+	while (s.queue.pop(popped, i)) {
+		if (s.done(i) || s.nodes[i].key != popped) {
+			continue;
 		}
+		s.mark_done(i);
+
+		const size_t key = s.nodes[i].key;
+		layout_.for_each_neighbor(i, [&](int j) {
+			if (!layout_.on_map(j) || j == start) {
+				return;
+			}
+			size_t new_key = rules.enter(key, j);
+			if (new_key == step_rules::NONE || (s.seen(j) && new_key >= s.nodes[j].key)) {
+				return;
+			}
+			if (s.done(j)) {
+				s.unmark(j); // a cheaper way into the rest of the tree, it needs to be expanded again
+			}
+			s.mark_seen(j);
+			s.nodes[j].key = new_key;
+			s.nodes[j].pred = i;
+			s.queue.push(new_key, j);
+		});
 	}
-	return result;
 }
 
 loc_set pathfind_context::reachable_hexes(const pathfind_context::pathing_query & query) {
@@ -175,27 +1045,462 @@ loc_set pathfind_context::reachable_hexes(const pathfind_context::pathing_query
 	return result;
 }
 
-std::vector<path> pathfind_context::reachable_hexes_with_paths(const pathfind_context::pathing_query & query) {
-	std::vector<path> result;
-	shortest_path_tree tree = compute_tree(query);
-	BOOST_FOREACH(const shortest_path_tree::value_type & v, tree) {
-		result.push_back(get_path(tree, v.first));
+void pathfind_context::reachable_hexes(const pathfind_context::pathing_query & query, hex_bitset & out) {
+	ensure_layout(query);
+	search(query, boost::none, scratch_, get_side_masks(query.moving_side, query.viewing_side, query));
+
+	out = layout_.make_bitset();
+	for (int i = 0; i < static_cast<int>(layout_.size()); ++i) {
+		if (scratch_.done(i)) {
+			out.set(static_cast<size_t>(i));
+		}
 	}
-	return result;
+}
+
+reachable_paths pathfind_context::reachable_hexes_with_paths(const pathfind_context::pathing_query & query) {
+	ensure_layout(query);
+	search(query, boost::none, scratch_, get_side_masks(query.moving_side, query.viewing_side, query));
+	return paths_from(scratch_, query);
 }
 
 path pathfind_context::shortest_path(map_location end, const pathing_query & query) {
-	return get_path(compute_tree(query, end), end);
+	if (end == query.start) {
+		return path(1, end);
+	}
+	ensure_layout(query);
+	ensure_oracle();
+	search(query, end, scratch_, get_side_masks(query.moving_side, query.viewing_side, query));
+
+	int i = layout_.index(end);
+	assert(i >= 0 && scratch_.done(i));
+	path ret(1, end);
+	while (scratch_.nodes[i].pred != i) {
+		i = scratch_.nodes[i].pred;
+		ret.push_back(layout_.location(i));
+	}
+	return ret;
 }
 
 size_t pathfind_context::shortest_path_distance(map_location end, const pathing_query & query) {
 	if (end == query.start) {
 		return 0;
 	}
-	shortest_path_tree tree = compute_tree(query, end);
-	auto it = tree.find(end);
-	assert(it != tree.end());
-	return it->second.turns_left - query.turns + 1;
+	ensure_layout(query);
+	ensure_oracle();
+	search(query, end, scratch_, get_side_masks(query.moving_side, query.viewing_side, query));
+
+	int i = layout_.index(end);
+	assert(i >= 0 && scratch_.done(i));
+	return query.turns - scratch_.turns_left(scratch_.nodes[i]) + 1;
+}
+
+void pathfind_context::compute_side_masks(boost::optional<int> moving_side, boost::optional<int> viewing_side, const pathing_query & resources, side_masks & out) {
+	assert(!(moving_side || viewing_side) || resources.sides_);
+	assert(!moving_side || resources.units);
+
+	out.shrouded = layout_.make_bitset();
+	out.enemy = layout_.make_bitset();
+	out.zoc = layout_.make_bitset();
+
+	if (viewing_side) {
+		resources.sides_->ally_adjusted_shroud(*viewing_side).for_each([&](map_location l) {
+			int i = layout_.index(l);
+			if (i >= 0 && layout_.on_map(i)) {
+				out.shrouded.set(static_cast<size_t>(i));
+			}
+		});
+	}
+
+	if (!moving_side) {
+		return; // other units are ignored
+	}
+	sides & sides = *resources.sides_;
+	const int side = *moving_side;
+
+	out.emits = layout_.make_bitset();
+	bool any_emits = false;
+	const unit_table & units = resources.units->table();
+	for (size_t r = 0; r < units.size(); ++r) {
+		int i = layout_.index(units.loc[r]);
+		if (i < 0 || !blocks(units, r, side, viewing_side, sides)) {
+			continue;
+		}
+		out.enemy.set(static_cast<size_t>(i));
+		if (units.emits_zoc(r)) {
+			out.emits.set(static_cast<size_t>(i));
+			any_emits = true;
+		}
+	}
+
+	if (any_emits) {
+		for (int j = 0; j < static_cast<int>(layout_.size()); ++j) {
+			if (layout_.on_map(j)) {
+				update_zoc(out, j);
+			}
+		}
+	}
+}
+
+// Only enemy units block the way, and only those the viewing side sees (all, without one)
+bool pathfind_context::blocks(const unit_table & t, size_t r, int moving_side, boost::optional<int> viewing_side, sides & sides) {
+	if (sides.are_allied(t.side[r], moving_side)) {
+		return false;
+	}
+	return !viewing_side || ((!t.hidden(r) || sides.are_allied(t.side[r], *viewing_side)) && !sides.ally_adjusted_fog(t.loc[r], *viewing_side));
+}
+
+void pathfind_context::update_zoc(side_masks & m, int j) {
+	bool zoc = false;
+	layout_.for_each_adjacent(j, [&](int k) {
+		zoc = zoc || m.emits.test(static_cast<size_t>(k));
+	});
+	if (zoc) {
+		m.zoc.set(static_cast<size_t>(j));
+	} else {
+		m.zoc.reset(static_cast<size_t>(j));
+	}
+}
+
+void pathfind_context::units_changed(const std::vector<map_location> & changed, const pathing_query & resources) {
+	if (resources.units != masks_units_ || resources.sides_ != masks_sides_) {
+		side_masks_.clear();
+		return;
+	}
+
+	const unit_table & units = resources.units->table();
+	typedef std::map<side_pair, side_masks>::value_type masks_entry;
+	BOOST_FOREACH(masks_entry & e, side_masks_) {
+		if (!e.first.first) {
+			continue; // no moving side, units don't matter
+		}
+		side_masks & m = e.second;
+		bool off_map = false;
+		BOOST_FOREACH(map_location loc, changed) {
+			int i = layout_.index(loc);
+			off_map = off_map || (i >= 0 && !layout_.on_map(i));
+		}
+		if (off_map) { // units off the map exert zoc on it too, but the cells around theirs aren't listed
+			compute_side_masks(e.first.first, e.first.second, resources, m);
+			continue;
+		}
+
+		BOOST_FOREACH(map_location loc, changed) {
+			int i = layout_.index(loc);
+			if (i < 0) {
+				continue;
+			}
+			m.enemy.reset(static_cast<size_t>(i));
+			m.emits.reset(static_cast<size_t>(i));
+			const unit_rec * u = resources.units->at(loc);
+			if (u && blocks(units, u->row_, *e.first.first, e.first.second, *resources.sides_)) {
+				m.enemy.set(static_cast<size_t>(i));
+				if (units.emits_zoc(u->row_)) {
+					m.emits.set(static_cast<size_t>(i));
+				}
+			}
+		}
+		BOOST_FOREACH(map_location loc, changed) {
+			int i = layout_.index(loc);
+			if (i < 0) {
+				continue;
+			}
+			update_zoc(m, i);
+			layout_.for_each_adjacent(i, [&](int j) {
+				if (layout_.on_map(j)) {
+					update_zoc(m, j);
+				}
+			});
+		}
+	}
+}
+
+void pathfind_context::ensure_layout(const pathing_query & query) {
+	assert(query.tmap_ || query.terrain_);
+	if (query.terrain_) {
+		ensure_layout(*query.terrain_);
+	} else {
+		ensure_layout(*query.tmap_);
+	}
+}
+
+template<typename Map>
+void pathfind_context::ensure_layout(const Map & m) {
+	if (!layout_.matches(m)) {
+		layout_.build(m, *geom_, tunnels_);
+		++layout_version_;
+		oracle_.invalidate();
+		side_masks_.clear();
+		BOOST_FOREACH(const boost::shared_ptr<cost_grid> & g, cost_grids_) {
+			g->invalidate();
+		}
+	}
+	BOOST_FOREACH(const boost::shared_ptr<cost_grid> & g, cost_grids_) {
+		if (!g->valid()) {
+			g->build(m, layout_);
+		}
+	}
+}
+
+const cost_grid * pathfind_context::add_movetype(const terrain_cost_fcn & terrain_costs) {
+	cost_grids_.push_back(boost::shared_ptr<cost_grid>(new cost_grid(terrain_costs)));
+	return cost_grids_.back().get();
+}
+
+static size_t movetype_cost(const terrain_movecosts & costs, size_t missing_cost, const terrain_id & t) {
+	auto it = costs.find(t);
+	return it == costs.end() ? missing_cost : it->second;
+}
+
+const cost_grid * pathfind_context::add_movetype(const terrain_movecosts & costs, size_t missing_cost) {
+	return add_movetype(terrain_cost_fcn(boost::bind(&movetype_cost, costs, missing_cost, _1)));
+}
+
+void pathfind_context::set_terrain(terrain_map & m, map_location loc, const terrain_id & t) {
+	auto it = m.find(loc);
+	if (it == m.end()) {
+		m.insert(std::make_pair(loc, t));
+		invalidate_layout();
+		return;
+	}
+	it->second = t;
+
+	if (!layout_.matches(m)) {
+		return; // the grids are rebuilt with the layout
+	}
+	int i = layout_.index(loc);
+	BOOST_FOREACH(const boost::shared_ptr<cost_grid> & g, cost_grids_) {
+		if (g->valid()) {
+			g->update(i, t);
+		}
+	}
+}
+
+bool pathfind_context::set_terrain(terrain_grid & m, map_location loc, terrain_code c) {
+	if (!m.on_map(loc) || c == terrain_codes::NONE) {
+		if (!m.set(loc, c)) {
+			return false;
+		}
+		invalidate_layout();
+		return true;
+	}
+	m.set(loc, c);
+
+	if (!layout_.matches(m)) {
+		return true; // the grids are rebuilt with the layout
+	}
+	int i = layout_.index(loc);
+	BOOST_FOREACH(const boost::shared_ptr<cost_grid> & g, cost_grids_) {
+		if (g->valid()) {
+			g->update(i, c, m.codes());
+		}
+	}
+	return true;
+}
+
+const pathfind_context::side_masks & pathfind_context::get_side_masks(boost::optional<int> moving_side, boost::optional<int> viewing_side, const pathing_query & resources) {
+	// The masks of searches which ignore the units and the shroud depend on neither, so those stay
+	if ((moving_side || viewing_side) && (resources.units != masks_units_ || resources.sides_ != masks_sides_)) {
+		for (auto it = side_masks_.begin(); it != side_masks_.end();) {
+			if (it->first.first || it->first.second) {
+				it = side_masks_.erase(it);
+			} else {
+				++it;
+			}
+		}
+		masks_units_ = resources.units;
+		masks_sides_ = resources.sides_;
+	}
+
+	side_pair key(moving_side, viewing_side);
+	auto it = side_masks_.find(key);
+	if (it == side_masks_.end()) {
+		it = side_masks_.insert(std::make_pair(key, side_masks())).first;
+		compute_side_masks(moving_side, viewing_side, resources, it->second);
+		++masks_computed_;
+	}
+	return it->second;
+}
+
+void pathfind_context::vision_changed(int side, sides & s) {
+	for (auto it = side_masks_.begin(); it != side_masks_.end();) {
+		if (it->first.second && s.are_allied(*it->first.second, side)) {
+			it = side_masks_.erase(it);
+		} else {
+			++it;
+		}
+	}
+}
+
+std::vector<pathfind_context::unit_reach> pathfind_context::reachable_hexes_for_side(int side, boost::optional<int> viewing_side, const pathing_query & resources, const movement_fcn & describe, thread_pool * pool) {
+	ensure_layout(resources);
+
+	const side_masks & masks = get_side_masks(side, viewing_side, resources);
+
+	std::vector<pathing_query> queries;
+	std::vector<unit_reach> result;
+	const unit_table & units = resources.units->table();
+	for (size_t row = 0; row < units.size(); ++row) {
+		if (units.side[row] != side) {
+			continue;
+		}
+		const unit_rec & u = *units.rec[row];
+		pathing_query q = resources;
+		q.start = u.loc_;
+		q.moving_side = side;
+		q.viewing_side = viewing_side;
+		if (!describe(u, q)) {
+			continue;
+		}
+		queries.push_back(q);
+		unit_reach r;
+		r.id = u.id_;
+		r.loc = u.loc_;
+		result.push_back(r);
+	}
+
+	const size_t workers = pool ? pool->size() : 1;
+	if (worker_scratch_.size() < workers) {
+		worker_scratch_.resize(workers);
+	}
+
+	auto body = [&](size_t n, size_t w) {
+		pathing_scratch & s = worker_scratch_[w];
+		search(queries[n], boost::none, s, masks);
+
+		hex_bitset & reach = result[n].reachable;
+		reach = layout_.make_bitset();
+		for (int i = 0; i < static_cast<int>(layout_.size()); ++i) {
+			if (s.done(i)) {
+				reach.set(static_cast<size_t>(i));
+			}
+		}
+	};
+
+	if (pool) {
+		pool->parallel_for(queries.size(), body);
+	} else {
+		for (size_t n = 0; n < queries.size(); ++n) {
+			body(n, 0);
+		}
+	}
+	return result;
+}
+
+namespace {
+// The neighbors of a hex through tunnels too, for search_rings
+struct tunnel_neighbors {
+	explicit tunnel_neighbors(pathfind_context * c) : c_(c) {}
+
+	template<typename F>
+	void operator()(map_location l, F f) const {
+		pathfind_context::neighbor_range n;
+		c_->neighbors(l, n);
+		n.for_each(f);
+	}
+
+	pathfind_context * c_;
+};
+} // end anonymous namespace
+
+void pathfind_context::get_ring(map_location a, size_t r, std::vector<map_location> & out) {
+	if (tunnels_.empty()) {
+		geom_->get_ring(a, r, out);
+		return;
+	}
+	const size_t begin = out.size();
+	const size_t ring = search_rings(a, r, tunnel_neighbors(this), out);
+	out.erase(out.begin() + begin, out.begin() + ring);
+}
+
+void pathfind_context::get_spiral(map_location a, size_t r, std::vector<map_location> & out) {
+	if (tunnels_.empty()) {
+		geom_->get_spiral(a, r, out);
+		return;
+	}
+	search_rings(a, r, tunnel_neighbors(this), out);
+}
+
+size_t pathfind_context::exit_distance(map_location b) {
+	size_t result = static_cast<size_t>(-1);
+	BOOST_FOREACH(const neighbor_map::value_type & t, tunnels_) {
+		BOOST_FOREACH(map_location x, t.second) {
+			result = std::min(result, geom_->distance(x, b));
+		}
+	}
+	return result;
+}
+
+// A path from a to b either takes no tunnel, or walks to some entrance, takes it, and walks on from its exit.
+size_t pathfind_context::tunnel_bound(map_location a, map_location b, size_t exit_dist) {
+	size_t result = geom_->distance(a, b);
+	if (exit_dist < result && exit_dist + 1 < result) {
+		BOOST_FOREACH(const neighbor_map::value_type & t, tunnels_) {
+			if (!t.second.empty()) {
+				result = std::min(result, geom_->distance(a, t.first.location()) + 1 + exit_dist);
+			}
+		}
+	}
+	return result;
+}
+
+size_t pathfind_context::step_bound(int a, int b, map_location dest, size_t exit_dist) {
+	size_t result = tunnel_bound(layout_.location(a), dest, exit_dist);
+	if (oracle_.valid() && b >= 0) {
+		result = std::max(result, oracle_.lower_bound(a, b));
+	}
+	return result;
+}
+
+size_t pathfind_context::heuristic_distance(map_location a, map_location b) {
+	size_t exit_dist = exit_distance(b);
+	int i = layout_.index(a), j = layout_.index(b);
+	if (i >= 0 && j >= 0 && layout_.on_map(i) && layout_.on_map(j)) {
+		return step_bound(i, j, b, exit_dist);
+	}
+	return tunnel_bound(a, b, exit_dist);
+}
+
+////
+// game_data
+////
+
+namespace {
+// What the kernel was told of the vision of a unit
+bool describe_vision(const unit_map * units, const unit_rec & u, vision_engine::unit_vision & out) {
+	unit_state s = units->state(u);
+	if (s.vision < 0) {
+		return false;
+	}
+	out.vision = s.vision;
+	out.jamming = s.jamming;
+	return true;
+}
+} // end anonymous namespace
+
+game_data::game_data(const geometry & g)
+	: terrain_codes_()
+	, terrain_(&terrain_codes_)
+	, units_()
+	, map_with_tunnels_(g)
+	, sides_()
+	, vision_(new vision_engine(map_with_tunnels_, g, sides_, boost::bind(&describe_vision, &units_, _1, _2)))
+{}
+
+void game_data::reset(const geometry & g) {
+	terrain_codes_ = terrain_codes();
+	terrain_ = terrain_grid(&terrain_codes_);
+	units_ = unit_map();
+	map_with_tunnels_ = pathfind_context(g);
+	sides_ = sides();
+	vision_.reset(new vision_engine(map_with_tunnels_, g, sides_, boost::bind(&describe_vision, &units_, _1, _2)));
+}
+
+pathfind_context::pathing_query game_data::resources() {
+	pathfind_context::pathing_query q;
+	q.terrain_ = &terrain_;
+	q.units = &units_;
+	q.sides_ = &sides_;
+	return q;
 }
 
 } // end namespace wesnoth
@@ -5,11 +5,15 @@
 #include <boost/multi_index/hashed_index.hpp>
 #include <boost/multi_index/ordered_index.hpp>
 #include <boost/multi_index/member.hpp>
+#include <boost/cstdint.hpp>
 #include <boost/foreach.hpp>
 #include <boost/function.hpp>
 #include <boost/optional.hpp>
+#include <boost/shared_ptr.hpp>
 
 #include "kernel.hpp"
+#include "pathing_grid.hpp"
+#include "thread_pool.hpp"
 
 namespace wesnoth {
 
@@ -26,6 +30,7 @@ struct unit_rec
 		: id_(id_arg)
 		, loc_(loc_arg)
 		, unit_(unit_arg)
+		, row_(0)
 	{
 	}
 
@@ -33,12 +38,55 @@ struct unit_rec
 	map_location loc_;
 	unit unit_;
 
-	// This data is essential for pathfinding -- we cache it from the lua state, and update periodically, using the dirty_ flag to mark when update is needed.
-	mutable int side_;
-	mutable bool hidden_;
-	mutable bool emits_zoc_;
-	mutable bool dirty_;
-	void update() const;
+	// The row of the unit in the unit_table of its map
+	mutable size_t row_;
+};
+
+// The data of a unit which is essential for pathfinding and vision. The engine copies it from the
+// lua state whenever a unit is updated, so that searches never read it through the unit.
+struct unit_state
+{
+	unit_state()
+		: side(0)
+		, hidden(false)
+		, emits_zoc(true)
+		, movetype(-1)
+		, vision(-1)
+		, jamming(0)
+	{
+	}
+
+	int side;
+	bool hidden;
+	bool emits_zoc;
+	int movetype; // an index the engine gives to the movetypes, -1 if unknown
+	int vision;   // vision points, -1 if the unit sees nothing
+	int jamming;
+};
+
+// The unit_state and location of each unit in a unit_map, one array per field, with a row for each
+// unit. The rows are kept packed: erasing a unit moves the last row into its place.
+struct unit_table
+{
+	enum { HIDDEN = 1, EMITS_ZOC = 2 };
+
+	std::vector<const unit_rec *> rec;
+	std::vector<map_location> loc;
+	std::vector<boost::int16_t> side;
+	std::vector<boost::uint8_t> flags;
+	std::vector<boost::int16_t> movetype;
+	std::vector<boost::int16_t> vision;
+	std::vector<boost::int16_t> jamming;
+
+	size_t size() const { return rec.size(); }
+	bool hidden(size_t r) const { return flags[r] & HIDDEN; }
+	bool emits_zoc(size_t r) const { return flags[r] & EMITS_ZOC; }
+
+	unit_state state(size_t r) const;
+	void set(size_t r, const unit_state & s);
+	void push_back(const unit_rec & u, const unit_state & s);
+	void erase(size_t r);
+	void clear();
 };
 
 struct by_id {};
@@ -50,15 +98,132 @@ using boost::multi_index::indexed_by;
 using boost::multi_index::tag;
 using boost::multi_index::member;
 
-typedef boost::multi_index_container<
-	unit_rec,
-	indexed_by<
-		//ordered by ids
-		ordered_unique<tag<by_id>, member<unit_rec,const int,&unit_rec::id_> >,
-		//hashed by location
-		ordered_unique<tag<by_loc>, member<unit_rec,const map_location,&unit_rec::loc_> >
-	>
-> unit_map;
+// Spreads map locations over the buckets of hashed indices
+inline std::size_t hash_value(const map_location & l) {
+	return static_cast<std::size_t>(l.x) * 8191u + static_cast<std::size_t>(l.y);
+}
+
+////
+// The units, hashed by id and by location. The units on the current map are also found by
+// location in a grid of slots laid over it, which is what the pathfinder asks for at each hex,
+// and their unit_state is kept in a unit_table. Units must be moved through modify or move, and
+// erased through the map, so that the slots and the table stay consistent with the indices.
+////
+
+class unit_map {
+	typedef boost::multi_index_container<
+		unit_rec,
+		indexed_by<
+			//hashed by ids
+			hashed_unique<tag<by_id>, member<unit_rec,const int,&unit_rec::id_> >,
+			//hashed by location
+			hashed_unique<tag<by_loc>, member<unit_rec,const map_location,&unit_rec::loc_> >
+		>
+	> container;
+
+public:
+	typedef container::value_type value_type;
+	typedef container::iterator iterator;
+	typedef container::const_iterator const_iterator;
+
+	template<typename Tag>
+	struct index {
+		typedef typename container::template index<Tag>::type type;
+	};
+
+	unit_map();
+	unit_map(const unit_map & other);
+	unit_map & operator=(const unit_map & other);
+
+	iterator begin() const { return units_.begin(); }
+	iterator end() const { return units_.end(); }
+	size_t size() const { return units_.size(); }
+	bool empty() const { return units_.empty(); }
+
+	// The indices can only be read, changes go through the map
+	template<typename Tag>
+	const typename index<Tag>::type & get() const { return units_.template get<Tag>(); }
+
+	std::pair<iterator, bool> insert(const unit_rec & u, const unit_state & s = unit_state());
+	iterator find(int id) const { return units_.find(id); }
+
+	const unit_table & table() const { return table_; }
+	unit_state state(const unit_rec & u) const { return table_.state(u.row_); }
+	int side(const unit_rec & u) const { return table_.side[u.row_]; }
+	// Called when the engine updates a unit
+	void update(iterator it, const unit_state & s) { table_.set(it->row_, s); }
+
+	// The unit at a hex, or NULL
+	const unit_rec * at(map_location loc) const {
+		int i = slot(loc);
+		if (i >= 0) {
+			return slots_[i];
+		}
+		const index<by_loc>::type & by_location = units_.get<by_loc>();
+		index<by_loc>::type::iterator it = by_location.find(loc);
+		return it == by_location.end() ? NULL : &*it;
+	}
+	size_t count(map_location loc) const { return at(loc) ? 1 : 0; }
+
+	// Changes a unit. If that moves it onto another unit, it is erased and false is returned, as
+	// multi_index does.
+	template<typename Modifier>
+	bool modify(iterator it, Modifier f) {
+		const unit_rec & u = *it;
+		vacate(u);
+		size_t row = u.row_;
+		if (!units_.modify(it, f)) {
+			table_.erase(row);
+			return false;
+		}
+		table_.loc[row] = u.loc_;
+		occupy(u);
+		return true;
+	}
+	// Moves a unit, or returns false if the hex is taken by another
+	bool move(iterator it, map_location to);
+
+	iterator erase(iterator it);
+	size_t erase(int id);
+	void clear();
+
+	// Lays the slots over the bounding box of the hexes of a map
+	template<typename Map>
+	void fit(const Map & m);
+	void set_area(int x0, int y0, int width, int height);
+
+private:
+	int slot(map_location loc) const {
+		int x = loc.x - x0_, y = loc.y - y0_;
+		if (x < 0 || y < 0 || x >= width_ || y >= height_) {
+			return -1;
+		}
+		return y * width_ + x;
+	}
+	void occupy(const unit_rec & u);
+	void vacate(const unit_rec & u);
+
+	container units_;
+	unit_table table_;
+	int x0_, y0_, width_, height_;
+	std::vector<const unit_rec *> slots_; // row by row over the area, NULL where there is no unit
+};
+
+template<typename Map>
+void unit_map::fit(const Map & m) {
+	if (m.empty()) {
+		set_area(0, 0, 0, 0);
+		return;
+	}
+	map_location lo = m.begin()->first, hi = lo;
+	BOOST_FOREACH(const typename Map::value_type & v, m) {
+		lo.x = std::min(lo.x, v.first.x);
+		lo.y = std::min(lo.y, v.first.y);
+		hi.x = std::max(hi.x, v.first.x);
+		hi.y = std::max(hi.y, v.first.y);
+	}
+	set_area(lo.x, lo.y, hi.x - lo.x + 1, hi.y - lo.y + 1);
+}
 
 ////
 // associated data types keyed by terrain_id
@@ -130,6 +295,46 @@ typedef std::map<terrain_id, size_t> terrain_movecosts;
 typedef boost::function<size_t(terrain_id)> terrain_cost_fcn;
 typedef boost::function<size_t(map_location)> move_cost_fcn;
 
+////
+// The move costs of a movetype, laid out like the map in a pathfind_context, one byte per hex.
+// Costs above 254 are stored as 255, which no unit can afford anyways. Hexes outside of the
+// map cost 255 too. The cost of each terrain is asked for only once.
+////
+
+class cost_grid {
+public:
+	enum { MAX_COST = 255 };
+
+	explicit cost_grid(const terrain_cost_fcn & f);
+
+	bool valid() const { return valid_; }
+	void invalidate() { valid_ = false; }
+
+	// Compute all the costs
+	void build(const terrain_map & m, const grid_layout & layout);
+	void build(const terrain_grid & m, const grid_layout & layout);
+	// Recompute the cost of a hex after its terrain changed
+	void update(int i, const terrain_id & t);
+	void update(int i, terrain_code c, const terrain_codes & codes);
+
+	unsigned char operator[](int i) const { return costs_[i]; }
+	size_t size() const { return costs_.size(); }
+
+	// The least cost of any hex of the map
+	size_t min_cost() const;
+
+private:
+	unsigned char lookup(const terrain_id & t);
+	unsigned char lookup(terrain_code c, const terrain_codes & codes);
+
+	terrain_cost_fcn fcn_;
+	std::map<terrain_id, unsigned char> known_;
+	std::vector<short> by_code_; // the costs of the terrain codes looked up, -1 for the others
+	std::vector<unsigned char> costs_;
+	size_t histogram_[MAX_COST + 1]; // number of hexes of the map at each cost
+	bool valid_;
+};
+
 ////
 // graph data
 ////
@@ -148,23 +353,70 @@ struct pathing_node {
 };
 typedef std::map<map_location, pathing_node> shortest_path_tree;
 
-typedef loc_map<loc_set > neighbor_map;
-typedef loc_set neighbor_function(map_location);
-typedef std::map<std::pair<map_location, map_location>, size_t> metric;
+////
+// The shortest paths to all the hexes reached by a query, as one array of predecessors.
+//
+// Hexes are numbered in the order of their locations, as in a shortest_path_tree, and pred(n)
+// is the number of the hex before n on its path; the start is its own predecessor. A path is
+// only put together when asked for, ending to start like shortest_path gives it, or walked
+// hex by hex without putting it together at all.
+////
+class reachable_paths {
+public:
+	size_t size() const { return locs_.size(); }
+
+	map_location location(size_t n) const { return locs_[n]; }
+	size_t pred(size_t n) const { return pred_[n]; }
+	// Number of hexes on the path to n, n and the start included
+	size_t length(size_t n) const { return length_[n]; }
+
+	// Number of a location, or -1 if it wasn't reached
+	int find(map_location loc) const;
+
+	path get_path(size_t n) const;
+
+	// Calls f(location) for each hex of the path to n, from n back to the start
+	template<typename F>
+	void walk_path(size_t n, F f) const {
+		for (;;) {
+			f(locs_[n]);
+			if (pred_[n] == n) {
+				return;
+			}
+			n = pred_[n];
+		}
+	}
+
+	// Writes all the paths one after the other, path n from offsets[n] up to offsets[n+1]
+	void all_paths(std::vector<map_location> & buffer, std::vector<size_t> & offsets) const;
+
+private:
+	friend class pathfind_context;
+
+	std::vector<map_location> locs_;
+	std::vector<size_t> pred_;
+	std::vector<size_t> length_;
+};
 
 class sides;
 
 class pathfind_context {
 public:
 	pathfind_context(const geometry & t)
-		: geom_(t)
+		: geom_(t.clone())
 		, tunnels_()
-		, heuristic_cache_()
+		, layout_()
+		, scratch_()
+		, layout_version_(0)
+		, side_masks_()
+		, masks_units_(NULL)
+		, masks_sides_(NULL)
+		, masks_computed_(0)
 	{
 	}
 
 	loc_set neighbors(map_location a) {
-		loc_set result = geom_.neighbors(a);
+		loc_set result = geom_->neighbors(a);
 		auto it = tunnels_.find(a);
 		if (it != tunnels_.end()) {
 			result.insert(it->second.begin(), it->second.end());
@@ -172,15 +424,39 @@ public:
 		return result;
 	}
 
+	// The neighbors of a hex, including tunnel exits, without building a set.
+	struct neighbor_range {
+		adjacent_hexes adjacent;
+		const loc_set * tunnel_exits; // NULL if there are none
+
+		template<typename F>
+		void for_each(F f) const {
+			BOOST_FOREACH(map_location loc, adjacent) {
+				f(loc);
+			}
+			if (tunnel_exits) {
+				BOOST_FOREACH(map_location loc, *tunnel_exits) {
+					f(loc);
+				}
+			}
+		}
+	};
+
+	void neighbors(map_location a, neighbor_range & out) {
+		geom_->get_adjacent(a, out.adjacent);
+		auto it = tunnels_.find(a);
+		out.tunnel_exits = (it != tunnels_.end() && !it->second.empty()) ? &it->second : NULL;
+	}
+
 	bool adjacent(map_location a, map_location b) {
-		if (geom_.adjacent(a, b)) {
+		if (geom_->adjacent(a, b)) {
 			return true;
 		}
 		auto it = tunnels_.find(b);
 		if (it == tunnels_.end()) {
 			return false;
 		}
-		auto set = it->second;
+		const loc_set & set = it->second;
 		auto it2 = set.find(a);
 		if (it2 == set.end()) {
 			return false;
@@ -189,44 +465,52 @@ public:
 		return true;
 	}
 
+	// The hexes at r steps from a, respectively within r steps, as geometry::get_ring and get_spiral
+	// give them, through tunnels too
+	void get_ring(map_location a, size_t r, std::vector<map_location> & out);
+	void get_spiral(map_location a, size_t r, std::vector<map_location> & out);
+
+	// These return whether the tunnel was new, respectively whether it existed
 	bool add_tunnel(map_location a, map_location b) {
-		auto s = tunnels_[a]; //don't mind to make empty, this is not called often
-		auto ret = s.emplace(b);
-		if (!ret.second) {
-			heuristic_cache_ = metric(); //toss the cache, since it is dirty now
+		bool added = tunnels_[a].insert(b).second;
+		if (added) {
+			layout_.invalidate();
+			oracle_.invalidate();
 		}
-		return ret.second; //ret.second is a boolean flag explaining if the emplace operation succeeded in creating a new entry
+		return added;
 	}
 	bool remove_tunnel(map_location a, map_location b) {
-		auto s = tunnels_[a]; //don't mind to make empty, this is not called often
-		auto ret = s.emplace(b);
-		if (!ret.second) {
-			heuristic_cache_ = metric(); //toss the cache, since it is dirty now
+		auto it = tunnels_.find(a);
+		if (it == tunnels_.end() || !it->second.erase(b)) {
+			return false;
+		}
+		if (it->second.empty()) {
+			tunnels_.erase(it);
 		}
-		return ret.second; //ret.second is a boolean flag explaining if the emplace operation succeeded in creating a new entry
+		layout_.invalidate();
+		oracle_.invalidate();
+		return true;
 	}
 
 	size_t shortest_path_distance(map_location start, map_location end, boost::optional<move_cost_fcn> = boost::none);
 	path shortest_path(map_location start, map_location end, boost::optional<move_cost_fcn> = boost::none);
 
-	size_t heuristic_distance(map_location a , map_location b) {
-		auto it = heuristic_cache_.find(make_pair(a,b));
-		if (it != heuristic_cache_.end()) {
-			return it->second;
-		}
-
-		int answer = shortest_path_distance(a, b);
-		heuristic_cache_.emplace(make_pair(a,b), answer);
-		return answer;
-	}
+	// Lower bound on the number of steps from a to b, tunnels included. It changes by at most one
+	// from a hex to any of its neighbors, so it can guide an A* search. Once a search for a single
+	// destination has run, it also takes the holes in the map into account (see landmark_oracle).
+	size_t heuristic_distance(map_location a , map_location b);
 
 	struct pathing_query {
 		map_location start;
+
+		// The move costs: a grid from add_movetype if set, otherwise the cost map, otherwise 1
+		const cost_grid * costs;
 		boost::optional<move_cost_fcn> cost_map;
 		size_t moves;
 		size_t turns;
 		size_t max_moves;
 
+		const cost_grid * first_turn_override_costs;
 		boost::optional<move_cost_fcn> first_turn_override_cost_map; //for handling slowed units
 
 		// How to handle other units
@@ -236,23 +520,212 @@ public:
 		boost::optional<int> viewing_side;
 		bool ignore_zoc;
 
-		// resources...
+		// Lower bound on the cost of entering a hex, under both cost maps. Searches for a single destination
+		// scale the heuristic distance by it. It defaults to the least cost in the cost grids, or to 1 given
+		// a cost map, since Wesnoth move costs are at least 1.
+		boost::optional<size_t> min_move_cost;
+
+		// resources... The map is either tmap_ or terrain_, which is used if set.
 		terrain_map * tmap_;
+		const terrain_grid * terrain_;
 		unit_map * units;
 		sides * sides_;
+
+		pathing_query()
+			: start()
+			, costs(NULL)
+			, cost_map()
+			, moves(0)
+			, turns(0)
+			, max_moves(0)
+			, first_turn_override_costs(NULL)
+			, first_turn_override_cost_map()
+			, moving_side()
+			, viewing_side()
+			, ignore_zoc(false)
+			, min_move_cost()
+			, tmap_(NULL)
+			, terrain_(NULL)
+			, units(NULL)
+			, sides_(NULL)
+		{}
 	};
 
+	// A cost grid for a movetype, kept up to date with the map of the queries. Changes to the terrain
+	// of a hex should go through set_terrain so that the grids follow them; after other changes to the
+	// map, call invalidate_layout. The grid lives as long as this context.
+	const cost_grid * add_movetype(const terrain_cost_fcn & terrain_costs);
+	const cost_grid * add_movetype(const terrain_movecosts & costs, size_t missing_cost = cost_grid::MAX_COST);
+
+	// Change the terrain of a hex of the map (or add it), and update the cost grids. A grid may
+	// refuse to grow for the hex, then false is returned and nothing changed.
+	void set_terrain(terrain_map & m, map_location loc, const terrain_id & t);
+	bool set_terrain(terrain_grid & m, map_location loc, terrain_code c);
+
 	size_t shortest_path_distance(map_location end, const pathing_query &);
 	path shortest_path(map_location end, const pathing_query &);
 
 	loc_set reachable_hexes(const pathing_query &);
-	std::vector<path> reachable_hexes_with_paths(const pathing_query &);
+	// As above, as a bitset over the layout of the map
+	void reachable_hexes(const pathing_query &, hex_bitset & out);
+	reachable_paths reachable_hexes_with_paths(const pathing_query &);
 	shortest_path_tree compute_tree(const pathing_query &, boost::optional<map_location> dest = boost::none);
 
+	////
+	// Reachability for all the units of a side at once.
+	//
+	// What the searches need to know about shroud and other units is computed for the whole side
+	// first: which hexes are shrouded for the viewing side, and where the visible enemies are and
+	// exert zoc. The searches themselves then only test bits, and can run on a thread pool
+	// (sequentially given none). Each unit's result is a bitset over the layout of the map. The
+	// results follow the rows of the unit table, not the iteration order of the unit_map, so a
+	// caller should match them to units by id.
+	//
+	// The movement callback completes the query for a unit (moves, turns, max_moves, cost maps,
+	// ignore_zoc) starting from the resources given, or returns false to skip the unit. It is
+	// called on the calling thread, but the cost maps it sets are called from the pool's threads.
+	////
+	struct unit_reach {
+		int id;
+		map_location loc;
+		hex_bitset reachable;
+	};
+	typedef boost::function<bool(const unit_rec &, pathing_query &)> movement_fcn;
+
+	std::vector<unit_reach> reachable_hexes_for_side(int side, boost::optional<int> viewing_side, const pathing_query & resources, const movement_fcn & describe, thread_pool * pool = NULL);
+
+	////
+	// Distance fields, for each hex how soon any of several sources gets there.
+	//
+	// distance_field_from searches from all the sources at once under one query, whose start is
+	// ignored: say from the villages, with some movetype. merged_distance_field searches from the
+	// start of each query under its own rules, and keeps the earliest arrival at each hex: say for
+	// all the units of the enemy. Given a thread pool, those searches run on it as in
+	// reachable_hexes_for_side. The fields are laid out like the map.
+	////
+	distance_field distance_field_from(const std::vector<map_location> & sources, const pathing_query &);
+	distance_field merged_distance_field(const std::vector<pathing_query> &, thread_pool * pool = NULL);
+
+	////
+	// Shortest path trees which follow the changes to the game, rather than being searched again.
+	//
+	// A change to the units on a hex, or to its terrain, only changes the steps into that hex and
+	// (for zoc) into its neighbors. A repair tears down the parts of the tree hanging from those
+	// hexes, and searches again from their edges only, in the spirit of LPA*. The tree belongs to
+	// the context which built it; its results are the same as compute_tree's.
+	////
+	class dynamic_tree {
+	public:
+		dynamic_tree();
+
+		const pathing_query & query() const { return query_; }
+
+	private:
+		friend class pathfind_context;
+
+		pathing_query query_;
+		pathing_scratch scratch_;
+		size_t layout_version_;
+
+		// working memory of the repairs
+		std::vector<int> first_child_, next_sibling_;
+		std::vector<int> stack_, candidates_;
+	};
+
+	void build_tree(const pathing_query &, dynamic_tree & out);
+	shortest_path_tree get_tree(const dynamic_tree &);
+
+	// Bring a tree up to date after the units on some hexes changed (both ends of a move), or their terrain
+	// changed through set_terrain. Unit changes should be reported to units_changed first.
+	void repair_tree(dynamic_tree &, const std::vector<map_location> & changed);
+
+	// Update the cached masks for the units on some hexes, rather than computing them again for the whole
+	// map as invalidate_units would have it. Only unit moves, additions and removals may be reported so.
+	void units_changed(const std::vector<map_location> & changed, const pathing_query & resources);
+
+	// The searches lay out the terrain map in flat arrays, and only notice some of its changes
+	// (hexes added or removed at the edges). Call this when the set of hexes changes otherwise.
+	void invalidate_layout() { layout_.invalidate(); oracle_.invalidate(); side_masks_.clear(); }
+
+	// Where the enemies of a side are and exert zoc, and what is shrouded, is computed once for
+	// each pair of moving and viewing sides, and kept until this is called. Call it whenever units
+	// are added, removed or moved, change side or visibility, and when fog, shroud or alliances change.
+	void invalidate_units() { side_masks_.clear(); }
+	// Only drops the masks of the sides which see through the eyes of a side (its allies), after the
+	// fog or shroud of that side changed
+	void vision_changed(int side, sides & s);
+
+	// How many times the masks were computed, for benchmarks
+	size_t side_masks_computed() const { return masks_computed_; }
+
 private:
-	geometry geom_;
+	boost::shared_ptr<geometry> geom_;
 	neighbor_map tunnels_;
-	mutable metric heuristic_cache_;
+
+	// What a side's searches need to know about the shroud and the other units, in layout order
+	struct side_masks {
+		hex_bitset shrouded;
+		hex_bitset enemy;    // a visible enemy stands here
+		hex_bitset emits;    // a visible enemy exerting zoc stands here
+		hex_bitset zoc;      // an adjacent visible enemy exerts zoc here
+	};
+	// Whether a unit counts as an enemy standing in the way of the moving side
+	static bool blocks(const unit_table & t, size_t r, int moving_side, boost::optional<int> viewing_side, sides & sides);
+	// Recompute the zoc of a cell from the emits mask
+	void update_zoc(side_masks & m, int j);
+	void compute_side_masks(boost::optional<int> moving_side, boost::optional<int> viewing_side, const pathing_query & resources, side_masks & out);
+
+	// The masks for the sides of a query, from the cache if possible
+	const side_masks & get_side_masks(boost::optional<int> moving_side, boost::optional<int> viewing_side, const pathing_query & resources);
+
+	// Lay out the map of a query, and build the cost grids over it
+	void ensure_layout(const pathing_query & query);
+	template<typename Map>
+	void ensure_layout(const Map & m);
+
+	// The reached cells of a search as a tree
+	shortest_path_tree tree_from(const pathing_scratch & s, const pathing_query & query);
+	reachable_paths paths_from(const pathing_scratch & s, const pathing_query & query);
+
+	// The step from cell to cell under a query, shared by the searches and the repairs
+	class step_rules;
+
+	// Dijkstra on the dense layout. Given a destination, it is A* instead, and stops once it gets there.
+	// The result is left in the scratch. It only looks at the units and sides through the masks,
+	// so searches given the masks and different scratches can run concurrently.
+	// Given sources, it searches from all of them at once instead of from the start of the query.
+	void search(const pathing_query &, boost::optional<map_location> dest, pathing_scratch & s, const side_masks & masks, const std::vector<map_location> * sources = NULL);
+
+	// Lower the entries of a field to the arrivals of a finished search where they are earlier
+	void add_to_field(const pathing_scratch & s, const pathing_query & query, distance_field & field);
+
+	// Least distance from a tunnel exit to b, or the largest size_t if there are no tunnels
+	size_t exit_distance(map_location b);
+	// heuristic_distance, given the exit_distance of b
+	size_t tunnel_bound(map_location a, map_location b, size_t exit_dist);
+	// The larger of that and the landmark bound, for cells of the layout
+	size_t step_bound(int a, int b, map_location dest, size_t exit_dist);
+
+	// Build the landmarks for the current layout, if needed
+	void ensure_oracle() {
+		if (!oracle_.valid()) {
+			oracle_.build(layout_);
+		}
+	}
+
+	grid_layout layout_;
+	landmark_oracle oracle_; // built on demand by searches for a destination, invalidated with the layout
+	pathing_scratch scratch_;
+	std::vector<pathing_scratch> worker_scratch_; // one per thread of the pool, for reachable_hexes_for_side
+	size_t layout_version_; // counts the layouts built, so that dynamic trees notice new ones
+	std::vector<size_t> path_numbers_, path_stack_; // working memory of paths_from
+	std::vector<boost::shared_ptr<cost_grid> > cost_grids_;
+
+	typedef std::pair<boost::optional<int>, boost::optional<int> > side_pair; // moving and viewing side
+	std::map<side_pair, side_masks> side_masks_;
+	const unit_map * masks_units_; // the resources the cached masks were computed from
+	const sides * masks_sides_;
+	size_t masks_computed_;
 };
 
 
@@ -263,93 +736,171 @@ private:
 // This is only to cache and speed up vision calculations. All the real info about a side is in the lua table and manipulated in lua.
 class sides {
 public:
-	typedef boost::function<bool(int, int)> ally_calc_function;
-
-	sides( const ally_calc_function & a ) 
-		: ally_calculator_(a)
+	static const int MAX_SIDES = 64;
+
+	sides()
+		: share_maps_()
+		, share_vision_()
+		, teams_()
+		, allies_valid_(false)
+		, planes_()
+		, bounds_()
+		, views_()
 	{
-	}
-
-	void update_ally_calculator(const ally_calc_function & f) {
-		ally_calculator_ = f;
+		std::fill(allies_, allies_ + MAX_SIDES, 0);
 	}
 
 private:
+	typedef std::map<int, bool> share_table;
+	share_table share_maps_;
+	share_table share_vision_;
+
+	////
+	// Alliances, as a matrix of one bit per pair of sides, for sides 1 to MAX_SIDES.
+	//
+	// Sides are allied when they have a team in common, and each side with itself. The matrix is
+	// rebuilt in one pass over the teams when one side's teams changed. Sides beyond MAX_SIDES
+	// are only allied with themselves.
+	////
+	std::vector<std::vector<std::string> > teams_; // by side number - 1
+	boost::uint64_t allies_[MAX_SIDES];            // row of side a - 1, bit of side b - 1
+	bool allies_valid_;
+
+	void rebuild_allies();
 
-	ally_calc_function ally_calculator_;
-
-	std::map<int, bool> share_maps_;
-	std::map<int, bool> share_vision_;
+public:
+	bool are_allied(int a, int b) {
+		if (a < 1 || b < 1 || a > MAX_SIDES || b > MAX_SIDES) {
+			return a == b;
+		}
+		if (!allies_valid_) {
+			rebuild_allies();
+		}
+		return (allies_[a - 1] >> (b - 1)) & 1;
+	}
 
-	typedef std::map< std::pair<int,int>, bool> ally_cache;
-	ally_cache ally_cache_;
+	// The teams of a side, as its teams attribute gives them: names separated by commas
+	void set_teams(int side, const std::string & teams);
 
-public:
-	bool are_allied(int a, int b);
+	void set_share_maps(int side, bool b) { share_maps_[side] = b; invalidate_views(); }
+	void set_share_vision(int side, bool b) { share_vision_[side] = b; invalidate_views(); }
 
 private:
-	typedef loc_map<bool> fog_override;
-	std::map<int, fog_override> fog_override_table_;
+	////
+	// Shroud and fog of each side, as bit planes over one rectangle of the map, so that whole
+	// areas are placed or removed a word at a time. The rectangle grows to take in hexes set
+	// outside of it; hexes outside of it are neither shrouded nor fogged, nor overridden.
+	////
+	struct vision_planes {
+		hex_bitset shroud;
+		hex_bitset fog;
+		hex_bitset has_override; // the fog of the hex is overridden
+		hex_bitset override_fog;  // and this is the override
+	};
+	std::vector<vision_planes> planes_; // by side number
+	hex_bitset bounds_;                 // empty, only holds the rectangle of the planes
+
+	const vision_planes * planes_of(int side) const {
+		return side >= 0 && static_cast<size_t>(side) < planes_.size() ? &planes_[side] : NULL;
+	}
+	vision_planes & planes_for(int side);
+	vision_planes & planes_for(int side, map_location covering);
+	void resize_planes(int x0, int y0, int w, int h);
+
+	////
+	// What a viewing side sees, its planes combined with those of the allies sharing their maps
+	// or vision, a word at a time. Computed when first asked for, and kept until the planes of
+	// one of the sides it was computed from change, or sharing or alliances do.
+	////
+	struct view {
+		hex_bitset shroud;
+		hex_bitset fog;
+		std::vector<int> inputs; // the sides whose planes went into it
+		bool valid;
+
+		view() : shroud(), fog(), inputs(), valid(false) {}
+	};
+	std::vector<view> views_; // by viewing side
 
-	std::map<int, loc_map<bool> > shroud_table_;
+	const view & get_view(int viewing_side);
+	void planes_changed(int side);
+	void invalidate_views();
 
 public:
-	bool true_fog(map_location, int);
-	boost::optional<bool> get_fog_override(map_location l , int t) {
-		auto tab = fog_override_table_[t];
-		auto it = tab.find(l);
-		if (it == tab.end() ) {
+	// The rectangle of the map, so that the planes need not grow one hex at a time
+	void set_bounds(int x0, int y0, int w, int h) { resize_planes(x0, y0, w, h); }
+	// A plane over the current rectangle, for the operations on whole planes below
+	hex_bitset make_plane() const { return hex_bitset(bounds_.x0(), bounds_.y0(), bounds_.width(), bounds_.height()); }
+
+	void set_shroud(map_location l, int s, bool b);
+	void set_fog(map_location l, int s, bool b);
+	void set_fog_override(map_location l, int s, boost::optional<bool> b);
+	void clear_fog_overrides(int s);
+
+	void place_shroud(int s, const hex_bitset & hexes);
+	void remove_shroud(int s, const hex_bitset & hexes);
+	void place_fog(int s, const hex_bitset & hexes);
+	void remove_fog(int s, const hex_bitset & hexes);
+
+	bool true_fog(map_location l, int s) const {
+		const vision_planes * p = planes_of(s);
+		return p && p->fog.test(l);
+	}
+	boost::optional<bool> get_fog_override(map_location l, int s) const {
+		const vision_planes * p = planes_of(s);
+		int i = p ? p->has_override.index(l) : -1;
+		if (i < 0 || !p->has_override.test(static_cast<size_t>(i))) {
 			return boost::none;
 		}
-		return  it->second;
+		return p->override_fog.test(static_cast<size_t>(i));
 	}
-	bool override_adjusted_fog(map_location l, int s) {
+	bool override_adjusted_fog(map_location l, int s) const {
 		if (auto b = get_fog_override(l, s)) {
 			return *b;
 		}
 		return true_fog(l, s);
 	}
 
-	bool ally_adjusted_fog(map_location l, int s) {
-		if (!override_adjusted_fog(l,s)) return false;
-		BOOST_FOREACH(int t, share_vision_ | boost::adaptors::map_keys ) {
-			if (are_allied(s,t) && share_vision_[t] && !override_adjusted_fog(l, t))
-				return false;
-		}
-		return true;
+	bool true_shroud(map_location l, int s) const {
+		const vision_planes * p = planes_of(s);
+		return p && p->shroud.test(l);
 	}
 
+	// Whether a hex is fogged or shrouded for a side, once what its allies see is taken in
+	bool ally_adjusted_fog(map_location l, int s) { return get_view(s).fog.test(l); }
+	bool ally_adjusted_shroud(map_location l, int s) { return get_view(s).shroud.test(l); }
 
-	bool true_shroud(map_location l, int s) {
-		return shroud_table_[s][l];
-	}
-
-	bool ally_adjusted_shroud(map_location l, int s) {
-		if (!true_shroud(l,s)) return false;
-		BOOST_FOREACH(int t, share_maps_ | boost::adaptors::map_keys ) {
-			if (are_allied(s,t) && share_maps_[t] && !true_shroud(l, t))
-				return false;
-		}
-		return true;
-	}
+	// The same for the whole map, over the rectangle of make_plane()
+	const hex_bitset & ally_adjusted_fog(int s) { return get_view(s).fog; }
+	const hex_bitset & ally_adjusted_shroud(int s) { return get_view(s).shroud; }
 };
 
 ////
 // Game data structure
 ////
 
+class vision_engine;
+
 struct game_data {
-	terrain_map terrain_map_;
+	terrain_codes terrain_codes_;
+	terrain_grid terrain_;
 	unit_map units_;
 	pathfind_context map_with_tunnels_;
 	sides sides_;
+	boost::shared_ptr<vision_engine> vision_; // follows the units, and keeps the fog of the sides
 
-	game_data(const geometry & g, const boost::function<bool(int, int)> & ally_calculator)
-		: terrain_map_()
-		, units_()
-		, map_with_tunnels_(g)
-		, sides_(ally_calculator)
-	{}
+	explicit game_data(const geometry & g);
+
+	// Clear everything in place, as if newly constructed. (The grid points at the codes of this
+	// object, so the game data is reset rather than assigned.)
+	void reset(const geometry & g);
+
+	// The map, the units and the sides, for searches and vision
+	pathfind_context::pathing_query resources();
+
+private:
+	game_data(const game_data&); // noncopyable
+	game_data & operator=(const game_data&);
 };
 
 } // end namespace wesnoth
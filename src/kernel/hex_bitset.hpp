@@ -0,0 +1,131 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <vector>
+
+#include <boost/cstdint.hpp>
+
+#include "kernel_types.hpp"
+
+namespace wesnoth {
+
+////
+// One bit per hex of a rectangle of the map, row by row.
+// Hexes outside of the rectangle read as unset, and may not be set.
+////
+
+class hex_bitset {
+public:
+	hex_bitset() : x0_(0), y0_(0), w_(0), h_(0), words_() {}
+
+	hex_bitset(int x0, int y0, int w, int h)
+		: x0_(x0)
+		, y0_(y0)
+		, w_(w)
+		, h_(h)
+		, words_((static_cast<size_t>(w) * h + 63) / 64, 0)
+	{
+	}
+
+	size_t size() const { return static_cast<size_t>(w_) * h_; }
+
+	int x0() const { return x0_; }
+	int y0() const { return y0_; }
+	int width() const { return w_; }
+	int height() const { return h_; }
+	bool same_rectangle(const hex_bitset & o) const { return x0_ == o.x0_ && y0_ == o.y0_ && w_ == o.w_ && h_ == o.h_; }
+
+	// Index of a location, or -1 if it is outside the rectangle
+	int index(map_location loc) const {
+		int x = loc.x - x0_, y = loc.y - y0_;
+		if (x < 0 || y < 0 || x >= w_ || y >= h_) {
+			return -1;
+		}
+		return y * w_ + x;
+	}
+
+	map_location location(size_t i) const {
+		map_location loc;
+		loc.x = x0_ + static_cast<int>(i % w_);
+		loc.y = y0_ + static_cast<int>(i / w_);
+		return loc;
+	}
+
+	bool test(size_t i) const { return (words_[i >> 6] >> (i & 63)) & 1; }
+	void set(size_t i) { words_[i >> 6] |= boost::uint64_t(1) << (i & 63); }
+	void reset(size_t i) { words_[i >> 6] &= ~(boost::uint64_t(1) << (i & 63)); }
+
+	bool test(map_location loc) const {
+		int i = index(loc);
+		return i >= 0 && test(static_cast<size_t>(i));
+	}
+	void set(map_location loc) { set(static_cast<size_t>(index(loc))); }
+	void reset(map_location loc) { reset(static_cast<size_t>(index(loc))); }
+
+	void clear() { std::fill(words_.begin(), words_.end(), 0); }
+
+	// Sets every bit of the rectangle
+	void fill() {
+		std::fill(words_.begin(), words_.end(), ~boost::uint64_t(0));
+		if (size() & 63) {
+			words_.back() = (boost::uint64_t(1) << (size() & 63)) - 1;
+		}
+	}
+
+	// Word by word operations, with a bitset over the same rectangle
+	hex_bitset & operator|=(const hex_bitset & o) {
+		assert(same_rectangle(o));
+		for (size_t k = 0; k < words_.size(); ++k) {
+			words_[k] |= o.words_[k];
+		}
+		return *this;
+	}
+	hex_bitset & operator&=(const hex_bitset & o) {
+		assert(same_rectangle(o));
+		for (size_t k = 0; k < words_.size(); ++k) {
+			words_[k] &= o.words_[k];
+		}
+		return *this;
+	}
+	// Resets the bits set in o
+	hex_bitset & subtract(const hex_bitset & o) {
+		assert(same_rectangle(o));
+		for (size_t k = 0; k < words_.size(); ++k) {
+			words_[k] &= ~o.words_[k];
+		}
+		return *this;
+	}
+
+	size_t count() const {
+		size_t result = 0;
+		for (size_t k = 0; k < words_.size(); ++k) {
+			result += __builtin_popcountll(words_[k]);
+		}
+		return result;
+	}
+
+	// Calls f(location) for each set bit
+	template<typename F>
+	void for_each(F f) const {
+		for (size_t k = 0; k < words_.size(); ++k) {
+			boost::uint64_t w = words_[k];
+			while (w) {
+				size_t i = k * 64 + __builtin_ctzll(w);
+				w &= w - 1;
+				f(location(i));
+			}
+		}
+	}
+
+	const std::vector<boost::uint64_t> & words() const { return words_; }
+	std::vector<boost::uint64_t> & words() { return words_; }
+
+private:
+	int x0_, y0_;
+	int w_, h_;
+	std::vector<boost::uint64_t> words_;
+};
+
+} // end namespace wesnoth
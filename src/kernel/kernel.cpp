@@ -109,7 +109,9 @@ following template:
 
 	template <member_function func>
 	int dispatch(lua_State* L) {
-		return ((*get_kernel_impl(L)).*func)();
+		kimpl& k = *get_kernel_impl(L);
+		kimpl::calling_thread guard(k, L);
+		return (k.*func)();
 	}
 
 ...
@@ -418,18 +420,42 @@ exceptions through lua anyways, it is possible to rig up a mechanism where they
 somewhere until we exit lua and then they are rethrown, however I would rather not do that if it can
 be avoided.
 
+4.) A server may want to run many games at once, on many cores.
+
+Since every kernel owns its own lua_State, and the lua core keeps no global state, we can guarantee
+that distinct kernels can run on distinct threads simultaneously, provided that nothing on the C++ side
+is shared either. The rules we follow to keep it that way:
+* No file-scope or function-static mutable variables in the kernel. Tables of constants (luaL_Reg arrays)
+are fine.
+* The dispatch<> shims only ever look at the extra space of the lua_State they were called with, so
+they always find the right kernel. Coroutines get a copy of the pointer when they are created
+(see luai_userstatethread in luaconf.h), otherwise calling back into the engine from a coroutine would
+read garbage. For the duration of the callback, lua_ points at the calling coroutine so that the
+member function sees its arguments.
+* Process-wide resources which can't be duplicated (the random device used for seeding) are guarded
+by a mutex.
+* The intrusive reference count of the kernel handle is atomic, so handles may be released from any
+thread.
+A single kernel is not synchronized, it should be driven by one thread at a time.
+
 ************/
 
 
+#include "command_log.hpp"
 #include "game_data.hpp"
 #include "kernel.hpp"
+#include "kernel_pool.hpp"
 #include "kernel_types.hpp"
-#include "string_utils.hpp"
+#include "lua_alloc.hpp"
+#include "lua_rng.hpp"
+#include "vision.hpp"
 
 #include "eris/lauxlib.h"
 #include "eris/lua.h"
 #include "eris/lualib.h"
 
+#include <iostream>
+
 // For null ostream...
 #include "boost/iostreams/stream.hpp"
 #include "boost/iostreams/device/null.hpp"
@@ -445,53 +471,54 @@ namespace wesnoth {
 
 class kernel::impl {
 public:
-	impl(kernel::Ctor_it begin, kernel::Ctor_it end);
+	impl(kernel::Ctor_it begin, kernel::Ctor_it end, const boost::shared_ptr<lua_allocator>& alloc);
+	~impl();
+
+	void reset();
 
-	void set_external_log(std::ostream* ext) const { log_.external_log_ = ext; }
+	void set_external_log(std::ostream* ext) const { log_.set_external_log(ext); }
 
-	std::string log() const { return log_.log_.str(); }
+	std::string log() const { return log_.recent(); }
 
 	friend class kernel;
 
+	// While a callback runs, lua_ points at the thread which called it, which is not the main
+	// thread if the call comes from a coroutine. (It is restored also if lua raises an error.)
+	struct calling_thread {
+		impl& k;
+		lua_State* saved;
+		calling_thread(impl& k_arg, lua_State* L) : k(k_arg), saved(k_arg.lua_) { k.lua_ = L; }
+		~calling_thread() { k.lua_ = saved; }
+	};
+
 private:
+	// All memory of the lua state goes through here, so it must be constructed before, and destroyed after, lua_.
+	accounting_allocator alloc_;
+
 	lua_State* lua_;
 
 	game_data game_data_;
 
 	std::string my_name() { return "wesnoth-kernel v 0.0.0, (Eris Lua 5.2.3)"; }
 
-	struct command_log {
-		std::stringstream log_;
-		mutable std::ostream* external_log_;
-
-		command_log() : log_(), external_log_(NULL) {}
-
-		inline command_log& operator<<(const std::string& str) {
-			log_ << str;
-			if (external_log_) {
-				(*external_log_) << str;
-			}
-			return *this;
-		}
-
-		inline command_log& operator<<(char const* str) {
-			if (str != NULL) {
-				log_ << str;
-				if (external_log_) {
-					(*external_log_) << str;
-				}
-			}
-			return *this;
-		}
-	};
-
 	mutable command_log log_;
 
 	void load_C_object_metatables();
 
+	// Registry references to the compiled init script and to the state of the globals before it ran.
+	int init_ref_;
+	int baseline_ref_;
+
+	void run_init();
+	void save_baseline();
+	void restore_baseline();
+	void copy_table_contents(int src, int dst);
+
 	bool load_string(const std::string&);
 	bool protected_call(int nargs, int nrets);
 
+	std::vector<kernel::event_result> execute_batch(const std::vector<std::string>&);
+
 	int intf_print();
 
 	int intf_construct_side();
@@ -502,7 +529,6 @@ private:
 	int intf_update_unit();
 	int intf_update_village();
 
-	bool are_allied(int side1, int side2);
 };
 
 namespace {
@@ -515,9 +541,37 @@ namespace {
 	typedef kernel::impl kimpl;
 	typedef int (kimpl::*member_function)();
 
+	// Calls each of its arguments (chunks, or nil for chunks which failed to load) in protected mode,
+	// and returns for each of them either true, nil, or the error value (false if the error was nil).
+	int run_chunks(lua_State* L) {
+		int n = lua_gettop(L);
+		for (int i = 1; i <= n; ++i) {
+			if (lua_isnil(L, i)) {
+				continue;
+			}
+			lua_pushvalue(L, i);
+			if (lua_pcall(L, 0, 0, 0) == LUA_OK) {
+				lua_pushboolean(L, 1);
+			} else if (lua_isnil(L, -1)) {
+				lua_pop(L, 1);
+				lua_pushboolean(L, 0); // error() or error(nil) must not look like a chunk which failed to load
+			}
+			lua_replace(L, i);
+		}
+		return n;
+	}
+
+	// Same as the panic function of luaL_newstate, which we can't use since we provide our own allocator.
+	int panic(lua_State* L) {
+		std::cerr << "PANIC: unprotected error in call to Lua API (" << lua_tostring(L, -1) << ")\n";
+		return 0; // return to Lua to abort
+	}
+
 	template <member_function func>
 	int dispatch(lua_State* L) {
-		return ((*get_kernel_impl(L)).*func)();
+		kimpl& k = *get_kernel_impl(L);
+		kimpl::calling_thread guard(k, L);
+		return (k.*func)();
 	}
 
 
@@ -549,12 +603,16 @@ int kernel::impl::intf_print() {
 	return 0;
 }
 
-kernel::impl::impl(kernel::Ctor_it begin, kernel::Ctor_it end)
-	: lua_(luaL_newstate())
-	, game_data_(hex(), boost::bind(&impl::are_allied, this, _1, _2))
+kernel::impl::impl(kernel::Ctor_it begin, kernel::Ctor_it end, const boost::shared_ptr<lua_allocator>& alloc)
+	: alloc_(alloc)
+	, lua_(lua_newstate(&accounting_allocator::lua_alloc, &alloc_))
+	, game_data_(hex())
 	, log_()
+	, init_ref_(LUA_NOREF)
+	, baseline_ref_(LUA_NOREF)
 {
 	get_kernel_impl(lua_) = this;
+	lua_atpanic(lua_, &panic);
 
 	lua_State * L = lua_;
 
@@ -643,9 +701,28 @@ kernel::impl::impl(kernel::Ctor_it begin, kernel::Ctor_it end)
 
 	load_C_object_metatables();
 
+	save_baseline();
+
 	std::string script(begin, end); // this can be done differently later
 
 	if (load_string(script.c_str())) {
+		// Keep the compiled chunk around, so that a reset doesn't need to parse it again.
+		lua_pushvalue(lua_, -1);
+		init_ref_ = luaL_ref(lua_, LUA_REGISTRYINDEX);
+		lua_pop(lua_, 1);
+	}
+
+	run_init();
+}
+
+kernel::impl::~impl() {
+	lua_close(lua_);
+}
+
+// Runs the init script, then cleans up after it. (The "engine" table is only meant to be used by the init script.)
+void kernel::impl::run_init() {
+	if (init_ref_ != LUA_NOREF) {
+		lua_rawgeti(lua_, LUA_REGISTRYINDEX, init_ref_);
 		protected_call(0, 0);
 	}
 
@@ -655,8 +732,150 @@ kernel::impl::impl(kernel::Ctor_it begin, kernel::Ctor_it end)
 	lua_setglobal(lua_, "engine");
 }
 
+// Records the contents and the metatable of every table reachable from the registry (the globals, the
+// libraries, package.loaded, the engine callbacks, the C object metatables, and whatever those hold),
+// and the metatable of strings, as they are before the init script runs. The registry itself isn't
+// recorded, since the kernel keeps its own references there.
+//
+// The registry entry is a table of the form { [1] = { [t] = { copy of t, metatable of t or false } },
+// [2] = metatable of strings or false }.
+void kernel::impl::save_baseline() {
+	lua_State* L = lua_;
+	lua_settop(L, 0);
+
+	lua_createtable(L, 2, 0); // 1: the baseline
+	lua_newtable(L);          // 2: the records, by table
+	lua_newtable(L);          // 3: the tables still to record, in an array
+	int queued = 0;
+
+	// Queues the value at index i if it is a table not seen yet
+	auto visit = [&](int i) {
+		i = lua_absindex(L, i);
+		if (!lua_istable(L, i)) {
+			return;
+		}
+		lua_pushvalue(L, i);
+		lua_rawget(L, 2);
+		bool seen = !lua_isnil(L, -1);
+		lua_pop(L, 1);
+		if (!seen) {
+			lua_pushvalue(L, i);
+			lua_pushboolean(L, 1);
+			lua_rawset(L, 2);
+			lua_pushvalue(L, i);
+			lua_rawseti(L, 3, ++queued);
+		}
+	};
+
+	for (lua_pushnil(L); lua_next(L, LUA_REGISTRYINDEX); lua_pop(L, 1)) {
+		visit(-2);
+		visit(-1);
+	}
+
+	lua_pushliteral(L, "");
+	if (!lua_getmetatable(L, -1)) {
+		lua_pushboolean(L, 0);
+	}
+	visit(-1);
+	lua_rawseti(L, 1, 2);
+	lua_pop(L, 1);
+
+	for (int n = 1; n <= queued; ++n) {
+		lua_rawgeti(L, 3, n);     // 4: the table
+		lua_createtable(L, 2, 0); // 5: its record
+		lua_newtable(L);          // 6: its copy
+		for (lua_pushnil(L); lua_next(L, 4); lua_pop(L, 1)) {
+			visit(-2);
+			visit(-1);
+			lua_pushvalue(L, -2);
+			lua_pushvalue(L, -2);
+			lua_rawset(L, 6);
+		}
+		lua_rawseti(L, 5, 1);
+		if (lua_getmetatable(L, 4)) {
+			visit(-1);
+		} else {
+			lua_pushboolean(L, 0);
+		}
+		lua_rawseti(L, 5, 2);
+		lua_rawset(L, 2);
+	}
+
+	lua_pop(L, 1);
+	lua_rawseti(L, 1, 1);
+	baseline_ref_ = luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+// Puts the contents and the metatables of all the tables recorded by save_baseline back the way they were.
+// (Strict mode and such are implemented with a metatable on _G.)
+void kernel::impl::restore_baseline() {
+	lua_State* L = lua_;
+	lua_settop(L, 0);
+
+	lua_rawgeti(L, LUA_REGISTRYINDEX, baseline_ref_); // 1
+	lua_rawgeti(L, 1, 1); // 2: the records
+
+	for (lua_pushnil(L); lua_next(L, 2); lua_pop(L, 1)) {
+		// 3: the table, 4: its record
+		lua_rawgeti(L, 4, 1);
+		copy_table_contents(5, 3);
+		lua_pop(L, 1);
+
+		lua_rawgeti(L, 4, 2);
+		if (!lua_istable(L, -1)) {
+			lua_pop(L, 1);
+			lua_pushnil(L);
+		}
+		lua_setmetatable(L, 3);
+	}
+
+	lua_pushliteral(L, "");
+	lua_rawgeti(L, 1, 2);
+	if (!lua_istable(L, -1)) {
+		lua_pop(L, 1);
+		lua_pushnil(L);
+	}
+	lua_setmetatable(L, -2);
+
+	lua_settop(L, 0);
+}
+
+// Makes the table at index dst a shallow copy of the table at index src, using raw access only.
+void kernel::impl::copy_table_contents(int src, int dst) {
+	lua_State* L = lua_;
+
+	// Assigning nil to an existing field during traversal is allowed by lua_next.
+	for (lua_pushnil(L); lua_next(L, dst); lua_pop(L, 1)) {
+		lua_pushvalue(L, -2);
+		lua_pushnil(L);
+		lua_rawset(L, dst);
+	}
+
+	for (lua_pushnil(L); lua_next(L, src); lua_pop(L, 1)) {
+		lua_pushvalue(L, -2);
+		lua_pushvalue(L, -2);
+		lua_rawset(L, dst);
+	}
+}
+
+void kernel::impl::reset() {
+	restore_baseline();
+
+	game_data_.reset(hex());
+
+	log_.clear();
+	log_ << "Resetting " << my_name() << "...\n";
+
+	run_init();
+
+	lua_gc(lua_, LUA_GCCOLLECT, 0);
+}
+
+
 void kernel::impl::load_C_object_metatables() {
 	//lua_terrain_map::load_table();
+	lua_rng::load_tables(lua_);
+	lua_alloc::load_tables(lua_);
 }
 
 bool kernel::impl::load_string(const std::string& str) {
@@ -685,6 +904,7 @@ bool kernel::impl::load_string(const std::string& str) {
 		std::cerr << " --- ERROR ---\n";
 		std::cerr << context << ":\n" << message << std::endl;
 		std::cerr << " -------------\n";
+		log_.write(command_log::ERROR, context + ":\n" + message);
 		return false;
 	}
 	return true;
@@ -718,51 +938,97 @@ bool kernel::impl::protected_call(int nargs, int nrets) {
 		std::cerr << " --- ERROR ---\n";
 		std::cerr << context << ":\n" << message << std::endl;
 		std::cerr << " -------------\n";
+		log_.write(command_log::ERROR, context + ":\n" + message);
 
 		return false;
 	}
 	return true;
 }
 
-bool kernel::impl::are_allied(int side1, int side2) {
-	std::string teams1;
-	std::string teams2;
+std::vector<kernel::event_result> kernel::impl::execute_batch(const std::vector<std::string>& chunks) {
+	lua_State* L = lua_;
+	const int n = chunks.size();
+	std::vector<kernel::event_result> results(n);
 
-	{
-		lua_getglobal(lua_, "Sides");
-		lua_pushvalue(lua_, -1); //copy it for later
-
-		lua_pushinteger(lua_, side1);
-		lua_rawget(lua_, -2);
-		lua_pushstring(lua_, "teams");
-		lua_rawget(lua_, -2);
-		if (const char * str = lua_tostring(lua_, -1)) {
-			teams1 = str;
+	if (!lua_checkstack(L, n + 1)) {
+		BOOST_FOREACH(kernel::event_result& r, results) {
+			r.error = "stack overflow";
 		}
-		lua_pop(lua_, 1);
+		return results;
+	}
 
-		lua_pushinteger(lua_, side2);
-		lua_rawget(lua_, -2);
-		lua_pushstring(lua_, "teams");
-		lua_rawget(lua_, -2);
-		if (const char * str = lua_tostring(lua_, -1)) {
-			teams2 = str;
+	lua_pushcfunction(L, &run_chunks);
+	for (int i = 0; i < n; ++i) {
+		if (!load_string(chunks[i])) {
+			lua_pushnil(L);
+			results[i].error = "parse error";
 		}
-		lua_pop(lua_, 1);
 	}
 
-	auto t1_vec = string_utils::split(teams1);
-	auto t2_vec = string_utils::split(teams2);
-	BOOST_FOREACH(const std::string & t1, t1_vec) {
-		if (std::find(t2_vec.begin(), t2_vec.end(), t1) != t2_vec.end()) {
-			return true;
+	int errcode = lua_pcall(L, n, n, 0);
+	if (errcode != LUA_OK) {
+		char const* msg = lua_tostring(L, -1);
+		std::string message = msg ? msg : "null string";
+		std::cerr << " --- ERROR ---\n";
+		std::cerr << "When executing a batch, Lua error:\n" << message << std::endl;
+		std::cerr << " -------------\n";
+		log_.write(command_log::ERROR, "When executing a batch, Lua error:\n" + message);
+		lua_pop(L, 1);
+
+		BOOST_FOREACH(kernel::event_result& r, results) {
+			if (!r.error) {
+				r.error = "runtime error";
+			}
+		}
+		return results;
+	}
+
+	for (int i = 0; i < n; ++i) {
+		int idx = -n + i;
+		bool ok = lua_type(L, idx) == LUA_TBOOLEAN && lua_toboolean(L, idx);
+		if (!ok && !results[i].error) { // chunks which failed to parse already have their error
+			char const* msg = lua_tostring(L, idx);
+			std::string message = msg ? msg : "null string";
+			std::cerr << " --- ERROR ---\n";
+			std::cerr << "When executing, Lua runtime error:\n" << message << std::endl;
+			std::cerr << " -------------\n";
+			log_.write(command_log::ERROR, "When executing, Lua runtime error:\n" + message);
+			results[i].error = "runtime error";
 		}
 	}
-	return false;
+	lua_pop(L, n);
+
+	return results;
 }
 
+// Called when a side is assigned to the Sides table, with its number and the side (or nil), which it returns to be stored.
 int kernel::impl::intf_construct_side() {
-	return 0;
+	int side = luaL_checkint(lua_, 1);
+	if (side < 1) {
+		return luaL_error(lua_, "sides are numbered from 1, not %d", side);
+	}
+	std::string teams; // a side set to nil has no teams, so it is allied only with itself, and no fog
+	bool fog = false;
+	if (lua_istable(lua_, 2)) {
+		lua_getfield(lua_, 2, "teams");
+		if (!lua_isnil(lua_, -1)) {
+			if (lua_type(lua_, -1) != LUA_TSTRING) {
+				return luaL_error(lua_, "side %d: teams must be a string, not a %s", side, luaL_typename(lua_, -1));
+			}
+			teams = lua_tostring(lua_, -1);
+		}
+		lua_getfield(lua_, 2, "fog");
+		fog = lua_toboolean(lua_, -1);
+		lua_pop(lua_, 2);
+	} else if (!lua_isnoneornil(lua_, 2)) {
+		return luaL_error(lua_, "side %d must be a table or nil, not a %s", side, luaL_typename(lua_, 2));
+	}
+	game_data_.sides_.set_teams(side, teams);
+	game_data_.map_with_tunnels_.invalidate_units(); // what the sides can pass through changed with the alliances
+	game_data_.vision_->use_fog(side, fog);
+
+	lua_settop(lua_, 2);
+	return 1;
 }
 
 int kernel::impl::intf_construct_unit() {
@@ -774,10 +1040,140 @@ int kernel::impl::intf_is_map_location() {
 int kernel::impl::intf_update_label() {
 	return 0;
 }
+// Called either with the map_data of a scenario, which replaces the whole map, or with a location and the
+// terrain id of that hex, nil to take it off the map.
 int kernel::impl::intf_update_terrain() {
+	pathfind_context & context = game_data_.map_with_tunnels_;
+	if (lua_type(lua_, 1) == LUA_TSTRING) {
+		size_t len;
+		const char * data = lua_tolstring(lua_, 1, &len);
+		read_map_data(data, data + len, game_data_.terrain_codes_, game_data_.terrain_);
+		context.invalidate_layout();
+		game_data_.vision_->rebuild(game_data_.resources());
+		return 0;
+	}
+
+	luaL_checktype(lua_, 1, LUA_TTABLE);
+	lua_getfield(lua_, 1, "x");
+	lua_getfield(lua_, 1, "y");
+	if (!lua_isnumber(lua_, -2) || !lua_isnumber(lua_, -1)) {
+		return luaL_error(lua_, "terrain must be keyed to a location with numbers x and y");
+	}
+	lua_Number x = lua_tonumber(lua_, -2), y = lua_tonumber(lua_, -1);
+	if (!(x >= -32768 && x <= 32767 && y >= -32768 && y <= 32767)) { // the range of packed_location
+		return luaL_error(lua_, "terrain can't be set at %f,%f, out of the range of map locations", x, y);
+	}
+	map_location loc;
+	loc.x = static_cast<int>(x);
+	loc.y = static_cast<int>(y);
+	lua_pop(lua_, 2);
+
+	terrain_code c = terrain_codes::NONE;
+	if (!lua_isnoneornil(lua_, 2)) {
+		size_t len;
+		const char * id = luaL_checklstring(lua_, 2, &len);
+		c = game_data_.terrain_codes_.intern(id, id + len);
+		if (c == terrain_codes::NONE) {
+			return luaL_error(lua_, "too many distinct terrains, can't add '%s'", id);
+		}
+	}
+	if (!context.set_terrain(game_data_.terrain_, loc, c)) {
+		return luaL_error(lua_, "terrain at %d,%d is too far from the map", loc.x, loc.y);
+	}
 	return 0;
 }
+// Called with a unit whose fields changed. What pathfinding and vision need of it is copied into the unit map now,
+// so that searches read it from there and never through the unit. Fields which aren't set are left as they were.
+// A unit the map doesn't hold yet is added once it has a location, and a unit whose location is false is taken
+// off the map. The vision engine follows each change, to keep the fog of the sides.
 int kernel::impl::intf_update_unit() {
+	luaL_checkany(lua_, 1);
+	lua_getfield(lua_, 1, "id");
+	bool known = lua_isnumber(lua_, -1);
+	int id = known ? static_cast<int>(lua_tointeger(lua_, -1)) : 0;
+	lua_pop(lua_, 1);
+	if (!known) {
+		return 0;
+	}
+
+	unit_map & units = game_data_.units_;
+	pathfind_context::pathing_query resources = game_data_.resources();
+	unit_map::iterator it = units.find(id);
+
+	lua_getfield(lua_, 1, "location");
+	if (lua_isboolean(lua_, -1) && !lua_toboolean(lua_, -1)) {
+		lua_pop(lua_, 1);
+		if (it != units.end()) {
+			units.erase(it);
+			game_data_.vision_->unit_removed(id, resources);
+			game_data_.map_with_tunnels_.invalidate_units();
+		}
+		return 0;
+	}
+	boost::optional<map_location> to;
+	if (lua_istable(lua_, -1)) {
+		lua_getfield(lua_, -1, "x");
+		lua_getfield(lua_, -2, "y");
+		if (lua_isnumber(lua_, -2) && lua_isnumber(lua_, -1)) {
+			map_location loc;
+			loc.x = static_cast<int>(lua_tointeger(lua_, -2));
+			loc.y = static_cast<int>(lua_tointeger(lua_, -1));
+			to = loc;
+		}
+		lua_pop(lua_, 2);
+	}
+	lua_pop(lua_, 1);
+
+	unit_state s = it != units.end() ? units.state(*it) : unit_state();
+	lua_getfield(lua_, 1, "side");
+	if (lua_isnumber(lua_, -1)) {
+		s.side = static_cast<int>(lua_tointeger(lua_, -1));
+		if (s.side < 0 || s.side > 0x7fff) { // the unit table keeps these in 16 bits
+			return luaL_error(lua_, "unit %d can't be on side %d", id, s.side);
+		}
+	}
+	lua_getfield(lua_, 1, "hidden");
+	if (!lua_isnil(lua_, -1)) {
+		s.hidden = lua_toboolean(lua_, -1);
+	}
+	lua_getfield(lua_, 1, "zoc");
+	if (!lua_isnil(lua_, -1)) {
+		s.emits_zoc = lua_toboolean(lua_, -1);
+	}
+	lua_getfield(lua_, 1, "vision");
+	if (lua_isnumber(lua_, -1)) {
+		s.vision = static_cast<int>(lua_tointeger(lua_, -1));
+		if (s.vision < -1 || s.vision > 0x7fff) {
+			return luaL_error(lua_, "unit %d can't have vision %d", id, s.vision);
+		}
+	}
+	lua_getfield(lua_, 1, "jamming");
+	if (lua_isnumber(lua_, -1)) {
+		s.jamming = static_cast<int>(lua_tointeger(lua_, -1));
+		if (s.jamming < 0 || s.jamming > 0x7fff) {
+			return luaL_error(lua_, "unit %d can't have jamming %d", id, s.jamming);
+		}
+	}
+	lua_pop(lua_, 5);
+
+	if (it == units.end()) {
+		if (!to) {
+			return 0;
+		}
+		std::pair<unit_map::iterator, bool> added = units.insert(unit_rec(id, *to, unit()), s);
+		if (!added.second) {
+			return luaL_error(lua_, "unit %d can't be placed at %d,%d, another unit is there", id, to->x, to->y);
+		}
+		it = added.first;
+	} else {
+		units.update(it, s);
+		if (to) {
+			units.move(it, *to);
+		}
+	}
+
+	game_data_.vision_->unit_changed(*it, resources);
+	game_data_.map_with_tunnels_.invalidate_units();
 	return 0;
 }
 int kernel::impl::intf_update_village() {
@@ -789,13 +1185,20 @@ int kernel::impl::intf_update_village() {
 // Implement HANDLE methods (class kernel)
 ////
 
-kernel::kernel(kernel::Ctor_it begin, kernel::Ctor_it end) : impl_(new kernel::impl(begin, end)), ref_count_(0) {
+kernel::kernel(kernel::Ctor_it begin, kernel::Ctor_it end) : impl_(new kernel::impl(begin, end, boost::shared_ptr<lua_allocator>())), ref_count_(0), pool_() {
+}
+
+kernel::kernel(kernel::Ctor_it begin, kernel::Ctor_it end, const boost::shared_ptr<lua_allocator>& alloc) : impl_(new kernel::impl(begin, end, alloc)), ref_count_(0), pool_() {
 }
 
 // Needed to be defined in the .cpp so that boost::scoped_ptr can be used for the impl
 kernel::~kernel() {
 }
 
+void kernel::reset() {
+	impl_->reset();
+}
+
 kernel::event_result kernel::fire_event(const std::string&) {
 	return {};
 }
@@ -830,19 +1233,22 @@ kernel::SIDE_RESULT kernel::get_side_result(int side) const {
 kernel::CONTROLLER kernel::get_side_controller(int side) const {
 	return EMPTY;
 }
+bool kernel::is_allied(int side1, int side2) const {
+	return impl_->game_data_.sides_.are_allied(side1, side2);
+}
 
 bool kernel::is_on_map(map_location loc) const {
-	return true;
+	return impl_->game_data_.terrain_.on_map(loc);
 }
 bool kernel::is_adjacent(map_location loc1, map_location loc2) const {
-	return true;
+	return impl_->game_data_.map_with_tunnels_.adjacent(loc1, loc2);
 }
 
 bool kernel::is_fogged(map_location loc, int viewing_team) const {
-	return true;
+	return impl_->game_data_.sides_.ally_adjusted_fog(loc, viewing_team);
 }
 bool kernel::is_shrouded(map_location loc, int viewing_team) const {
-	return true;
+	return impl_->game_data_.sides_.ally_adjusted_shroud(loc, viewing_team);
 }
 
 config kernel::read_report(const std::string& name, int viewing_team) const {
@@ -870,21 +1276,43 @@ kernel::event_result kernel::execute(const std::string& prog) {
 	return result;
 }
 
+std::vector<kernel::event_result> kernel::execute_batch(const std::vector<std::string>& progs) {
+	return impl_->execute_batch(progs);
+}
+
 std::string kernel::log() const {
 	return impl_->log();
 }
 
+std::vector<command_log::entry> kernel::log_entries(boost::uint64_t since) const {
+	return impl_->log_.entries(since);
+}
+
 void kernel::set_external_log(std::ostream* str) const {
 	impl_->set_external_log(str);
 }
 
+void kernel::flush_log() const {
+	impl_->log_.flush();
+}
+
+lua_memory_stats kernel::memory_stats() const {
+	return impl_->alloc_.stats();
+}
+
+void kernel::set_memory_limit(size_t bytes) {
+	impl_->alloc_.set_limit(bytes);
+}
+
 void kernel::add_ref() const {
 	++ref_count_;
 }
 
 void kernel::del_ref() const {
 	if (--ref_count_ == 0) {
-		delete this;
+		if (!pool_ || !pool_->recycle(this)) {
+			delete this;
+		}
 	}
 }
 
@@ -1,11 +1,24 @@
 #pragma once
 
+#include <atomic>
+
 #include <boost/scoped_ptr.hpp>
 
+#include "command_log.hpp"
 #include "kernel_types.hpp"
+#include "lua_alloc.hpp"
 
 namespace wesnoth {
 
+class pool_link;
+
+////
+// Threads: Distinct kernel objects share no mutable state, and may be used on
+// different threads at the same time. A single kernel is not synchronized, and
+// must only be used by one thread at a time. The exception is the intrusive
+// reference count, which may be modified from any thread.
+////
+
 class kernel {
 
 	//****
@@ -14,11 +27,30 @@ class kernel {
 public:
 	typedef std::string::iterator Ctor_it;
 	kernel(Ctor_it begin, Ctor_it end); // Pass Lua script to load
+
+	// As above, with the lua state allocating through the given strategy (malloc if NULL).
+	// The kernel keeps the allocator alive as long as it needs it.
+	kernel(Ctor_it begin, Ctor_it end, const boost::shared_ptr<lua_allocator>& alloc);
 	~kernel();
 
 private:
 	kernel(const kernel&); // private copy ctor unimplemented for now
 
+public:
+	////
+	// Return the kernel to the state it had right after construction.
+	// This reuses the lua state, the opened libraries and the already compiled
+	// init script, so it is much cheaper than constructing a new kernel.
+	//
+	// Every table which existed before the init script ran, however deeply nested
+	// (package.loaded, the metatables of the C objects...), gets back its contents
+	// and metatable, and strings get back their metatable. Tables made later are
+	// forgotten. What isn't restored is the state inside C objects (userdata) which
+	// the game kept across the reset.
+	////
+
+	void reset();
+
 	//****
 	// WRITE ACCESS
 	//****
@@ -51,6 +83,13 @@ public:
 
 	event_result execute(const std::string& lua); // Todo: Return a variant?
 
+	////
+	// Execute several chunks of lua code in the game, entering lua only once.
+	// There is one result per chunk. A chunk which fails does not stop the later ones.
+	////
+
+	std::vector<event_result> execute_batch(const std::vector<std::string>& lua);
+
 	////
 	// Execute an AI turn in the game for the current player.
 	////
@@ -84,6 +123,7 @@ public:
 	enum CONTROLLER { HUMAN, AI, NETWORK, NETWORK_AI, EMPTY };
 
 	CONTROLLER get_side_controller(int side) const;
+	bool is_allied(int side1, int side2) const;
 
 	// Locations and vision
 
@@ -107,11 +147,30 @@ public:
 
 	////
 	// Get the logs
+	// The kernel keeps only a bounded window of recent lines. Entries carry a
+	// severity and a sequence number, so a reader can ask for what is new since
+	// the last time it looked.
 
 	std::string log() const;
 
+	std::vector<command_log::entry> log_entries(boost::uint64_t since = 0) const;
+
+	// New lines are mirrored to the external log from a background thread.
+	// flush_log waits until everything logged so far has been written there.
 	void set_external_log(std::ostream*) const;
 
+	void flush_log() const;
+
+	////
+	// Memory used by the lua state.
+	// Once a limit is set, lua code which would grow the state beyond it fails
+	// with a memory error, after lua tried a full garbage collection. 0 is no limit.
+	////
+
+	lua_memory_stats memory_stats() const;
+
+	void set_memory_limit(size_t bytes);
+
 	////
 	// PIMPL idiom
 	////
@@ -123,7 +182,13 @@ private:
 	////
 	// Detail: Allow intrusive pointer to the handle.
 	////
-	mutable int ref_count_;
+	mutable std::atomic<int> ref_count_;
+
+	////
+	// Detail: If the kernel was leased from a pool, the last release returns it there instead of deleting it.
+	////
+	friend class kernel_pool;
+	mutable boost::shared_ptr<pool_link> pool_;
 
 public:
 	void add_ref() const;
@@ -0,0 +1,256 @@
+#include "kernel_pool.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <ostream>
+
+#include <boost/foreach.hpp>
+
+namespace wesnoth {
+
+typedef std::chrono::steady_clock pool_clock;
+
+static double elapsed_us(pool_clock::time_point start) {
+	return std::chrono::duration<double, std::micro>(pool_clock::now() - start).count();
+}
+
+////
+// pool_link
+////
+
+pool_link::pool_link(kernel_pool* pool)
+	: mutex_()
+	, returned_()
+	, pool_(pool)
+	, returning_(0)
+{
+}
+
+bool pool_link::recycle(const kernel* k) {
+	kernel_pool* pool;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		pool = pool_;
+		if (!pool) {
+			return false;
+		}
+		++returning_;
+	}
+
+	pool->recycle(k);
+
+	std::lock_guard<std::mutex> lock(mutex_);
+	if (--returning_ == 0) {
+		returned_.notify_all();
+	}
+	return true;
+}
+
+void pool_link::detach() {
+	std::unique_lock<std::mutex> lock(mutex_);
+	pool_ = NULL;
+	returned_.wait(lock, [this]() { return returning_ == 0; });
+}
+
+////
+// kernel_pool
+////
+
+kernel_pool::stats::stats()
+	: idle(0)
+	, leased(0)
+	, created(0)
+	, acquires(0)
+	, hits(0)
+	, resets(0)
+	, reset_failures(0)
+	, total_reset_us(0)
+	, max_reset_us(0)
+	, total_create_us(0)
+{
+}
+
+kernel_pool::kernel_pool(const std::string& init_script, size_t initial_size, size_t max_idle, const lua_allocator_factory& allocators)
+	: init_script_(init_script)
+	, max_idle_(max_idle)
+	, allocators_(allocators)
+	, link_(new pool_link(this))
+	, mutex_()
+	, returned_()
+	, idle_()
+	, dirty_()
+	, leased_()
+	, stopping_(false)
+	, stats_()
+	, resetter_(&kernel_pool::run_resets, this)
+{
+	reserve(initial_size);
+}
+
+kernel_pool::~kernel_pool() {
+	// The kernels still leased keep the link, and delete themselves once it is detached. Those being
+	// returned right now are waited for, they end up in the pool.
+	link_->detach();
+
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		stopping_ = true;
+	}
+	returned_.notify_all();
+	resetter_.join();
+
+	BOOST_FOREACH(kernel* k, idle_) {
+		delete k;
+	}
+	BOOST_FOREACH(kernel* k, dirty_) {
+		delete k;
+	}
+}
+
+// Constructs a kernel outside of the lock, since this is the expensive part.
+kernel* kernel_pool::create() {
+	std::string script(init_script_);
+
+	pool_clock::time_point start = pool_clock::now();
+	kernel* k = new kernel(script.begin(), script.end(), allocators_ ? allocators_() : boost::shared_ptr<lua_allocator>());
+	double us = elapsed_us(start);
+
+	std::lock_guard<std::mutex> lock(mutex_);
+	++stats_.created;
+	stats_.total_create_us += us;
+	return k;
+}
+
+kernel_pool::handle kernel_pool::acquire() {
+	kernel* k = NULL;
+	bool dirty = false;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		++stats_.acquires;
+		if (!idle_.empty()) {
+			++stats_.hits;
+			k = idle_.back();
+			idle_.pop_back();
+		} else if (!dirty_.empty()) {
+			++stats_.hits;
+			k = dirty_.back();
+			dirty_.pop_back();
+			dirty = true;
+		}
+	}
+
+	if (dirty && !reset(k)) {
+		k = NULL;
+	}
+	if (!k) {
+		k = create();
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		leased_.insert(k);
+	}
+	k->pool_ = link_;
+	return handle(k);
+}
+
+void kernel_pool::reserve(size_t n) {
+	for (;;) {
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			if (idle_.size() + dirty_.size() >= n) {
+				return;
+			}
+		}
+		kernel* k = create();
+
+		std::lock_guard<std::mutex> lock(mutex_);
+		idle_.push_back(k);
+	}
+}
+
+// Called through the link by kernel::del_ref when the last handle to a leased kernel is released.
+// The kernel is only queued for the reset thread here.
+void kernel_pool::recycle(const kernel* ck) {
+	kernel* k = const_cast<kernel*>(ck);
+
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		leased_.erase(k);
+		if (idle_.size() + dirty_.size() < max_idle_) {
+			dirty_.push_back(k);
+			k = NULL;
+		}
+	}
+
+	if (k) {
+		delete k;
+	} else {
+		returned_.notify_one();
+	}
+}
+
+bool kernel_pool::reset(kernel* k) {
+	pool_clock::time_point start = pool_clock::now();
+	try {
+		k->reset();
+	} catch (...) {
+		delete k;
+		std::lock_guard<std::mutex> lock(mutex_);
+		++stats_.reset_failures;
+		return false;
+	}
+	double us = elapsed_us(start);
+
+	std::lock_guard<std::mutex> lock(mutex_);
+	++stats_.resets;
+	stats_.total_reset_us += us;
+	stats_.max_reset_us = std::max(stats_.max_reset_us, us);
+	return true;
+}
+
+void kernel_pool::run_resets() {
+	std::unique_lock<std::mutex> lock(mutex_);
+	for (;;) {
+		returned_.wait(lock, [this]() { return stopping_ || !dirty_.empty(); });
+		if (stopping_) {
+			return; // the destructor deletes what is left
+		}
+		kernel* k = dirty_.back();
+		dirty_.pop_back();
+
+		lock.unlock();
+		bool ok = reset(k);
+		lock.lock();
+
+		if (!ok) {
+			continue;
+		}
+		// The pool may have filled up with kernels reserved meanwhile
+		if (idle_.size() + dirty_.size() < max_idle_) {
+			idle_.push_back(k);
+		} else {
+			lock.unlock();
+			delete k;
+			lock.lock();
+		}
+	}
+}
+
+kernel_pool::stats kernel_pool::get_stats() const {
+	std::lock_guard<std::mutex> lock(mutex_);
+	stats result = stats_;
+	result.idle = idle_.size() + dirty_.size();
+	result.leased = leased_.size();
+	return result;
+}
+
+std::ostream& operator<<(std::ostream& os, const kernel_pool::stats& s) {
+	os << "kernel pool: " << s.idle << " idle, " << s.leased << " leased, " << s.created << " created\n";
+	os << "  acquires: " << s.acquires << ", hits: " << s.hits << " (hit rate " << 100.0 * s.hit_rate() << "%)\n";
+	os << "  construction: mean " << s.mean_create_us() << " us\n";
+	os << "  resets: " << s.resets << ", mean " << s.mean_reset_us() << " us, max " << s.max_reset_us << " us, " << s.reset_failures << " failed\n";
+	return os;
+}
+
+} // end namespace wesnoth
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <condition_variable>
+#include <iosfwd>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/intrusive_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+
+#include "kernel.hpp"
+
+namespace wesnoth {
+
+////
+// A pool of pre-initialized kernels, for processes which host many games at once.
+//
+// Kernels are handed out as intrusive pointers. When the last pointer to a leased
+// kernel goes away, the kernel is handed to the reset thread of the pool, which resets
+// it and puts it back in the pool, rather than deleted. So releasing a handle costs no
+// more than queueing the kernel, on whichever thread releases it. An acquire which finds
+// no kernel reset yet takes one which was returned, and resets it itself. If the pool
+// already holds max_idle kernels, reset or not, a returning kernel is deleted instead,
+// and so is a kernel whose reset throws.
+//
+// The pool is thread safe. It should outlive the kernels leased from it, but if it
+// doesn't, the outstanding kernels are detached and simply delete themselves later.
+//
+// Between games a kernel is reset, see kernel::reset for what that restores.
+////
+
+class kernel_pool;
+
+////
+// What a leased kernel holds on to, to get back to its pool. The pool detaches it when it is
+// destroyed, first waiting for the kernels which are being returned right then.
+////
+
+class pool_link {
+public:
+	explicit pool_link(kernel_pool* pool);
+
+	// Hand a kernel whose last handle was released to the pool. Returns false if the pool is gone.
+	bool recycle(const kernel*);
+
+	void detach();
+
+private:
+	pool_link(const pool_link&); // noncopyable
+
+	std::mutex mutex_;
+	std::condition_variable returned_;
+	kernel_pool* pool_;
+	size_t returning_; // kernels being handed to the pool right now
+};
+
+class kernel_pool {
+public:
+	typedef boost::intrusive_ptr<kernel> handle;
+
+	// If given, the factory makes the allocation strategy of each new kernel. It may be called from any thread.
+	kernel_pool(const std::string& init_script, size_t initial_size = 0, size_t max_idle = 64, const lua_allocator_factory& allocators = lua_allocator_factory());
+	~kernel_pool();
+
+	// Take a kernel from the pool, constructing a new one if none are idle.
+	handle acquire();
+
+	// Make sure that at least n kernels are idle.
+	void reserve(size_t n);
+
+	struct stats {
+		size_t idle;     // kernels waiting in the pool
+		size_t leased;   // kernels currently handed out
+		size_t created;  // kernels constructed over the lifetime of the pool
+		size_t acquires; // calls to acquire
+		size_t hits;     // calls to acquire which were served by an idle kernel
+
+		size_t resets;          // kernels reset and returned to the pool
+		size_t reset_failures;  // kernels deleted since their reset threw
+		double total_reset_us;  // time spent in kernel::reset, in microseconds
+		double max_reset_us;
+		double total_create_us; // time spent constructing kernels, in microseconds
+
+		stats();
+
+		double hit_rate() const { return acquires ? static_cast<double>(hits) / acquires : 0.0; }
+		double mean_reset_us() const { return resets ? total_reset_us / resets : 0.0; }
+		double mean_create_us() const { return created ? total_create_us / created : 0.0; }
+	};
+
+	stats get_stats() const;
+
+private:
+	kernel_pool(const kernel_pool&); // noncopyable
+
+	kernel* create();
+	// Resets a returned kernel, or deletes it and returns false if that throws
+	bool reset(kernel*);
+	void run_resets();
+
+	friend class pool_link;
+	void recycle(const kernel*);
+
+	std::string init_script_;
+	size_t max_idle_;
+	lua_allocator_factory allocators_;
+	boost::shared_ptr<pool_link> link_;
+
+	mutable std::mutex mutex_;
+	std::condition_variable returned_; // the reset thread waits for kernels to reset
+	std::vector<kernel*> idle_;         // reset, ready to lease
+	std::vector<kernel*> dirty_;        // returned, waiting for the reset thread
+	std::set<const kernel*> leased_;
+	bool stopping_;
+	stats stats_;
+
+	std::thread resetter_;
+};
+
+std::ostream& operator<<(std::ostream&, const kernel_pool::stats&);
+
+} // end namespace wesnoth
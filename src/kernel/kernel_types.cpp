@@ -1,5 +1,7 @@
 #include "kernel_types.hpp"
 
+#include <cstdlib>
+
 namespace wesnoth {
 
 static map_location _helper(int x, int y) {
@@ -10,20 +12,74 @@ static map_location _helper(int x, int y) {
 }
 
 // TODO: Fix this to correct for C++ vs WML 0 - 1 difference
+// Even columns are the raised ones: their side neighbors are at rows y-1 and y, for odd columns at y and y+1.
+void hex::get_adjacent(map_location a, adjacent_hexes & out) {
+	out.clear();
+	int up = (a.x & 1) == 0 ? 1 : 0;
+	out.push_back(_helper(a.x, a.y-1));
+	out.push_back(_helper(a.x+1, a.y - up));
+	out.push_back(_helper(a.x+1, a.y + 1 - up));
+	out.push_back(_helper(a.x, a.y+1));
+	out.push_back(_helper(a.x-1, a.y + 1 - up));
+	out.push_back(_helper(a.x-1, a.y - up));
+}
+
 std::set<map_location> hex::neighbors(map_location a) {
-	std::set<map_location> res;
-	bool b = (a.x & 1) == 0;
-	res.emplace(_helper(a.x, a.y-1));
-	res.emplace(_helper(a.x+1, a.y - (b ? 1 : 0)));
-	res.emplace(_helper(a.x+1, a.y + (b ? 0 : 1)));
-	res.emplace(_helper(a.x, a.y+1));
-	res.emplace(_helper(a.x-1, a.y + (b ? 0 : 1)));
-	res.emplace(_helper(a.x-1, a.y + (b ? 1 : 0)));
-	return res;
+	adjacent_hexes adj;
+	get_adjacent(a, adj);
+	return std::set<map_location>(adj.begin(), adj.end());
 }
 
 bool hex::adjacent(map_location a, map_location b) {
-	return geometry::adjacent(a, b);
+	int dx = b.x - a.x;
+	int dy = b.y - a.y;
+	if (dx == 0) {
+		return dy == 1 || dy == -1;
+	}
+	if (dx != 1 && dx != -1) {
+		return false;
+	}
+	int up = (a.x & 1) == 0 ? 1 : 0;
+	return dy == -up || dy == 1 - up;
+}
+
+// In cube coordinates, where hex distance is half the taxicab distance.
+size_t hex::distance(map_location a, map_location b) {
+	int dq = b.x - a.x;
+	int dr = (b.y - (b.x - (b.x & 1)) / 2) - (a.y - (a.x - (a.x & 1)) / 2);
+	return (std::abs(dq) + std::abs(dr) + std::abs(dq + dr)) / 2;
+}
+
+// The axial coordinates used by distance are (x, y - floor(x / 2)), in which each of the six
+// directions is a fixed step. A ring starts r steps in direction 4 and walks r steps in each.
+static const int hex_directions[6][2] = { {1, 0}, {1, -1}, {0, -1}, {-1, 0}, {-1, 1}, {0, 1} };
+
+static int floor_half(int x) {
+	return (x - (x & 1)) / 2;
+}
+
+void hex::get_ring(map_location a, size_t radius, std::vector<map_location> & out) {
+	if (radius == 0) {
+		out.push_back(a);
+		return;
+	}
+	const int n = static_cast<int>(radius);
+	int q = a.x + hex_directions[4][0] * n;
+	int r = a.y - floor_half(a.x) + hex_directions[4][1] * n;
+	for (int d = 0; d < 6; ++d) {
+		for (int k = 0; k < n; ++k) {
+			out.push_back(_helper(q, r + floor_half(q)));
+			q += hex_directions[d][0];
+			r += hex_directions[d][1];
+		}
+	}
+}
+
+void hex::get_spiral(map_location a, size_t radius, std::vector<map_location> & out) {
+	out.reserve(out.size() + 1 + 3 * radius * (radius + 1));
+	for (size_t n = 0; n <= radius; ++n) {
+		get_ring(a, n, out);
+	}
 }
 
 } // end namespace wesnoth
@@ -1,7 +1,15 @@
 #pragma once
 
+#include <array>
+#include <cassert>
+#include <cstddef>
+#include <functional>
 #include <set>
 #include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <boost/cstdint.hpp>
 #include <boost/optional.hpp>
 #include <boost/property_tree/ptree.hpp>
 #include <boost/variant.hpp>
@@ -25,12 +33,172 @@ namespace wesnoth {
 
 	typedef std::set<map_location> loc_set;
 
+	// A map_location in 32 bits, x in the high half and y in the low half, as the key of hash tables
+	// and to index dense arrays. Both coordinates must fit in 16 bits.
+	class packed_location {
+	public:
+		packed_location() : bits_(0) {}
+		packed_location(map_location loc)
+			: bits_(static_cast<boost::uint32_t>(static_cast<boost::uint16_t>(loc.x)) << 16 | static_cast<boost::uint16_t>(loc.y))
+		{
+			assert(fits(loc) && "map_location out of the range of packed_location");
+		}
+
+		static bool fits(map_location loc) {
+			return loc.x >= -32768 && loc.x <= 32767 && loc.y >= -32768 && loc.y <= 32767;
+		}
+
+		int x() const { return static_cast<boost::int16_t>(bits_ >> 16); }
+		int y() const { return static_cast<boost::int16_t>(bits_ & 0xFFFF); }
+		map_location location() const {
+			map_location loc;
+			loc.x = x();
+			loc.y = y();
+			return loc;
+		}
+
+		boost::uint32_t bits() const { return bits_; }
+
+		// Index in a rectangle of width w laid row by row from (x0, y0), which must hold the location
+		size_t row_major(int x0, int y0, int w) const {
+			return static_cast<size_t>(y() - y0) * w + (x() - x0);
+		}
+
+		// The bits of x and y interleaved (both shifted to be non-negative), so that hexes close on the
+		// map are mostly close in this order
+		boost::uint32_t morton() const {
+			return spread(bits_ >> 16 ^ 0x8000) << 1 | spread((bits_ & 0xFFFF) ^ 0x8000);
+		}
+		static packed_location from_morton(boost::uint32_t m) {
+			packed_location result;
+			result.bits_ = (gather(m >> 1) ^ 0x8000) << 16 | (gather(m) ^ 0x8000);
+			return result;
+		}
+
+		bool operator==(const packed_location a) const { return bits_ == a.bits_; }
+		bool operator!=(const packed_location a) const { return bits_ != a.bits_; }
+
+	private:
+		// Moves bit i of the low half to bit 2i, and back
+		static boost::uint32_t spread(boost::uint32_t v) {
+			v = (v | v << 8) & 0x00FF00FFu;
+			v = (v | v << 4) & 0x0F0F0F0Fu;
+			v = (v | v << 2) & 0x33333333u;
+			v = (v | v << 1) & 0x55555555u;
+			return v;
+		}
+		static boost::uint32_t gather(boost::uint32_t v) {
+			v &= 0x55555555u;
+			v = (v | v >> 1) & 0x33333333u;
+			v = (v | v >> 2) & 0x0F0F0F0Fu;
+			v = (v | v >> 4) & 0x00FF00FFu;
+			v = (v | v >> 8) & 0x0000FFFFu;
+			return v;
+		}
+
+		boost::uint32_t bits_;
+	};
+
+	// For boost containers, std::hash is below
+	inline std::size_t hash_value(const packed_location l) {
+		return static_cast<std::size_t>(l.bits()) * 2654435761u; // Knuth's multiplicative hash
+	}
+
+} // end namespace wesnoth
+
+namespace std {
+	template<>
+	struct hash<wesnoth::packed_location> {
+		std::size_t operator()(const wesnoth::packed_location l) const { return wesnoth::hash_value(l); }
+	};
+} // end namespace std
+
+namespace wesnoth {
+
+	template<typename T>
+	using loc_hash_map = std::unordered_map<packed_location, T>;
+
+	// The tunnel exits of each hex which has some
+	typedef loc_hash_map<loc_set> neighbor_map;
+
+	// Breadth first search from a out to r steps, where each_neighbor(loc, f) calls f(n) for each
+	// neighbor n of loc. Appends the hexes reached to out, a first and then ring by ring, and returns
+	// where the ring at r steps starts in out (out.size() if no hex is that far).
+	template<typename Neighbors>
+	size_t search_rings(map_location a, size_t r, Neighbors each_neighbor, std::vector<map_location> & out) {
+		std::unordered_set<packed_location> seen;
+		size_t ring_begin = out.size();
+		out.push_back(a);
+		seen.insert(a);
+		for (size_t d = 0; d < r; ++d) {
+			const size_t ring_end = out.size();
+			for (size_t k = ring_begin; k < ring_end; ++k) {
+				each_neighbor(out[k], [&](map_location n) {
+					if (seen.insert(n).second) {
+						out.push_back(n);
+					}
+				});
+			}
+			ring_begin = ring_end;
+		}
+		return ring_begin;
+	}
+
+	// The hexes adjacent to some hex, in a fixed size buffer, so that going over them doesn't allocate.
+	class adjacent_hexes {
+	public:
+		static const size_t capacity = 6;
+
+		typedef const map_location * iterator;
+		typedef const map_location * const_iterator;
+
+		adjacent_hexes() : locs_(), size_(0) {}
+
+		void push_back(map_location loc) {
+			assert(size_ < capacity && "Too many neighbors for adjacent_hexes, use geometry::neighbors");
+			locs_[size_++] = loc;
+		}
+		void clear() { size_ = 0; }
+
+		size_t size() const { return size_; }
+		const_iterator begin() const { return locs_.data(); }
+		const_iterator end() const { return locs_.data() + size_; }
+		map_location operator[](size_t i) const { return locs_[i]; }
+
+	private:
+		std::array<map_location, capacity> locs_;
+		size_t size_;
+	};
+
 	class geometry {
 	public:
+		virtual ~geometry() {}
+
+		// Topologies are held polymorphically by the pathfinder, so they must be able to copy themselves.
+		virtual geometry* clone() const {
+			assert(false && "Your topology must override the clone function");
+		}
+
 		virtual loc_set neighbors(map_location) {
 			assert(false && "Your topology must override the default neighbor function");
 		}
 
+		// Same as neighbors, for the pathfinder's inner loops. The default copies the result of neighbors,
+		// topologies where no hex has more than adjacent_hexes::capacity neighbors should override it.
+		virtual void get_adjacent(map_location a, adjacent_hexes & out) {
+			out.clear();
+			loc_set n = neighbors(a);
+			for (loc_set::const_iterator it = n.begin(); it != n.end(); ++it) {
+				out.push_back(*it);
+			}
+		}
+
+		// Lower bound on the number of steps between two hexes, which changes by at most one from a hex to its
+		// neighbors. The pathfinder uses it to aim at a destination. The default of 0 is correct, but no help.
+		virtual size_t distance(map_location, map_location) {
+			return 0;
+		}
+
 		// You should override this also for efficiency, but it might be hard to do better for some exotic topologies.
 		virtual bool adjacent(map_location a, map_location b) {
 			auto n = neighbors(b);
@@ -39,12 +207,47 @@ namespace wesnoth {
 			}
 			return false;
 		}
+
+		// Append to out the hexes at exactly r steps from a (a itself for r = 0), respectively those within
+		// r steps of a, a first and then ring by ring outwards. The hexes needn't be on the map. The defaults
+		// search outwards with get_adjacent, topologies with a closed form should override them.
+		virtual void get_ring(map_location a, size_t r, std::vector<map_location> & out) {
+			const size_t begin = out.size();
+			const size_t ring = search_rings(a, r, adjacent_of(this), out);
+			out.erase(out.begin() + begin, out.begin() + ring);
+		}
+		virtual void get_spiral(map_location a, size_t r, std::vector<map_location> & out) {
+			search_rings(a, r, adjacent_of(this), out);
+		}
+
+	private:
+		// The neighbors of a hex for search_rings
+		struct adjacent_of {
+			explicit adjacent_of(geometry * g) : g_(g) {}
+
+			template<typename F>
+			void operator()(map_location l, F f) const {
+				adjacent_hexes adj;
+				g_->get_adjacent(l, adj);
+				for (adjacent_hexes::const_iterator it = adj.begin(); it != adj.end(); ++it) {
+					f(*it);
+				}
+			}
+
+			geometry * g_;
+		};
 	};
 
 	// The wesnoth hex geometry.
 	class hex : public geometry {
+	public:
+		geometry* clone() const { return new hex(*this); }
 		std::set<map_location> neighbors(map_location a);
+		void get_adjacent(map_location a, adjacent_hexes & out);
 		bool adjacent(map_location a, map_location b);
+		size_t distance(map_location a, map_location b);
+		void get_ring(map_location a, size_t r, std::vector<map_location> & out);
+		void get_spiral(map_location a, size_t r, std::vector<map_location> & out);
 	};
 
 
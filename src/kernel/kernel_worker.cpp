@@ -0,0 +1,300 @@
+#include "kernel_worker.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <ostream>
+#include <vector>
+
+namespace wesnoth {
+
+////
+// latency_histogram
+////
+
+latency_histogram::latency_histogram()
+	: count_(0)
+	, total_(0)
+	, max_(0)
+{
+	std::fill(buckets_, buckets_ + nbuckets, 0);
+}
+
+void latency_histogram::add(double us) {
+	size_t i = 0;
+	while (i + 1 < nbuckets && us >= std::ldexp(1.0, i)) {
+		++i;
+	}
+	++buckets_[i];
+	++count_;
+	total_ += us;
+	max_ = std::max(max_, us);
+}
+
+double latency_histogram::quantile(double q) const {
+	size_t target = static_cast<size_t>(std::ceil(q * count_));
+	size_t seen = 0;
+	for (size_t i = 0; i < nbuckets; ++i) {
+		seen += buckets_[i];
+		if (seen >= target && seen > 0) {
+			return std::min(std::ldexp(1.0, i), max_);
+		}
+	}
+	return max_;
+}
+
+std::ostream& operator<<(std::ostream& os, const latency_histogram& h) {
+	os << h.count() << " samples, mean " << h.mean() << " us, p50 < " << h.quantile(0.5) << " us, p99 < " << h.quantile(0.99) << " us, max " << h.max() << " us\n";
+	for (size_t i = 0; i < latency_histogram::nbuckets; ++i) {
+		if (h.bucket(i)) {
+			os << "    < " << std::ldexp(1.0, i) << " us: " << h.bucket(i) << "\n";
+		}
+	}
+	return os;
+}
+
+////
+// kernel_worker
+////
+
+kernel_worker::stats::stats()
+	: queue_depth(0)
+	, max_queue_depth(0)
+	, commands(0)
+	, batches(0)
+	, lua_entries(0)
+	, blocked(0)
+	, failed(0)
+	, callback_errors(0)
+	, wait()
+	, total()
+{
+}
+
+kernel_worker::kernel_worker(const kernel_ptr& k, size_t max_batch, size_t max_queue)
+	: kernel_(k)
+	, max_batch_(std::max<size_t>(max_batch, 1))
+	, max_queue_(std::max<size_t>(max_queue, 1))
+	, mutex_()
+	, wake_()
+	, room_()
+	, queue_()
+	, stopping_(false)
+	, stats_()
+	, thread_(&kernel_worker::run, this)
+{
+}
+
+kernel_worker::~kernel_worker() {
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		stopping_ = true;
+	}
+	wake_.notify_all();
+	thread_.join();
+}
+
+std::future<kernel_worker::event_result> kernel_worker::submit(JOB type, const std::string& text, const config& command, const callback& done) {
+	job j;
+	j.type = type;
+	j.text = text;
+	j.command = command;
+	j.done = done;
+	std::future<event_result> result = j.promise.get_future();
+
+	{
+		std::unique_lock<std::mutex> lock(mutex_);
+		// A callback waiting for room would wait for itself
+		if (queue_.size() >= max_queue_ && std::this_thread::get_id() != thread_.get_id()) {
+			++stats_.blocked;
+			room_.wait(lock, [this]() { return queue_.size() < max_queue_; });
+		}
+		j.submitted = clock::now();
+		queue_.push_back(std::move(j));
+		stats_.max_queue_depth = std::max(stats_.max_queue_depth, queue_.size());
+	}
+	wake_.notify_one();
+	return result;
+}
+
+std::future<kernel_worker::event_result> kernel_worker::fire_event(const std::string& name, const callback& done) {
+	return submit(FIRE_EVENT, name, config(), done);
+}
+
+std::future<kernel_worker::event_result> kernel_worker::do_command(const config& command, const callback& done) {
+	return submit(DO_COMMAND, std::string(), command, done);
+}
+
+std::future<kernel_worker::event_result> kernel_worker::execute(const std::string& lua, const callback& done) {
+	return submit(EXECUTE, lua, config(), done);
+}
+
+std::future<kernel_worker::event_result> kernel_worker::execute_ai_turn(const callback& done) {
+	return submit(EXECUTE_AI_TURN, std::string(), config(), done);
+}
+
+std::future<kernel_worker::event_result> kernel_worker::end_turn(const callback& done) {
+	return submit(END_TURN, std::string(), config(), done);
+}
+
+namespace {
+
+std::string describe(std::exception_ptr e) {
+	try {
+		std::rethrow_exception(e);
+	} catch (const std::exception& ex) {
+		return std::string("exception: ") + ex.what();
+	} catch (...) {
+		return "unknown exception";
+	}
+}
+
+} // end anonymous namespace
+
+kernel_worker::event_result kernel_worker::carry_out(job& j) {
+	switch (j.type) {
+	case FIRE_EVENT:
+		return kernel_->fire_event(j.text);
+	case DO_COMMAND:
+		return kernel_->do_command(j.command);
+	case EXECUTE:
+		return kernel_->execute(j.text);
+	case EXECUTE_AI_TURN:
+		return kernel_->execute_ai_turn();
+	case END_TURN:
+		return kernel_->end_turn();
+	}
+	return event_result();
+}
+
+void kernel_worker::finish(job& j, const event_result& result) {
+	double us = std::chrono::duration<double, std::micro>(clock::now() - j.submitted).count();
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		++stats_.commands;
+		stats_.total.add(us);
+	}
+
+	j.promise.set_value(result);
+	call_back(j, result);
+}
+
+void kernel_worker::fail(job& j, std::exception_ptr e) {
+	double us = std::chrono::duration<double, std::micro>(clock::now() - j.submitted).count();
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		++stats_.commands;
+		++stats_.failed;
+		stats_.total.add(us);
+	}
+
+	j.promise.set_exception(e);
+	if (j.done) {
+		event_result result;
+		result.error = describe(e);
+		call_back(j, result);
+	}
+}
+
+void kernel_worker::call_back(job& j, const event_result& result) {
+	if (!j.done) {
+		return;
+	}
+	try {
+		j.done(result);
+	} catch (...) {
+		std::lock_guard<std::mutex> lock(mutex_);
+		++stats_.callback_errors;
+	}
+}
+
+void kernel_worker::run() {
+	std::vector<job> batch;
+	std::vector<std::string> chunks;
+
+	for (;;) {
+		batch.clear();
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			wake_.wait(lock, [this]() { return stopping_ || !queue_.empty(); });
+			if (queue_.empty()) {
+				return; // stopping, and nothing is left to do
+			}
+
+			size_t n = std::min(max_batch_, queue_.size());
+			for (size_t i = 0; i < n; ++i) {
+				batch.push_back(std::move(queue_.front()));
+				queue_.pop_front();
+			}
+
+			clock::time_point now = clock::now();
+			for (size_t i = 0; i < batch.size(); ++i) {
+				stats_.wait.add(std::chrono::duration<double, std::micro>(now - batch[i].submitted).count());
+				if (i == 0 || batch[i].type != EXECUTE || batch[i - 1].type != EXECUTE) {
+					++stats_.lua_entries;
+				}
+			}
+			++stats_.batches;
+		}
+		room_.notify_all();
+
+		for (size_t i = 0; i < batch.size();) {
+			job& j = batch[i];
+
+			if (j.type == EXECUTE) {
+				size_t end = i;
+				chunks.clear();
+				while (end < batch.size() && batch[end].type == EXECUTE) {
+					chunks.push_back(batch[end].text);
+					++end;
+				}
+
+				if (chunks.size() > 1) {
+					std::vector<event_result> results;
+					try {
+						results = kernel_->execute_batch(chunks);
+					} catch (...) {
+						std::exception_ptr e = std::current_exception();
+						for (size_t k = i; k < end; ++k) {
+							fail(batch[k], e);
+						}
+						i = end;
+						continue;
+					}
+					for (size_t k = 0; k < results.size(); ++k) {
+						finish(batch[i + k], results[k]);
+					}
+					i = end;
+					continue;
+				}
+			}
+
+			event_result result;
+			try {
+				result = carry_out(j);
+			} catch (...) {
+				fail(j, std::current_exception());
+				++i;
+				continue;
+			}
+			finish(j, result);
+			++i;
+		}
+	}
+}
+
+kernel_worker::stats kernel_worker::get_stats() const {
+	std::lock_guard<std::mutex> lock(mutex_);
+	stats result = stats_;
+	result.queue_depth = queue_.size();
+	return result;
+}
+
+std::ostream& operator<<(std::ostream& os, const kernel_worker::stats& s) {
+	os << "kernel worker: " << s.queue_depth << " queued (max " << s.max_queue_depth << ", " << s.blocked << " submissions blocked), " << s.commands << " done in " << s.batches
+	   << " batches (mean " << s.mean_batch() << "), " << s.lua_entries << " kernel entries, " << s.failed << " failed, " << s.callback_errors << " callback errors\n";
+	os << "  queue wait: " << s.wait;
+	os << "  total latency: " << s.total;
+	return os;
+}
+
+} // end namespace wesnoth
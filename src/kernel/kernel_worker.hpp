@@ -0,0 +1,148 @@
+#pragma once
+
+#include <condition_variable>
+#include <chrono>
+#include <deque>
+#include <exception>
+#include <future>
+#include <iosfwd>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include <boost/function.hpp>
+#include <boost/intrusive_ptr.hpp>
+
+#include "kernel.hpp"
+
+namespace wesnoth {
+
+////
+// Histogram of latencies in power of two buckets. Bucket i counts the samples
+// which took less than 2^i microseconds, and not less than 2^(i-1).
+////
+
+class latency_histogram {
+public:
+	static const size_t nbuckets = 32;
+
+	latency_histogram();
+
+	void add(double us);
+
+	size_t count() const { return count_; }
+	double mean() const { return count_ ? total_ / count_ : 0.0; }
+	double max() const { return max_; }
+
+	// An upper bound for the given quantile (0 < q <= 1), accurate to a factor of two.
+	double quantile(double q) const;
+
+	size_t bucket(size_t i) const { return buckets_[i]; }
+
+private:
+	size_t buckets_[nbuckets];
+	size_t count_;
+	double total_;
+	double max_;
+};
+
+std::ostream& operator<<(std::ostream&, const latency_histogram&);
+
+////
+// Asynchronous front-end for a kernel.
+//
+// Commands are queued, and carried out in order by a worker thread which owns the kernel.
+// Each returns a future for its event_result, and optionally takes a callback, which is
+// called on the worker thread once the command is done.
+//
+// The worker takes everything which is queued at once (up to max_batch commands). Runs of
+// consecutive execute commands in a batch are handed to kernel::execute_batch, so that they
+// enter lua only once.
+//
+// At most max_queue commands wait at once. Submitting to a full queue blocks until the worker
+// takes the next batch, except from a callback (on the worker thread), which is let through.
+//
+// A command which throws (say std::bad_alloc) stores the exception in its future, and its
+// callback is given a result with the error. An exception thrown by a callback is dropped and
+// counted. The worker carries on with the next command in both cases.
+//
+// While a worker exists, nobody else should use its kernel. The destructor finishes all the
+// queued commands before it returns.
+////
+
+class kernel_worker {
+public:
+	typedef boost::intrusive_ptr<kernel> kernel_ptr;
+	typedef kernel::event_result event_result;
+	typedef boost::function<void(const event_result&)> callback;
+
+	explicit kernel_worker(const kernel_ptr& k, size_t max_batch = 64, size_t max_queue = 1024);
+	~kernel_worker();
+
+	std::future<event_result> fire_event(const std::string& name, const callback& done = callback());
+	std::future<event_result> do_command(const config& command, const callback& done = callback());
+	std::future<event_result> execute(const std::string& lua, const callback& done = callback());
+	std::future<event_result> execute_ai_turn(const callback& done = callback());
+	std::future<event_result> end_turn(const callback& done = callback());
+
+	struct stats {
+		size_t queue_depth;     // commands waiting right now
+		size_t max_queue_depth;
+		size_t commands;        // commands completed
+		size_t batches;         // times the worker woke up and took the queue
+		size_t lua_entries;     // calls made into the kernel
+		size_t blocked;         // submissions which waited for room in the queue
+		size_t failed;          // commands which threw
+		size_t callback_errors; // callbacks which threw
+
+		latency_histogram wait;  // from submission until the worker took the command
+		latency_histogram total; // from submission until the result was ready
+
+		stats();
+
+		double mean_batch() const { return batches ? static_cast<double>(commands) / batches : 0.0; }
+	};
+
+	stats get_stats() const;
+
+private:
+	kernel_worker(const kernel_worker&); // noncopyable
+
+	typedef std::chrono::steady_clock clock;
+
+	enum JOB { FIRE_EVENT, DO_COMMAND, EXECUTE, EXECUTE_AI_TURN, END_TURN };
+
+	struct job {
+		JOB type;
+		std::string text;
+		config command;
+		callback done;
+		std::promise<event_result> promise;
+		clock::time_point submitted;
+	};
+
+	std::future<event_result> submit(JOB type, const std::string& text, const config& command, const callback& done);
+
+	void run();
+	event_result carry_out(job& j);
+	void finish(job& j, const event_result& result);
+	void fail(job& j, std::exception_ptr e);
+	void call_back(job& j, const event_result& result);
+
+	kernel_ptr kernel_;
+	size_t max_batch_;
+	size_t max_queue_;
+
+	mutable std::mutex mutex_;
+	std::condition_variable wake_; // the worker waits for commands
+	std::condition_variable room_; // submitters wait for room in the queue
+	std::deque<job> queue_;
+	bool stopping_;
+	stats stats_;
+
+	std::thread thread_;
+};
+
+std::ostream& operator<<(std::ostream&, const kernel_worker::stats&);
+
+} // end namespace wesnoth
@@ -0,0 +1,240 @@
+#include "lua_alloc.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+#include <boost/foreach.hpp>
+
+#include "eris/lua.h"
+#include "eris/lauxlib.h"
+
+namespace wesnoth {
+
+////
+// malloc_allocator
+////
+
+void* malloc_allocator::reallocate(void* ptr, size_t, size_t nsize) {
+	if (nsize == 0) {
+		std::free(ptr);
+		return NULL;
+	}
+	return std::realloc(ptr, nsize);
+}
+
+////
+// pool_allocator
+////
+
+pool_allocator::pool_allocator()
+	: bump_(NULL)
+	, bump_end_(NULL)
+	, chunks_()
+{
+	std::fill(free_lists_, free_lists_ + max_small / granularity + 1, static_cast<free_block*>(NULL));
+}
+
+pool_allocator::~pool_allocator() {
+	BOOST_FOREACH(char* chunk, chunks_) {
+		std::free(chunk);
+	}
+}
+
+void* pool_allocator::allocate_small(size_t cls) {
+	if (free_block* b = free_lists_[cls]) {
+		free_lists_[cls] = b->next;
+		return b;
+	}
+
+	size_t size = cls * granularity;
+	if (bump_ + size > bump_end_) {
+		char* chunk = static_cast<char*>(std::malloc(chunk_size));
+		if (!chunk) {
+			return NULL;
+		}
+		chunks_.push_back(chunk);
+		bump_ = chunk;
+		bump_end_ = chunk + chunk_size;
+	}
+
+	void* result = bump_;
+	bump_ += size;
+	return result;
+}
+
+void pool_allocator::free_small(void* ptr, size_t cls) {
+	free_block* b = static_cast<free_block*>(ptr);
+	b->next = free_lists_[cls];
+	free_lists_[cls] = b;
+}
+
+void* pool_allocator::reallocate(void* ptr, size_t osize, size_t nsize) {
+	if (nsize == 0) {
+		if (ptr) {
+			if (osize <= max_small) {
+				free_small(ptr, size_class(osize));
+			} else {
+				std::free(ptr);
+			}
+		}
+		return NULL;
+	}
+
+	if (!ptr) {
+		return nsize <= max_small ? allocate_small(size_class(nsize)) : std::malloc(nsize);
+	}
+
+	bool small_old = osize <= max_small;
+	bool small_new = nsize <= max_small;
+
+	if (small_old && small_new && size_class(osize) == size_class(nsize)) {
+		return ptr;
+	}
+	if (!small_old && !small_new) {
+		return std::realloc(ptr, nsize);
+	}
+
+	void* result = small_new ? allocate_small(size_class(nsize)) : std::malloc(nsize);
+	if (!result) {
+		return NULL;
+	}
+	std::memcpy(result, ptr, std::min(osize, nsize));
+	if (small_old) {
+		free_small(ptr, size_class(osize));
+	} else {
+		std::free(ptr);
+	}
+	return result;
+}
+
+////
+// accounting_allocator
+////
+
+lua_memory_stats::lua_memory_stats()
+	: live_bytes(0)
+	, peak_bytes(0)
+	, limit_bytes(0)
+	, allocations(0)
+	, frees(0)
+	, failures(0)
+{
+	std::fill(size_histogram, size_histogram + nsize_buckets, 0);
+	std::fill(kind_histogram, kind_histogram + nkinds, 0);
+}
+
+const char* lua_memory_stats::kind_name(size_t kind) {
+	static const char* const names[nkinds] = { "other", "boolean", "lightuserdata", "number", "string", "table", "function", "userdata", "thread", "proto", "upvalue" };
+	return kind < nkinds ? names[kind] : "other";
+}
+
+accounting_allocator::accounting_allocator(const boost::shared_ptr<lua_allocator>& backing)
+	: backing_(backing ? backing : boost::shared_ptr<lua_allocator>(new malloc_allocator()))
+	, stats_()
+{
+}
+
+void* accounting_allocator::reallocate(void* ptr, size_t osize, size_t nsize) {
+	// When ptr is NULL, osize tells what kind of object lua is making.
+	size_t old = ptr ? osize : 0;
+
+	if (nsize > old && stats_.limit_bytes && stats_.live_bytes + (nsize - old) > stats_.limit_bytes) {
+		++stats_.failures;
+		return NULL;
+	}
+
+	void* result = backing_->reallocate(ptr, osize, nsize);
+
+	if (nsize == 0) {
+		if (ptr) {
+			stats_.live_bytes -= osize;
+			++stats_.frees;
+		}
+		return NULL;
+	}
+	if (!result) {
+		++stats_.failures;
+		return NULL;
+	}
+
+	stats_.live_bytes = stats_.live_bytes - old + nsize;
+	stats_.peak_bytes = std::max(stats_.peak_bytes, stats_.live_bytes);
+
+	if (!ptr) {
+		++stats_.allocations;
+
+		size_t bucket = 0;
+		while (bucket + 1 < lua_memory_stats::nsize_buckets && nsize > (size_t(8) << bucket)) {
+			++bucket;
+		}
+		++stats_.size_histogram[bucket];
+		++stats_.kind_histogram[osize < lua_memory_stats::nkinds ? osize : 0];
+	}
+	return result;
+}
+
+void* accounting_allocator::lua_alloc(void* ud, void* ptr, size_t osize, size_t nsize) {
+	return static_cast<accounting_allocator*>(ud)->reallocate(ptr, osize, nsize);
+}
+
+////
+// Lua bindings
+////
+
+namespace lua_alloc {
+
+static void set_number(lua_State* L, const char* name, size_t value) {
+	lua_pushnumber(L, static_cast<lua_Number>(value));
+	lua_setfield(L, -2, name);
+}
+
+static int impl_memory_stats(lua_State* L) {
+	void* ud;
+	if (lua_getallocf(L, &ud) != &accounting_allocator::lua_alloc) {
+		return luaL_error(L, "Memory.stats: this lua state does not have an accounting allocator");
+	}
+	const lua_memory_stats& s = static_cast<accounting_allocator*>(ud)->stats();
+
+	lua_newtable(L);
+	set_number(L, "live", s.live_bytes);
+	set_number(L, "peak", s.peak_bytes);
+	set_number(L, "limit", s.limit_bytes);
+	set_number(L, "allocations", s.allocations);
+	set_number(L, "frees", s.frees);
+	set_number(L, "failures", s.failures);
+
+	lua_newtable(L);
+	for (size_t i = 0; i < lua_memory_stats::nsize_buckets; ++i) {
+		if (s.size_histogram[i]) {
+			lua_pushnumber(L, static_cast<lua_Number>(s.size_histogram[i]));
+			lua_rawseti(L, -2, 8 << i);
+		}
+	}
+	lua_setfield(L, -2, "sizes");
+
+	lua_newtable(L);
+	for (size_t i = 0; i < lua_memory_stats::nkinds; ++i) {
+		if (s.kind_histogram[i]) {
+			set_number(L, lua_memory_stats::kind_name(i), s.kind_histogram[i]);
+		}
+	}
+	lua_setfield(L, -2, "kinds");
+
+	return 1;
+}
+
+void load_tables(lua_State* L) {
+	static luaL_Reg const callbacks[] = {
+		{ "stats",	&impl_memory_stats},
+		{ NULL, NULL }
+	};
+
+	lua_newtable(L);
+	luaL_setfuncs(L, callbacks, 0);
+	lua_setglobal(L, "Memory");
+}
+
+} // end namespace lua_alloc
+
+} // end namespace wesnoth
@@ -0,0 +1,132 @@
+#pragma once
+
+/**
+ * Memory allocation strategies for the lua state of a kernel.
+ *
+ * Every kernel routes its allocations through an accounting_allocator, which
+ * tracks how much memory the lua state uses and can enforce a limit on it.
+ * The accounting allocator forwards to a backing strategy: plain malloc by
+ * default, or a pool_allocator tuned for lua's many small objects.
+ */
+
+#include <cstddef>
+#include <vector>
+
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+
+struct lua_State;
+
+namespace wesnoth {
+
+////
+// Allocation strategy, with the same contract as lua_Alloc:
+// - nsize == 0 frees ptr (which may be NULL) and returns NULL
+// - otherwise resizes ptr (allocates, if it is NULL) to nsize bytes, returning NULL on failure
+// - when ptr is not NULL, osize is its size. Shrinking must not fail.
+////
+
+class lua_allocator {
+public:
+	virtual ~lua_allocator() {}
+	virtual void* reallocate(void* ptr, size_t osize, size_t nsize) = 0;
+};
+
+typedef boost::function<boost::shared_ptr<lua_allocator>()> lua_allocator_factory;
+
+// The standard library allocator, like the one luaL_newstate uses.
+class malloc_allocator : public lua_allocator {
+public:
+	void* reallocate(void* ptr, size_t osize, size_t nsize);
+};
+
+////
+// Segregated free lists for small blocks, carved out of large chunks.
+// Lua frees blocks with their size, so the blocks carry no header. Blocks
+// larger than max_small go to malloc. Memory is returned to the system only
+// when the allocator is destroyed, so it must outlive its lua state.
+// Not thread safe -- each kernel should have its own.
+////
+
+class pool_allocator : public lua_allocator {
+public:
+	static const size_t granularity = 8;
+	static const size_t max_small = 256;
+	static const size_t chunk_size = 32 * 1024;
+
+	pool_allocator();
+	~pool_allocator();
+
+	void* reallocate(void* ptr, size_t osize, size_t nsize);
+
+	size_t reserved_bytes() const { return chunks_.size() * chunk_size; }
+
+private:
+	pool_allocator(const pool_allocator&); // noncopyable
+
+	static size_t size_class(size_t size) { return (size + granularity - 1) / granularity; }
+
+	void* allocate_small(size_t cls);
+	void free_small(void* ptr, size_t cls);
+
+	struct free_block {
+		free_block* next;
+	};
+
+	free_block* free_lists_[max_small / granularity + 1];
+	char* bump_;
+	char* bump_end_;
+	std::vector<char*> chunks_;
+};
+
+////
+// Statistics kept by the accounting allocator.
+////
+
+struct lua_memory_stats {
+	static const size_t nsize_buckets = 24; // bucket i: blocks of size at most 2^(i+3)
+	static const size_t nkinds = 11;        // lua type tags, plus prototypes and upvalues. 0 is "other"
+
+	size_t live_bytes;
+	size_t peak_bytes;
+	size_t limit_bytes; // 0 for none
+
+	size_t allocations;
+	size_t frees;
+	size_t failures; // requests refused because of the limit, or because the backing allocator failed
+
+	size_t size_histogram[nsize_buckets]; // allocations by requested size
+	size_t kind_histogram[nkinds];        // new objects by kind (string, table, closure, ...)
+
+	lua_memory_stats();
+
+	static const char* kind_name(size_t kind);
+};
+
+class accounting_allocator : public lua_allocator {
+public:
+	explicit accounting_allocator(const boost::shared_ptr<lua_allocator>& backing);
+
+	void* reallocate(void* ptr, size_t osize, size_t nsize);
+
+	const lua_memory_stats& stats() const { return stats_; }
+
+	// Growing the lua state beyond the limit fails with a lua memory error. 0 for no limit.
+	void set_limit(size_t bytes) { stats_.limit_bytes = bytes; }
+
+	// Trampoline to use with lua_newstate, with the accounting_allocator as userdata.
+	static void* lua_alloc(void* ud, void* ptr, size_t osize, size_t nsize);
+
+private:
+	boost::shared_ptr<lua_allocator> backing_;
+	lua_memory_stats stats_;
+};
+
+namespace lua_alloc {
+
+/** Adds the Memory table, whose stats() function reports the lua_memory_stats of the state */
+void load_tables(lua_State*);
+
+} // end namespace lua_alloc
+
+} // end namespace wesnoth
@@ -18,6 +18,7 @@
 #include "mt_rng.hpp"
 //#include "lua_kernel_base.hpp"
 
+#include <iostream>
 #include <new>
 #include <string>
 
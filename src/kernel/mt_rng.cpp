@@ -17,6 +17,7 @@
 //#include "config.hpp"
 #include "formatter.hpp"
 //#include "log.hpp"
+#include <iostream>
 #include <sstream>
 #include <iomanip>
 /*static lg::log_domain log_random("random");
@@ -25,7 +26,11 @@
 #define WRN_RND LOG_STREAM(warn, log_random)
 #define ERR_RND LOG_STREAM(err, log_random)
 */
-#define DBG_RND std::cerr
+// Debug output is off, since it would make every draw from every kernel contend on std::cerr.
+// As with LOG_STREAM, the else takes the whole streaming expression, so the macro is safe in
+// an unbraced if, and nothing is formatted while it is off.
+static const bool debug_random = false;
+#define DBG_RND if (!debug_random) ; else std::cerr
 #define LOG_RND std::cerr
 #define WRN_RND std::cerr
 #define ERR_RND std::cerr
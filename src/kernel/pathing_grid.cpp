@@ -0,0 +1,342 @@
+#include "pathing_grid.hpp"
+
+#include <algorithm>
+#include <utility>
+
+namespace wesnoth {
+
+////
+// grid_layout
+////
+
+grid_layout::grid_layout()
+	: valid_(false)
+	, nhexes_(0)
+	, first_()
+	, last_()
+	, shape_(0)
+	, x0_(0)
+	, y0_(0)
+	, stride_(0)
+	, rows_(0)
+	, flags_()
+	, hex_(false)
+	, adjacent_begin_()
+	, adjacent_()
+	, tunnel_begin_()
+	, tunnels_()
+	, rtunnel_begin_()
+	, rtunnels_()
+{
+}
+
+void grid_layout::layout(const std::vector<map_location> & hexes, geometry & g, const neighbor_map & tunnels) {
+	int min_x = 0, min_y = 0, max_x = -1, max_y = -1;
+	BOOST_FOREACH(const map_location & loc, hexes) {
+		if (max_x < min_x) {
+			min_x = max_x = loc.x;
+			min_y = max_y = loc.y;
+		}
+		min_x = std::min(min_x, loc.x);
+		max_x = std::max(max_x, loc.x);
+		min_y = std::min(min_y, loc.y);
+		max_y = std::max(max_y, loc.y);
+	}
+
+	// One cell of border on every side
+	x0_ = min_x - 1;
+	y0_ = min_y - 1;
+	stride_ = max_x - min_x + 3;
+	rows_ = max_y - min_y + 3;
+
+	flags_.assign(static_cast<size_t>(stride_) * rows_, 0);
+	for (int i = 0; i < static_cast<int>(flags_.size()); ++i) {
+		if (location(i).x & 1) {
+			flags_[i] |= ODD_COLUMN;
+		}
+	}
+	BOOST_FOREACH(const map_location & loc, hexes) {
+		flags_[index(loc)] |= ON_MAP;
+	}
+
+	hex_ = dynamic_cast<hex *>(&g) != NULL;
+
+	adjacent_begin_.clear();
+	adjacent_.clear();
+	if (hex_) {
+		static const int even[6][2] = { {0, -1}, {1, -1}, {1, 0}, {0, 1}, {-1, 0}, {-1, -1} };
+		static const int odd[6][2] = { {0, -1}, {1, 0}, {1, 1}, {0, 1}, {-1, 1}, {-1, 0} };
+		for (int k = 0; k < 6; ++k) {
+			hex_offsets_[0][k] = even[k][1] * stride_ + even[k][0];
+			hex_offsets_[1][k] = odd[k][1] * stride_ + odd[k][0];
+		}
+	} else {
+		// Neighbors outside of the layout are certainly off the map, so they are dropped
+		adjacent_begin_.reserve(flags_.size() + 1);
+		for (int i = 0; i < static_cast<int>(flags_.size()); ++i) {
+			adjacent_begin_.push_back(adjacent_.size());
+			if (flags_[i] & ON_MAP) {
+				BOOST_FOREACH(const map_location & n, g.neighbors(location(i))) {
+					int j = index(n);
+					if (j >= 0) {
+						adjacent_.push_back(j);
+					}
+				}
+			}
+		}
+		adjacent_begin_.push_back(adjacent_.size());
+	}
+
+	tunnel_begin_.clear();
+	tunnels_.clear();
+	rtunnel_begin_.clear();
+	rtunnels_.clear();
+	if (!tunnels.empty()) {
+		std::vector<std::pair<int, int> > edges;
+		BOOST_FOREACH(const neighbor_map::value_type & t, tunnels) {
+			int i = index(t.first.location());
+			if (i < 0 || !(flags_[i] & ON_MAP)) {
+				continue;
+			}
+			BOOST_FOREACH(const map_location & n, t.second) {
+				int j = index(n);
+				if (j >= 0) {
+					edges.push_back(std::make_pair(i, j));
+				}
+			}
+		}
+		std::sort(edges.begin(), edges.end());
+
+		tunnel_begin_.assign(flags_.size() + 1, 0);
+		size_t k = 0;
+		for (int i = 0; i < static_cast<int>(flags_.size()); ++i) {
+			tunnel_begin_[i] = k;
+			while (k < edges.size() && edges[k].first == i) {
+				tunnels_.push_back(edges[k].second);
+				flags_[i] |= TUNNEL;
+				++k;
+			}
+		}
+		tunnel_begin_[flags_.size()] = k;
+
+		for (size_t e = 0; e < edges.size(); ++e) {
+			std::swap(edges[e].first, edges[e].second);
+		}
+		std::sort(edges.begin(), edges.end());
+		rtunnel_begin_.assign(flags_.size() + 1, 0);
+		k = 0;
+		for (int i = 0; i < static_cast<int>(flags_.size()); ++i) {
+			rtunnel_begin_[i] = k;
+			while (k < edges.size() && edges[k].first == i) {
+				rtunnels_.push_back(edges[k].second);
+				flags_[i] |= TUNNEL_EXIT;
+				++k;
+			}
+		}
+		rtunnel_begin_[flags_.size()] = k;
+	}
+
+	valid_ = true;
+	nhexes_ = hexes.size();
+}
+
+void grid_layout::build(const terrain_grid & m, geometry & g, const neighbor_map & tunnels) {
+	std::vector<map_location> hexes;
+	hexes.reserve(m.size());
+	m.for_each([&](map_location loc, terrain_code) {
+		hexes.push_back(loc);
+	});
+	layout(hexes, g, tunnels);
+	first_ = last_ = map_location();
+	shape_ = m.shape();
+}
+
+////
+// landmark_oracle
+////
+
+landmark_oracle::landmark_oracle()
+	: valid_(false)
+	, n_(0)
+	, landmarks_()
+	, from_()
+	, to_()
+	, edge_begin_()
+	, redge_begin_()
+	, edges_()
+	, redges_()
+	, queue_()
+{
+}
+
+void landmark_oracle::build(const grid_layout & layout, size_t landmarks) {
+	n_ = layout.size();
+	const int n = static_cast<int>(n_);
+
+	// Forward edges in CSR form, then the same edges reversed
+	edge_begin_.assign(n_ + 1, 0);
+	edges_.clear();
+	std::vector<size_t> in_degree(n_ + 1, 0);
+	for (int i = 0; i < n; ++i) {
+		edge_begin_[i] = edges_.size();
+		if (layout.on_map(i)) {
+			layout.for_each_neighbor(i, [&](int j) {
+				if (layout.on_map(j)) {
+					edges_.push_back(j);
+					++in_degree[j + 1];
+				}
+			});
+		}
+	}
+	edge_begin_[n_] = edges_.size();
+
+	redge_begin_.assign(n_ + 1, 0);
+	for (size_t i = 0; i < n_; ++i) {
+		redge_begin_[i + 1] = redge_begin_[i] + in_degree[i + 1];
+	}
+	redges_.resize(edges_.size());
+	std::vector<size_t> fill(redge_begin_.begin(), redge_begin_.end() - 1);
+	for (int i = 0; i < n; ++i) {
+		for (size_t k = edge_begin_[i]; k < edge_begin_[i + 1]; ++k) {
+			redges_[fill[edges_[k]]++] = i;
+		}
+	}
+
+	// Farthest point selection: each landmark is the cell farthest from those picked before
+	landmarks_.clear();
+	std::vector<std::vector<boost::uint32_t> > from(landmarks), to(landmarks);
+	std::vector<boost::uint32_t> nearest(n_, UNREACHED);
+
+	int next = -1;
+	for (int i = 0; i < n && next < 0; ++i) {
+		if (layout.on_map(i)) {
+			next = i;
+		}
+	}
+	while (next >= 0 && landmarks_.size() < landmarks) {
+		size_t k = landmarks_.size();
+		landmarks_.push_back(next);
+		bfs(next, false, from[k]);
+		bfs(next, true, to[k]);
+
+		next = -1;
+		boost::uint32_t farthest = 0;
+		for (int i = 0; i < n; ++i) {
+			if (!layout.on_map(i)) {
+				continue;
+			}
+			nearest[i] = std::min(nearest[i], from[k][i]);
+			if (nearest[i] > farthest) { // unreached cells come first, they are in another component
+				farthest = nearest[i];
+				next = i;
+			}
+		}
+		if (farthest == 0) {
+			break; // every cell is a landmark already
+		}
+	}
+
+	// Interleave them, so that the distances of a cell to all the landmarks are together
+	const size_t L = landmarks_.size();
+	from_.resize(n_ * L);
+	to_.resize(n_ * L);
+	for (size_t i = 0; i < n_; ++i) {
+		for (size_t k = 0; k < L; ++k) {
+			from_[i * L + k] = from[k][i];
+			to_[i * L + k] = to[k][i];
+		}
+	}
+
+	valid_ = true;
+}
+
+void landmark_oracle::bfs(int l, bool reverse, std::vector<boost::uint32_t> & out) {
+	const std::vector<size_t> & begin = reverse ? redge_begin_ : edge_begin_;
+	const std::vector<int> & edges = reverse ? redges_ : edges_;
+
+	out.assign(n_, UNREACHED);
+	queue_.clear();
+	queue_.push_back(l);
+	out[l] = 0;
+	for (size_t q = 0; q < queue_.size(); ++q) {
+		int i = queue_[q];
+		for (size_t k = begin[i]; k < begin[i + 1]; ++k) {
+			int j = edges[k];
+			if (out[j] == UNREACHED) {
+				out[j] = out[i] + 1;
+				queue_.push_back(j);
+			}
+		}
+	}
+}
+
+////
+// bucket_queue
+////
+
+bucket_queue::bucket_queue()
+	: buckets_()
+	, mask_(0)
+	, current_(0)
+	, count_(0)
+{
+}
+
+void bucket_queue::reset(size_t span, size_t first) {
+	size_t n = 1;
+	while (n <= span) {
+		n *= 2;
+	}
+	if (buckets_.size() < n) {
+		buckets_.resize(n);
+	}
+	mask_ = buckets_.size() - 1;
+	BOOST_FOREACH(std::vector<int> & b, buckets_) {
+		b.clear();
+	}
+	current_ = first;
+	count_ = 0;
+}
+
+////
+// pathing_scratch
+////
+
+pathing_scratch::pathing_scratch()
+	: nodes()
+	, cost()
+	, first_turn_cost()
+	, bound()
+	, queue()
+	, key_base(1)
+	, turns(0)
+	, gen_(0)
+	, seen_()
+	, done_()
+	, facts_gen_()
+	, facts_()
+{
+}
+
+void pathing_scratch::begin(size_t n) {
+	if (seen_.size() != n) {
+		nodes.resize(n);
+		cost.resize(n);
+		first_turn_cost.resize(n);
+		bound.resize(n);
+		seen_.assign(n, 0);
+		done_.assign(n, 0);
+		facts_gen_.assign(n, 0);
+		facts_.assign(n, 0);
+		gen_ = 0;
+	}
+
+	if (++gen_ == 0) { // wrapped around, the old stamps can't be trusted
+		std::fill(seen_.begin(), seen_.end(), 0);
+		std::fill(done_.begin(), done_.end(), 0);
+		std::fill(facts_gen_.begin(), facts_gen_.end(), 0);
+		gen_ = 1;
+	}
+}
+
+} // end namespace wesnoth
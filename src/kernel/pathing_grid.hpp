@@ -0,0 +1,318 @@
+#pragma once
+
+#include <cstddef>
+#include <map>
+#include <vector>
+
+#include <cassert>
+
+#include <boost/cstdint.hpp>
+#include <boost/foreach.hpp>
+
+#include "distance_field.hpp"
+#include "hex_bitset.hpp"
+#include "kernel_types.hpp"
+#include "terrain_grid.hpp"
+
+namespace wesnoth {
+
+////
+// Dense layout of a map, for pathfinding.
+//
+// Cells are numbered row by row over the bounding box of the map, with a border of
+// off-map cells all around, so the neighbors of an on-map cell are always valid indices.
+// In the hex geometry, the neighbors of a cell are at fixed index offsets which only
+// depend on the parity of its column. Other geometries use adjacency lists computed
+// once from geometry::neighbors. Tunnels are extra adjacency lists for the few cells
+// which have them.
+////
+
+class grid_layout {
+public:
+	grid_layout();
+
+	// Lay out the hexes which are keys of the map.
+	template<typename Map>
+	void build(const Map & m, geometry & g, const neighbor_map & tunnels);
+
+	// Whether this was built from a map with the same hexes. (That isn't checked thoroughly:
+	// replacing a hex by another inside the bounding box goes unnoticed, use invalidate then.)
+	template<typename Map>
+	bool matches(const Map & m) const;
+
+	// The same for the hexes on a terrain grid, which tells when they change
+	void build(const terrain_grid & m, geometry & g, const neighbor_map & tunnels);
+	bool matches(const terrain_grid & m) const { return valid_ && shape_ == m.shape(); }
+
+	void invalidate() { valid_ = false; }
+
+	size_t size() const { return flags_.size(); }
+	// Cell (column, row) has index row * stride() + column
+	int stride() const { return stride_; }
+	int rows() const { return rows_; }
+
+	// Index of the cell at location, or -1 if it is outside the layout
+	int index(map_location loc) const {
+		int x = loc.x - x0_, y = loc.y - y0_;
+		if (x < 0 || y < 0 || x >= stride_ || y >= rows_) {
+			return -1;
+		}
+		return y * stride_ + x;
+	}
+
+	map_location location(int i) const {
+		map_location loc;
+		loc.x = x0_ + i % stride_;
+		loc.y = y0_ + i / stride_;
+		return loc;
+	}
+
+	bool on_map(int i) const { return flags_[i] & ON_MAP; }
+
+	// An empty bitset over the cells of the layout, indexed like them
+	hex_bitset make_bitset() const { return hex_bitset(x0_, y0_, stride_, rows_); }
+	// The same for distances, all unreached
+	distance_field make_field() const { return distance_field(x0_, y0_, stride_, rows_); }
+
+	// Calls f(j) for each cell j adjacent to the on-map cell i, then for each tunnel exit of i.
+	template<typename F>
+	void for_each_neighbor(int i, F f) const {
+		for_each_adjacent(i, f);
+		if (flags_[i] & TUNNEL) {
+			for (size_t k = tunnel_begin_[i]; k < tunnel_begin_[i + 1]; ++k) {
+				f(tunnels_[k]);
+			}
+		}
+	}
+
+	// Calls f(j) for each cell j from which the on-map cell i is a step away, tunnels included.
+	template<typename F>
+	void for_each_predecessor(int i, F f) const {
+		for_each_adjacent(i, f);
+		if (flags_[i] & TUNNEL_EXIT) {
+			for (size_t k = rtunnel_begin_[i]; k < rtunnel_begin_[i + 1]; ++k) {
+				f(rtunnels_[k]);
+			}
+		}
+	}
+
+	// Calls f(j) for each cell j adjacent to the on-map cell i, ignoring tunnels.
+	template<typename F>
+	void for_each_adjacent(int i, F f) const {
+		if (hex_) {
+			const int * offsets = hex_offsets_[(flags_[i] & ODD_COLUMN) ? 1 : 0];
+			for (int k = 0; k < 6; ++k) {
+				f(i + offsets[k]);
+			}
+		} else {
+			for (size_t k = adjacent_begin_[i]; k < adjacent_begin_[i + 1]; ++k) {
+				f(adjacent_[k]);
+			}
+		}
+	}
+
+private:
+	enum { ON_MAP = 1, ODD_COLUMN = 2, TUNNEL = 4, TUNNEL_EXIT = 8 };
+
+	void layout(const std::vector<map_location> & hexes, geometry & g, const neighbor_map & tunnels);
+
+	bool valid_;
+	size_t nhexes_;
+	map_location first_, last_; // the least and greatest keys of the map it was built from
+	size_t shape_;              // or the shape of the terrain grid, 0 if built from a map
+
+	int x0_, y0_; // location of cell 0
+	int stride_, rows_;
+
+	std::vector<unsigned char> flags_;
+
+	bool hex_;
+	int hex_offsets_[2][6]; // for even and odd columns
+
+	std::vector<size_t> adjacent_begin_; // when not hex: adjacency lists, adjacent_[adjacent_begin_[i] .. adjacent_begin_[i+1]]
+	std::vector<int> adjacent_;
+
+	std::vector<size_t> tunnel_begin_;
+	std::vector<int> tunnels_;
+	std::vector<size_t> rtunnel_begin_; // the same edges, by exit
+	std::vector<int> rtunnels_;
+};
+
+template<typename Map>
+void grid_layout::build(const Map & m, geometry & g, const neighbor_map & tunnels) {
+	std::vector<map_location> hexes;
+	hexes.reserve(m.size());
+	BOOST_FOREACH(const typename Map::value_type & v, m) {
+		hexes.push_back(v.first);
+	}
+	layout(hexes, g, tunnels);
+	shape_ = 0;
+	if (!m.empty()) {
+		first_ = m.begin()->first;
+		last_ = m.rbegin()->first;
+	}
+}
+
+template<typename Map>
+bool grid_layout::matches(const Map & m) const {
+	if (!valid_ || shape_ || m.size() != nhexes_) {
+		return false;
+	}
+	return m.empty() || (m.begin()->first == first_ && m.rbegin()->first == last_);
+}
+
+////
+// Lower bounds on the number of steps between the cells of a layout, tunnels included (ALT).
+//
+// A few landmark cells are picked far apart, and the step distances from and to each of them
+// are computed by breadth first search over the on-map cells. By the triangle inequality, the
+// distance from a to b is at least d(L, b) - d(L, a) and d(a, L) - d(b, L) for each landmark L.
+// This only depends on the topology of the map, so it stays valid as long as the layout does.
+// Between adjacent cells the bound changes by at most one, so it can guide A*.
+////
+
+class landmark_oracle {
+public:
+	landmark_oracle();
+
+	void build(const grid_layout & layout, size_t landmarks = 8);
+
+	bool valid() const { return valid_; }
+	void invalidate() { valid_ = false; }
+
+	size_t lower_bound(int a, int b) const {
+		const size_t L = landmarks_.size();
+		const boost::uint32_t * from_a = &from_[a * L], * from_b = &from_[b * L];
+		const boost::uint32_t * to_a = &to_[a * L], * to_b = &to_[b * L];
+		boost::uint32_t result = 0;
+		for (size_t k = 0; k < L; ++k) {
+			if (from_a[k] != UNREACHED && from_b[k] != UNREACHED && from_b[k] > from_a[k] + result) {
+				result = from_b[k] - from_a[k];
+			}
+			if (to_a[k] != UNREACHED && to_b[k] != UNREACHED && to_a[k] > to_b[k] + result) {
+				result = to_a[k] - to_b[k];
+			}
+		}
+		return result;
+	}
+
+private:
+	enum { UNREACHED = 0xFFFFFFFF };
+
+	// Breadth first search from cell l, along the edges or against them, into out[0 .. n)
+	void bfs(int l, bool reverse, std::vector<boost::uint32_t> & out);
+
+	bool valid_;
+	size_t n_;
+	std::vector<int> landmarks_;
+	std::vector<boost::uint32_t> from_; // from_[i * landmarks + k]: steps from landmark k to cell i
+	std::vector<boost::uint32_t> to_;   // to_[i * landmarks + k]: steps from cell i to landmark k
+
+	// The graph of the on-map cells, forwards and backwards (tunnels only go one way)
+	std::vector<size_t> edge_begin_, redge_begin_;
+	std::vector<int> edges_, redges_;
+	std::vector<int> queue_;
+};
+
+////
+// Priority queue for small integer keys (Dial's algorithm).
+// Keys popped are nondecreasing, and every key pushed must be within span of the last key popped.
+// The buckets keep their capacity, so a queue reused across searches stops allocating.
+////
+
+class bucket_queue {
+public:
+	bucket_queue();
+
+	// Empty the queue, for keys from first to first + span
+	void reset(size_t span, size_t first = 0);
+
+	bool empty() const { return count_ == 0; }
+
+	void push(size_t key, int value) {
+		assert(key >= current_ && key - current_ <= mask_);
+		buckets_[key & mask_].push_back(value);
+		++count_;
+	}
+
+	// Remove an entry with the least key
+	bool pop(size_t & key, int & value) {
+		if (count_ == 0) {
+			return false;
+		}
+		while (buckets_[current_ & mask_].empty()) {
+			++current_;
+		}
+		std::vector<int> & b = buckets_[current_ & mask_];
+		value = b.back();
+		b.pop_back();
+		--count_;
+		key = current_;
+		return true;
+	}
+
+private:
+	std::vector<std::vector<int> > buckets_;
+	size_t mask_;
+	size_t current_;
+	size_t count_;
+};
+
+////
+// Working memory of a search over a grid_layout.
+// Rather than clearing the arrays before each search, the entries carry the generation
+// which wrote them, and entries from older generations count as empty.
+////
+
+struct grid_node {
+	size_t key;       // search order, smaller is better
+	int pred;         // index of the predecessor, or the node itself for the start
+};
+
+class pathing_scratch {
+public:
+	pathing_scratch();
+
+	// Start a new search over a layout with n cells
+	void begin(size_t n);
+
+	bool seen(int i) const { return seen_[i] == gen_; }
+	bool done(int i) const { return done_[i] == gen_; }
+	void mark_seen(int i) { seen_[i] = gen_; }
+	void mark_done(int i) { done_[i] = gen_; }
+
+	// For repairs of a finished search: forget a cell was reached, or what was known about it
+	void unmark(int i) { seen_[i] = done_[i] = 0; }
+	void forget_facts(int i) { facts_gen_[i] = 0; }
+
+	// Per-cell facts about the query, computed on first use
+	unsigned char & facts(int i) {
+		if (facts_gen_[i] != gen_) {
+			facts_gen_[i] = gen_;
+			facts_[i] = 0;
+		}
+		return facts_[i];
+	}
+
+	std::vector<grid_node> nodes;
+	std::vector<size_t> cost;
+	std::vector<size_t> first_turn_cost;
+	std::vector<size_t> bound; // A* lower bound on the number of steps to the destination
+	bucket_queue queue;
+
+	// Search order of a node with some turns and moves left is (turns - turns_left) * key_base + (key_base - 1 - moves_left)
+	size_t key_base;
+	size_t turns;
+
+	size_t moves_left(const grid_node & n) const { return key_base - 1 - n.key % key_base; }
+	size_t turns_left(const grid_node & n) const { return turns - n.key / key_base; }
+
+private:
+	boost::uint32_t gen_;
+	std::vector<boost::uint32_t> seen_;
+	std::vector<boost::uint32_t> done_;
+	std::vector<boost::uint32_t> facts_gen_;
+	std::vector<unsigned char> facts_;
+};
+
+} // end namespace wesnoth
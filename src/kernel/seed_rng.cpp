@@ -44,12 +44,16 @@
 
 #include <sstream>
 #include <iomanip>
+#include <mutex>
 
 namespace seed_rng {
 
 	uint32_t next_seed() {
 	#ifndef NO_BOOST_RANDOM_DEVICE
+		// Kernels on different threads share the device, and it is not safe to draw from concurrently.
+		static std::mutex mutex_;
 		static boost::random_device rnd_;
+		std::lock_guard<std::mutex> lock(mutex_);
 		return rnd_();
 	#else
 		return static_cast<uint32_t> (std::time(0));
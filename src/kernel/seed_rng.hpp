@@ -20,6 +20,8 @@
 
    The seed_rng::next_seed function provided probably shouldn't be used
    anywhere except for default constructors of prg classes, or similar.
+
+   It is safe to call from several threads at once.
 */
 
 #pragma once
@@ -0,0 +1,349 @@
+#include "terrain_grid.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace wesnoth {
+
+////
+// terrain_codes
+////
+
+const terrain_code terrain_codes::NONE;
+
+terrain_codes::terrain_codes()
+	: names_()
+	, aliases_()
+	, buckets_()
+{
+}
+
+size_t terrain_codes::hash(const char * begin, const char * end) {
+	size_t h = 2166136261u; // FNV-1a
+	for (const char * p = begin; p != end; ++p) {
+		h = (h ^ static_cast<unsigned char>(*p)) * 16777619u;
+	}
+	return h;
+}
+
+size_t terrain_codes::bucket(const char * begin, const char * end, size_t h) const {
+	const size_t mask = buckets_.size() - 1;
+	const size_t n = end - begin;
+	for (size_t i = h & mask; ; i = (i + 1) & mask) {
+		terrain_code c = buckets_[i];
+		if (c == NONE || (names_[c].size() == n && std::memcmp(names_[c].data(), begin, n) == 0)) {
+			return i;
+		}
+	}
+}
+
+void terrain_codes::rehash(size_t nbuckets) {
+	buckets_.assign(nbuckets, NONE);
+	for (size_t c = 0; c < names_.size(); ++c) {
+		const char * name = names_[c].data();
+		buckets_[bucket(name, name + names_[c].size(), hash(name, name + names_[c].size()))] = static_cast<terrain_code>(c);
+	}
+}
+
+terrain_code terrain_codes::intern(const char * begin, const char * end) {
+	if (buckets_.empty()) {
+		rehash(64);
+	}
+	size_t i = bucket(begin, end, hash(begin, end));
+	if (buckets_[i] != NONE) {
+		return buckets_[i];
+	}
+	if (names_.size() >= NONE) {
+		return NONE;
+	}
+
+	terrain_code c = static_cast<terrain_code>(names_.size());
+	names_.push_back(terrain_id(begin, end));
+	aliases_.push_back(std::vector<terrain_code>(1, c));
+	buckets_[i] = c;
+	if (names_.size() * 2 > buckets_.size()) {
+		rehash(buckets_.size() * 2);
+	}
+	return c;
+}
+
+terrain_code terrain_codes::find(const char * begin, const char * end) const {
+	if (buckets_.empty()) {
+		return NONE;
+	}
+	return buckets_[bucket(begin, end, hash(begin, end))];
+}
+
+void terrain_codes::set_aliases(terrain_code c, const std::vector<terrain_code> & of) {
+	aliases_[c] = of.empty() ? std::vector<terrain_code>(1, c) : of;
+}
+
+////
+// terrain_grid
+////
+
+const size_t terrain_grid::MAX_GROWN_SIZE;
+std::atomic<size_t> terrain_grid::shapes_(0);
+
+terrain_grid::terrain_grid()
+	: codes_(NULL)
+	, x0_(0)
+	, y0_(0)
+	, w_(0)
+	, h_(0)
+	, hexes_(0)
+	, codes_by_hex_()
+	, shape_(0)
+{
+	new_shape();
+}
+
+terrain_grid::terrain_grid(const terrain_codes * codes)
+	: codes_(codes)
+	, x0_(0)
+	, y0_(0)
+	, w_(0)
+	, h_(0)
+	, hexes_(0)
+	, codes_by_hex_()
+	, shape_(0)
+{
+	new_shape();
+}
+
+void terrain_grid::reset(const terrain_codes * codes, int x0, int y0, int w, int h) {
+	codes_ = codes;
+	x0_ = x0;
+	y0_ = y0;
+	w_ = std::max(w, 0);
+	h_ = std::max(h, 0);
+	hexes_ = 0;
+	codes_by_hex_.assign(static_cast<size_t>(w_) * h_, terrain_codes::NONE);
+	new_shape();
+}
+
+bool terrain_grid::set(map_location loc, terrain_code c) {
+	int i = index(loc);
+	if (i < 0) {
+		if (c == terrain_codes::NONE) {
+			return true;
+		}
+		if (!packed_location::fits(loc)) {
+			return false;
+		}
+		// Grow the rectangle to take in the hex. The hex is within 16 bits, but the rectangle might not be.
+		boost::int64_t gx0 = w_ ? std::min<boost::int64_t>(x0_, loc.x) : loc.x, gy0 = h_ ? std::min<boost::int64_t>(y0_, loc.y) : loc.y;
+		boost::int64_t gx1 = w_ ? std::max<boost::int64_t>(boost::int64_t(x0_) + w_, loc.x + 1) : loc.x + 1;
+		boost::int64_t gy1 = h_ ? std::max<boost::int64_t>(boost::int64_t(y0_) + h_, loc.y + 1) : loc.y + 1;
+		if (static_cast<boost::uint64_t>((gx1 - gx0) * (gy1 - gy0)) > std::max(codes_by_hex_.size(), MAX_GROWN_SIZE)) {
+			return false;
+		}
+		int x0 = static_cast<int>(gx0), y0 = static_cast<int>(gy0), x1 = static_cast<int>(gx1), y1 = static_cast<int>(gy1);
+		std::vector<terrain_code> grown(static_cast<size_t>(x1 - x0) * static_cast<size_t>(y1 - y0), terrain_codes::NONE);
+		for (int y = 0; y < h_; ++y) {
+			std::copy(codes_by_hex_.begin() + y * w_, codes_by_hex_.begin() + (y + 1) * w_, grown.begin() + (y + y0_ - y0) * (x1 - x0) + (x0_ - x0));
+		}
+		codes_by_hex_.swap(grown);
+		x0_ = x0;
+		y0_ = y0;
+		w_ = x1 - x0;
+		h_ = y1 - y0;
+		i = index(loc);
+	}
+
+	terrain_code old = codes_by_hex_[i];
+	if ((old == terrain_codes::NONE) != (c == terrain_codes::NONE)) {
+		if (c == terrain_codes::NONE) {
+			--hexes_;
+		} else {
+			++hexes_;
+		}
+		new_shape();
+	}
+	codes_by_hex_[i] = c;
+	return true;
+}
+
+void terrain_grid::crop_rows(int h) {
+	if (h >= h_) {
+		return;
+	}
+	h = std::max(h, 0);
+	const size_t kept = static_cast<size_t>(h) * w_;
+	hexes_ -= (codes_by_hex_.size() - kept) - std::count(codes_by_hex_.begin() + kept, codes_by_hex_.end(), terrain_codes::NONE);
+	codes_by_hex_.resize(kept);
+	h_ = h;
+	new_shape();
+}
+
+////
+// map_data
+////
+
+static bool is_blank(char c) {
+	return c == ' ' || c == '\t' || c == '\r';
+}
+
+// Calls f(p) for each comma and newline p of [begin, end), in order. Returns false as soon as f does.
+template<typename F>
+static bool for_each_delimiter(const char * begin, const char * end, F f) {
+	const char * p = begin;
+#ifdef __SSE2__
+	const __m128i comma = _mm_set1_epi8(','), newline = _mm_set1_epi8('\n');
+	for (; end - p >= 16; p += 16) {
+		__m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+		unsigned mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(block, comma), _mm_cmpeq_epi8(block, newline)));
+		while (mask) {
+			if (!f(p + __builtin_ctz(mask))) {
+				return false;
+			}
+			mask &= mask - 1;
+		}
+	}
+#endif
+	for (; p != end; ++p) {
+		if ((*p == ',' || *p == '\n') && !f(p)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static size_t count_newlines(const char * begin, const char * end) {
+	size_t n = 0;
+	const char * p = begin;
+#ifdef __SSE2__
+	const __m128i newline = _mm_set1_epi8('\n');
+	for (; end - p >= 16; p += 16) {
+		__m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+		n += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(block, newline)));
+	}
+#endif
+	for (; p != end; ++p) {
+		n += *p == '\n';
+	}
+	return n;
+}
+
+// Skips the header lines and blank lines before the rows, reading border_size from the header
+static const char * skip_header(const char * begin, const char * end, int & border_size) {
+	static const char key[] = "border_size";
+	const size_t key_size = sizeof(key) - 1;
+
+	const char * line = begin;
+	while (line != end) {
+		const char * line_end = std::find(line, end, '\n');
+		const char * equals = std::find(line, line_end, '=');
+		if (equals == line_end && std::find_if(line, line_end, [](char c) { return !is_blank(c); }) != line_end) {
+			return line; // the first row
+		}
+		if (equals != line_end && static_cast<size_t>(equals - line) >= key_size && std::equal(key, key + key_size, line)) {
+			border_size = std::atoi(equals + 1);
+		}
+		line = line_end == end ? end : line_end + 1;
+	}
+	return end;
+}
+
+void read_map_data(const char * begin, const char * end, terrain_codes & codes, terrain_grid & out, start_positions * starts, map_border border) {
+	int border_size = 1;
+	const char * data = skip_header(begin, end, border_size);
+	const int b = border == DATA_ORIGIN ? 0 : border_size;
+
+	// The first row sets the width, and there are at most as many rows as lines
+	int w = 1;
+	for_each_delimiter(data, end, [&](const char * p) {
+		if (*p == '\n') {
+			return false;
+		}
+		++w;
+		return true;
+	});
+	const int lines = static_cast<int>(count_newlines(data, end)) + 1;
+	if (border == DROP_BORDER) {
+		out.reset(&codes, 0, 0, w - 2 * b, lines - 2 * b);
+	} else {
+		out.reset(&codes, -b, -b, w, lines);
+	}
+
+	std::vector<terrain_code> & hexes = out.codes_by_hex_;
+	const size_t first_start = starts ? starts->size() : 0;
+	size_t on_map = 0;
+	int x = 0, y = 0; // in the data
+	const char * cell = data;
+	auto read_cell = [&](const char * cell_end, bool row_end) {
+		const char * cb = cell, * ce = cell_end;
+		cell = cell_end == end ? end : cell_end + 1;
+		while (cb != ce && is_blank(*cb)) {
+			++cb;
+		}
+		while (ce != cb && is_blank(ce[-1])) {
+			--ce;
+		}
+		if (cb == ce && x == 0 && row_end) {
+			return true; // a blank line
+		}
+
+		map_location loc;
+		loc.x = x - b;
+		loc.y = y - b;
+		if (row_end) {
+			x = 0;
+			++y;
+		} else {
+			++x;
+		}
+
+		// A starting position: its number, then the code
+		const char * space = std::find(cb, ce, ' ');
+		if (space != ce) {
+			int number = 0;
+			for (const char * p = cb; p != space && *p >= '0' && *p <= '9'; ++p) {
+				number = number * 10 + (*p - '0');
+			}
+			if (starts) {
+				starts->push_back(std::make_pair(number, loc));
+			}
+			cb = space;
+			while (cb != ce && is_blank(*cb)) {
+				++cb;
+			}
+		}
+		if (cb == ce || (border == DROP_BORDER && (loc.x < 0 || loc.y < 0 || loc.x >= w - 2 * b))) {
+			return true;
+		}
+
+		terrain_code c = codes.intern(cb, ce);
+		int i = out.index(loc);
+		if (i >= 0 && hexes[i] == terrain_codes::NONE) {
+			hexes[i] = c;
+			++on_map;
+		} else {
+			out.set(loc, c); // a longer row than the first one
+		}
+		return true;
+	};
+
+	for_each_delimiter(data, end, [&](const char * p) {
+		return read_cell(p, *p == '\n');
+	});
+	if (cell < end) {
+		read_cell(end, true); // the last row has no newline
+	}
+
+	out.hexes_ += on_map;
+	out.crop_rows(border == DROP_BORDER ? y - 2 * b : y);
+	if (border == DROP_BORDER && starts) {
+		// The bottom border rows were read before it was known that they are the border
+		starts->erase(std::remove_if(starts->begin() + first_start, starts->end(), [&](const std::pair<int, map_location> & s) {
+			return !out.on_map(s.second);
+		}), starts->end());
+	}
+}
+
+} // end namespace wesnoth
@@ -0,0 +1,165 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+#include <boost/cstdint.hpp>
+
+#include "kernel_types.hpp"
+
+namespace wesnoth {
+
+typedef boost::uint16_t terrain_code;
+
+class terrain_codes;
+class terrain_grid;
+
+// Where read_map_data puts a map: with the first code of the data at (0, 0), or with the first hex
+// inside the border there, the border (of border_size hexes, 1 without a header) kept around it or
+// left off the grid
+enum map_border { DATA_ORIGIN, KEEP_BORDER, DROP_BORDER };
+
+typedef std::vector<std::pair<int, map_location> > start_positions; // number and location
+
+// Reads the map_data of a scenario: rows of comma separated terrain codes, one per line, where a
+// code may be preceded by the number of a starting position ("1 Kh"). Lines holding '=' before the
+// rows are the header of the old map format. The codes are interned straight from the text, and
+// nothing is allocated once the grid, the table and starts have seen a map as large. The starting
+// positions are added to starts, if given.
+void read_map_data(const char * begin, const char * end, terrain_codes & codes, terrain_grid & out, start_positions * starts = NULL, map_border border = DATA_ORIGIN);
+
+////
+// The terrain strings of a game, each interned once as a 16 bit code.
+//
+// A terrain can be an alias of others (its "aliasof" in the terrain config), then what counts for
+// it is taken from those. A terrain which isn't an alias has itself as only alias.
+////
+
+class terrain_codes {
+public:
+	static const terrain_code NONE = 0xFFFF;
+
+	terrain_codes();
+
+	// The code of a string, interned the first time it is seen (only then is the string copied).
+	// Returns NONE once all the codes are taken.
+	terrain_code intern(const char * begin, const char * end);
+	terrain_code intern(const terrain_id & t) { return intern(t.data(), t.data() + t.size()); }
+
+	// The code of a string, or NONE if it was never interned
+	terrain_code find(const char * begin, const char * end) const;
+	terrain_code find(const terrain_id & t) const { return find(t.data(), t.data() + t.size()); }
+
+	size_t size() const { return names_.size(); }
+	const terrain_id & name(terrain_code c) const { return names_[c]; }
+
+	void set_aliases(terrain_code c, const std::vector<terrain_code> & of);
+	const std::vector<terrain_code> & aliases(terrain_code c) const { return aliases_[c]; }
+
+private:
+	static size_t hash(const char * begin, const char * end);
+	// The bucket holding a string, or the empty bucket where it would go
+	size_t bucket(const char * begin, const char * end, size_t h) const;
+	void rehash(size_t nbuckets);
+
+	std::vector<terrain_id> names_;
+	std::vector<std::vector<terrain_code> > aliases_;
+	std::vector<terrain_code> buckets_; // open addressing, a power of two of them, NONE where empty
+};
+
+////
+// The terrain of each hex of a rectangle of the map, row by row, as terrain codes. The hexes of the
+// rectangle which aren't on the map hold NONE, so whether a hex is on the map is a bounds check and
+// a compare. Each grid knows the table its codes come from.
+////
+
+class terrain_grid {
+public:
+	terrain_grid();
+	explicit terrain_grid(const terrain_codes * codes);
+
+	const terrain_codes & codes() const { return *codes_; }
+
+	// Clear the grid and lay it over a rectangle, with no hex on the map
+	void reset(const terrain_codes * codes, int x0, int y0, int w, int h);
+
+	int x0() const { return x0_; }
+	int y0() const { return y0_; }
+	int width() const { return w_; }
+	int height() const { return h_; }
+
+	// The number of hexes on the map
+	size_t size() const { return hexes_; }
+	bool empty() const { return hexes_ == 0; }
+
+	// Index of a location, or -1 if it is outside the rectangle
+	int index(map_location loc) const {
+		boost::int64_t x = boost::int64_t(loc.x) - x0_, y = boost::int64_t(loc.y) - y0_;
+		if (x < 0 || y < 0 || x >= w_ || y >= h_) {
+			return -1;
+		}
+		return static_cast<int>(y * w_ + x);
+	}
+	map_location location(size_t i) const {
+		map_location loc;
+		loc.x = x0_ + static_cast<int>(i % w_);
+		loc.y = y0_ + static_cast<int>(i / w_);
+		return loc;
+	}
+
+	bool on_map(map_location loc) const {
+		int i = index(loc);
+		return i >= 0 && codes_by_hex_[i] != terrain_codes::NONE;
+	}
+	// The code at a hex, NONE off the map
+	terrain_code code(map_location loc) const {
+		int i = index(loc);
+		return i < 0 ? terrain_codes::NONE : codes_by_hex_[i];
+	}
+	const terrain_id & name(map_location loc) const { return codes_->name(code(loc)); }
+
+	// The most hexes which a hex set outside of the rectangle may grow it to
+	static const size_t MAX_GROWN_SIZE = 1024 * 1024;
+
+	// Change the terrain of a hex. Setting NONE takes it off the map, and a hex outside of the
+	// rectangle grows it. Returns false, and leaves the grid as it was, for a hex out of the range
+	// of packed_location, or which would grow the rectangle past MAX_GROWN_SIZE hexes (or past its
+	// size, for a larger map read from map_data).
+	bool set(map_location loc, terrain_code c);
+
+	// Calls f(loc, code) for each hex on the map, row by row
+	template<typename F>
+	void for_each(F f) const {
+		for (size_t i = 0; i < codes_by_hex_.size(); ++i) {
+			if (codes_by_hex_[i] != terrain_codes::NONE) {
+				f(location(i), codes_by_hex_[i]);
+			}
+		}
+	}
+
+	const std::vector<terrain_code> & codes_by_hex() const { return codes_by_hex_; }
+
+	// Changes each time hexes go on or off the map, and differs between grids of different shapes,
+	// so that layouts of the map can tell whether they still match
+	size_t shape() const { return shape_; }
+
+private:
+	friend void read_map_data(const char *, const char *, terrain_codes &, terrain_grid &, start_positions *, map_border);
+
+	void new_shape() { shape_ = ++shapes_; }
+	// Keep only the first h rows
+	void crop_rows(int h);
+
+	const terrain_codes * codes_;
+	int x0_, y0_;
+	int w_, h_;
+	size_t hexes_;
+	std::vector<terrain_code> codes_by_hex_;
+	size_t shape_;
+
+	static std::atomic<size_t> shapes_;
+};
+
+} // end namespace wesnoth
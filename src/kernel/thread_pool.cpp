@@ -0,0 +1,83 @@
+#include "thread_pool.hpp"
+
+namespace wesnoth {
+
+thread_pool::thread_pool(size_t nthreads)
+	: threads_()
+	, loop_mutex_()
+	, mutex_()
+	, wake_()
+	, finished_()
+	, stopping_(false)
+	, loop_(0)
+	, body_(NULL)
+	, n_(0)
+	, next_(0)
+	, busy_(0)
+{
+	for (size_t i = 0; i < nthreads; ++i) {
+		threads_.push_back(std::thread(&thread_pool::run, this, i));
+	}
+}
+
+thread_pool::~thread_pool() {
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		stopping_ = true;
+	}
+	wake_.notify_all();
+	for (size_t i = 0; i < threads_.size(); ++i) {
+		threads_[i].join();
+	}
+}
+
+void thread_pool::parallel_for(size_t n, const loop_body & body) {
+	if (threads_.empty()) {
+		for (size_t i = 0; i < n; ++i) {
+			body(i, 0);
+		}
+		return;
+	}
+
+	std::lock_guard<std::mutex> loop_lock(loop_mutex_);
+
+	std::unique_lock<std::mutex> lock(mutex_);
+	body_ = &body;
+	n_ = n;
+	next_.store(0);
+	busy_ = threads_.size();
+	++loop_;
+	wake_.notify_all();
+
+	finished_.wait(lock, [this]() { return busy_ == 0; });
+	body_ = NULL;
+}
+
+void thread_pool::run(size_t worker) {
+	size_t done_loop = 0;
+	for (;;) {
+		const loop_body * body;
+		size_t n;
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			wake_.wait(lock, [&]() { return stopping_ || loop_ != done_loop; });
+			if (stopping_) {
+				return;
+			}
+			done_loop = loop_;
+			body = body_;
+			n = n_;
+		}
+
+		for (size_t i = next_++; i < n; i = next_++) {
+			(*body)(i, worker);
+		}
+
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (--busy_ == 0) {
+			finished_.notify_one();
+		}
+	}
+}
+
+} // end namespace wesnoth
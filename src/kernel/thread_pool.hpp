@@ -0,0 +1,56 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <boost/function.hpp>
+
+namespace wesnoth {
+
+////
+// A fixed set of worker threads for data parallel loops.
+//
+// parallel_for hands out the indices of a loop to the workers one at a time, and returns
+// once all of them are done. The body also gets the number of the worker running it, less
+// than size(), so it can use per-thread scratch memory without locking.
+//
+// Loops from different threads are run one after the other. A pool of zero threads runs
+// loops on the calling thread, as worker 0.
+////
+
+class thread_pool {
+public:
+	typedef boost::function<void(size_t index, size_t worker)> loop_body;
+
+	explicit thread_pool(size_t nthreads = std::thread::hardware_concurrency());
+	~thread_pool();
+
+	size_t size() const { return threads_.empty() ? 1 : threads_.size(); }
+
+	// The body must not throw.
+	void parallel_for(size_t n, const loop_body & body);
+
+private:
+	thread_pool(const thread_pool&); // noncopyable
+
+	void run(size_t worker);
+
+	std::vector<std::thread> threads_;
+
+	std::mutex loop_mutex_; // held for the whole of a parallel_for
+
+	std::mutex mutex_;
+	std::condition_variable wake_;
+	std::condition_variable finished_;
+	bool stopping_;
+	size_t loop_;        // number of the current loop, so a worker joins each one only once
+	const loop_body * body_;
+	size_t n_;
+	std::atomic<size_t> next_;
+	size_t busy_;        // workers still inside the current loop
+};
+
+} // end namespace wesnoth
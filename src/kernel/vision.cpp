@@ -0,0 +1,315 @@
+#include "vision.hpp"
+
+#include <algorithm>
+#include <cassert>
+
+#include <boost/bind.hpp>
+#include <boost/foreach.hpp>
+
+namespace wesnoth {
+
+vision_engine::vision_engine(pathfind_context & context, const geometry & g, sides & s, const vision_fcn & describe)
+	: context_(context)
+	, geom_(g.clone())
+	, sides_(s)
+	, describe_(describe)
+	, seers_()
+	, area_()
+	, counts_()
+	, fog_()
+	, shroud_()
+	, changed_sides_()
+	, reach_()
+	, seen_()
+	, adjacent_()
+	, jammers_()
+	, base_costs_()
+{
+}
+
+void vision_engine::use_fog(int side, bool b) {
+	assert(side >= 0);
+	if (static_cast<size_t>(side) >= fog_.size()) {
+		fog_.resize(side + 1, false);
+	}
+	fog_[side] = b;
+
+	if (!b) {
+		hex_bitset everything = sides_.make_plane();
+		everything.fill();
+		sides_.remove_fog(side, everything);
+		changed_sides_.push_back(side);
+		publish_changes();
+		return;
+	}
+	const std::vector<boost::uint16_t> & counts = counts_of(side);
+	for (size_t i = 0; i < area_.size(); ++i) {
+		set_fog(area_.location(i), side, counts[i] == 0);
+	}
+	publish_changes();
+}
+
+void vision_engine::use_shroud(int side, bool b) {
+	assert(side >= 0);
+	if (static_cast<size_t>(side) >= shroud_.size()) {
+		shroud_.resize(side + 1, false);
+	}
+	shroud_[side] = b;
+
+	if (b) {
+		const std::vector<boost::uint16_t> & counts = counts_of(side);
+		for (size_t i = 0; i < area_.size(); ++i) {
+			if (counts[i]) {
+				set_shroud(area_.location(i), side, false);
+			}
+		}
+	}
+	publish_changes();
+}
+
+size_t vision_engine::viewers(map_location loc, int side) const {
+	int i = area_.index(loc);
+	if (i < 0 || side < 0 || static_cast<size_t>(side) >= counts_.size() || counts_[side].empty()) {
+		return 0;
+	}
+	return counts_[side][i];
+}
+
+std::vector<boost::uint16_t> & vision_engine::counts_of(int side) {
+	assert(side >= 0);
+	if (static_cast<size_t>(side) >= counts_.size()) {
+		counts_.resize(side + 1);
+	}
+	if (counts_[side].size() != area_.size()) {
+		counts_[side].assign(area_.size(), 0);
+	}
+	return counts_[side];
+}
+
+////
+// Looking
+////
+
+size_t vision_engine::jammed_cost(map_location loc) {
+	size_t jam = 0;
+	BOOST_FOREACH(const jammer & j, jammers_) {
+		size_t d = geom_->distance(j.first, loc);
+		if (d < j.second) {
+			jam = std::max(jam, j.second - d);
+		}
+	}
+	return (base_costs_ ? (*base_costs_)(loc) : 1) + jam;
+}
+
+// Finds the cells a unit sees. The area must be rebuilt if they aren't laid out over it.
+void vision_engine::look(seer & r, const pathing_query & resources) {
+	jammers_.clear();
+	BOOST_FOREACH(const seer_map::value_type & v, seers_) {
+		const seer & j = v.second;
+		if (j.vision.jamming && !sides_.are_allied(j.side, r.side) && geom_->distance(j.loc, r.loc) <= r.vision.vision + j.vision.jamming) {
+			jammers_.push_back(std::make_pair(j.loc, j.vision.jamming));
+		}
+	}
+
+	pathing_query q;
+	q.start = r.loc;
+	q.moves = r.vision.vision;
+	q.max_moves = r.vision.vision;
+	q.turns = 0;
+	q.ignore_zoc = true;
+	q.tmap_ = resources.tmap_;
+	q.terrain_ = resources.terrain_;
+	if (jammers_.empty()) {
+		q.cost_map = r.vision.costs;
+	} else {
+		base_costs_ = r.vision.costs;
+		q.cost_map = move_cost_fcn(boost::bind(&vision_engine::jammed_cost, this, _1));
+	}
+	context_.reachable_hexes(q, reach_);
+
+	// and the hexes next to those reached
+	seen_ = reach_;
+	reach_.for_each([&](map_location l) {
+		geom_->get_adjacent(l, adjacent_);
+		BOOST_FOREACH(map_location a, adjacent_) {
+			int i = seen_.index(a);
+			if (i >= 0) {
+				seen_.set(static_cast<size_t>(i));
+			}
+		}
+	});
+
+	r.seen.clear();
+	seen_.for_each([&](map_location l) {
+		r.seen.push_back(seen_.index(l));
+	});
+}
+
+void vision_engine::changed_count(int side, int cell, bool seen) {
+	map_location loc = area_.location(cell);
+	if (static_cast<size_t>(side) < fog_.size() && fog_[side]) {
+		set_fog(loc, side, !seen);
+	}
+	if (seen && static_cast<size_t>(side) < shroud_.size() && shroud_[side]) {
+		set_shroud(loc, side, false);
+	}
+}
+
+void vision_engine::set_fog(map_location loc, int side, bool b) {
+	if (sides_.true_fog(loc, side) != b) {
+		sides_.set_fog(loc, side, b);
+		if (changed_sides_.empty() || changed_sides_.back() != side) {
+			changed_sides_.push_back(side);
+		}
+	}
+}
+
+void vision_engine::set_shroud(map_location loc, int side, bool b) {
+	if (sides_.true_shroud(loc, side) != b) {
+		sides_.set_shroud(loc, side, b);
+		if (changed_sides_.empty() || changed_sides_.back() != side) {
+			changed_sides_.push_back(side);
+		}
+	}
+}
+
+// The searches of the pathfinder see the fog and shroud through masks, those of the allies of the
+// sides whose bits changed must go
+void vision_engine::publish_changes() {
+	std::sort(changed_sides_.begin(), changed_sides_.end());
+	changed_sides_.erase(std::unique(changed_sides_.begin(), changed_sides_.end()), changed_sides_.end());
+	BOOST_FOREACH(int side, changed_sides_) {
+		context_.vision_changed(side, sides_);
+	}
+	changed_sides_.clear();
+}
+
+void vision_engine::count(const seer & r, int delta) {
+	std::vector<boost::uint16_t> & counts = counts_of(r.side);
+	BOOST_FOREACH(int i, r.seen) {
+		if (delta > 0) {
+			if (counts[i]++ == 0) {
+				changed_count(r.side, i, true);
+			}
+		} else {
+			assert(counts[i] > 0);
+			if (--counts[i] == 0) {
+				changed_count(r.side, i, false);
+			}
+		}
+	}
+}
+
+////
+// Following the units
+////
+
+void vision_engine::rebuild(const pathing_query & resources) {
+	assert(resources.units && (resources.tmap_ || resources.terrain_));
+	seers_.clear();
+	BOOST_FOREACH(const unit_rec & u, *resources.units) {
+		seer r;
+		if (describe_(u, r.vision)) {
+			r.side = resources.units->side(u);
+			r.loc = u.loc_;
+			seers_.insert(std::make_pair(u.id_, r));
+		}
+	}
+
+	// All the units are known before any looks, for the jamming
+	BOOST_FOREACH(seer_map::value_type & v, seers_) {
+		look(v.second, resources);
+		if (!reach_.same_rectangle(area_)) {
+			area_ = hex_bitset(reach_.x0(), reach_.y0(), reach_.width(), reach_.height());
+		}
+	}
+
+	counts_.clear();
+	BOOST_FOREACH(const seer_map::value_type & v, seers_) {
+		std::vector<boost::uint16_t> & counts = counts_of(v.second.side);
+		BOOST_FOREACH(int i, v.second.seen) {
+			++counts[i];
+		}
+	}
+
+	for (size_t side = 0; side < std::max(fog_.size(), shroud_.size()); ++side) {
+		if (side < fog_.size() && fog_[side]) {
+			use_fog(side, true);
+		}
+		if (side < shroud_.size() && shroud_[side]) {
+			use_shroud(side, true);
+		}
+	}
+}
+
+// The units of the enemies of a jammer near where it was or is now look again
+void vision_engine::relook_jammed(int id, int side, map_location a, map_location b, size_t jamming, const pathing_query & resources) {
+	BOOST_FOREACH(seer_map::value_type & v, seers_) {
+		seer & r = v.second;
+		if (v.first == id || sides_.are_allied(r.side, side)) {
+			continue;
+		}
+		size_t range = r.vision.vision + jamming;
+		if (geom_->distance(r.loc, a) > range && geom_->distance(r.loc, b) > range) {
+			continue;
+		}
+		seer before = r;
+		look(r, resources);
+		count(r, 1);
+		count(before, -1);
+	}
+}
+
+void vision_engine::unit_changed(const unit_rec & u, const pathing_query & resources) {
+	unit_vision v;
+	if (!describe_(u, v)) {
+		unit_removed(u.id_, resources);
+		return;
+	}
+
+	seer_map::iterator it = seers_.find(u.id_);
+	const bool existed = it != seers_.end();
+	seer before;
+	if (existed) {
+		before = it->second;
+	} else {
+		it = seers_.insert(std::make_pair(u.id_, seer())).first;
+	}
+	seer & r = it->second;
+	r.side = resources.units->side(u);
+	r.loc = u.loc_;
+	r.vision = v;
+	look(r, resources);
+	if (!reach_.same_rectangle(area_)) {
+		rebuild(resources); // the layout of the map changed
+		return;
+	}
+
+	// Count the hexes seen now first, so that those seen before and after don't get fogged in between
+	count(r, 1);
+	if (existed) {
+		count(before, -1);
+	}
+
+	size_t jamming = std::max(existed ? before.vision.jamming : 0, v.jamming);
+	if (jamming) {
+		relook_jammed(u.id_, r.side, existed ? before.loc : r.loc, r.loc, jamming, resources);
+	}
+	publish_changes();
+}
+
+void vision_engine::unit_removed(int id, const pathing_query & resources) {
+	seer_map::iterator it = seers_.find(id);
+	if (it == seers_.end()) {
+		return;
+	}
+	seer old = it->second;
+	seers_.erase(it);
+	count(old, -1);
+	if (old.vision.jamming) {
+		relook_jammed(id, old.side, old.loc, old.loc, old.vision.jamming, resources);
+	}
+	publish_changes();
+}
+
+} // end namespace wesnoth
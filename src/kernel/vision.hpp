@@ -0,0 +1,102 @@
+#pragma once
+
+#include <map>
+#include <vector>
+
+#include <boost/cstdint.hpp>
+#include <boost/function.hpp>
+#include <boost/optional.hpp>
+#include <boost/shared_ptr.hpp>
+
+#include "game_data.hpp"
+#include "hex_bitset.hpp"
+
+namespace wesnoth {
+
+////
+// What the units of each side see, kept up to date as units move.
+//
+// A unit sees the hexes it could reach with its vision points under its vision costs, and
+// the hexes next to those. Enemy jammers make seeing harder around them: a hex at distance d
+// from a unit with jamming j costs j - d more to see into, when that is positive (the most
+// jammed by any one jammer).
+//
+// For each side and each hex, the engine counts the units of the side which see it. When a
+// unit moves, only the hexes it saw and the ones it sees now are counted again, and those
+// going to or from zero are fogged or cleared, and unshrouded, in the planes of the sides
+// (for the sides told to have fog or shroud). Units of other sides only look again when a
+// jammer moved near enough to them. The sides whose fog or shroud changed are collected while
+// the engine works, and once it is done the pathfind context drops the masks of their allies.
+////
+
+class vision_engine {
+public:
+	typedef pathfind_context::pathing_query pathing_query;
+
+	struct unit_vision {
+		size_t vision;                        // vision points
+		boost::optional<move_cost_fcn> costs; // of seeing into a hex, 1 if not set
+		size_t jamming;                       // taken from the vision of enemies near the unit
+
+		unit_vision() : vision(0), costs(), jamming(0) {}
+	};
+	// Describes the vision of a unit, or returns false if it sees nothing
+	typedef boost::function<bool(const unit_rec &, unit_vision &)> vision_fcn;
+
+	vision_engine(pathfind_context & context, const geometry & g, sides & s, const vision_fcn & describe);
+
+	// Whether the engine keeps fog for a side, and clears its shroud where its units look
+	void use_fog(int side, bool b);
+	void use_shroud(int side, bool b);
+
+	// See everything again from all the units of resources.units, on the map of resources
+	void rebuild(const pathing_query & resources);
+
+	// A unit was added, moved (to its loc_) or changed its vision
+	void unit_changed(const unit_rec & u, const pathing_query & resources);
+	void unit_removed(int id, const pathing_query & resources);
+
+	// How many units of a side see a hex
+	size_t viewers(map_location loc, int side) const;
+
+private:
+	struct seer {
+		int side;
+		map_location loc;
+		unit_vision vision;
+		std::vector<int> seen; // cells of the area, sorted
+
+		seer() : side(0), loc(), vision(), seen() {}
+	};
+
+	void look(seer & r, const pathing_query & resources);
+	size_t jammed_cost(map_location loc);
+	void count(const seer & r, int delta);
+	void changed_count(int side, int cell, bool seen);
+	void set_fog(map_location loc, int side, bool b);
+	void set_shroud(map_location loc, int side, bool b);
+	void publish_changes();
+	void relook_jammed(int id, int side, map_location a, map_location b, size_t jamming, const pathing_query & resources);
+	std::vector<boost::uint16_t> & counts_of(int side);
+
+	pathfind_context & context_;
+	boost::shared_ptr<geometry> geom_;
+	sides & sides_;
+	vision_fcn describe_;
+
+	typedef std::map<int, seer> seer_map;
+	seer_map seers_;                                     // by unit id
+	hex_bitset area_;                                    // the layout of the map when rebuilt, only its rectangle is used
+	std::vector<std::vector<boost::uint16_t> > counts_; // by side, then cell of the area
+	std::vector<bool> fog_, shroud_;                    // by side
+	std::vector<int> changed_sides_;                    // whose fog or shroud changed since publish_changes
+
+	// working memory of look
+	hex_bitset reach_, seen_;
+	adjacent_hexes adjacent_;
+	typedef std::pair<map_location, size_t> jammer; // location and jamming
+	std::vector<jammer> jammers_;                    // the enemy jammers near the unit looking
+	boost::optional<move_cost_fcn> base_costs_;
+};
+
+} // end namespace wesnoth
@@ -0,0 +1,389 @@
+#include "kernel/kernel.hpp"
+#include "kernel/kernel_pool.hpp"
+#include "kernel/kernel_worker.hpp"
+#include "kernel/lua_alloc.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/foreach.hpp>
+
+using wesnoth::kernel;
+using wesnoth::kernel_pool;
+using wesnoth::kernel_worker;
+using wesnoth::lua_allocator;
+using wesnoth::lua_memory_stats;
+
+typedef std::chrono::steady_clock bench_clock;
+
+static double elapsed_ms(bench_clock::time_point start) {
+	return std::chrono::duration<double, std::milli>(bench_clock::now() - start).count();
+}
+
+static int arg_or(int argc, char** argv, int index, int def) {
+	return index < argc ? std::atoi(argv[index]) : def;
+}
+
+// The last line that a kernel printed.
+static std::string last_line(const kernel& k) {
+	std::string log = k.log();
+	if (!log.empty() && log[log.size() - 1] == '\n') {
+		log.erase(log.size() - 1);
+	}
+	return log.substr(log.find_last_of('\n') + 1);
+}
+
+////
+// threads: Run independent kernels on many threads at once, and check that they
+// all compute the same thing as a kernel running alone.
+////
+
+// Draws from a seeded Rng, churns the allocator, and reports the checksum from inside a coroutine.
+static std::string thread_workload(int iterations) {
+	std::stringstream ss;
+	ss << "local r = Rng.create()\n"
+	      "Rng.seed(r, '1234abcd')\n"
+	      "local t = {}\n"
+	      "local s = 0\n"
+	      "for i = 1, " << iterations << " do\n"
+	      "  t[i % 64 + 1] = { i, tostring(Rng.draw(r)) }\n"
+	      "  s = (s + Rng.draw(r)) % 1000003\n"
+	      "end\n"
+	      "coroutine.wrap(function(x) print(x) end)(s)\n";
+	return ss.str();
+}
+
+struct thread_result {
+	double ms;
+	int mismatches;
+};
+
+static thread_result run_threads(kernel_pool& pool, int nthreads, int leases, int rounds, const std::string& prog, const std::string& expected) {
+	std::atomic<int> mismatches(0);
+	std::vector<std::thread> threads;
+
+	bench_clock::time_point start = bench_clock::now();
+	for (int t = 0; t < nthreads; ++t) {
+		threads.push_back(std::thread([&]() {
+			for (int l = 0; l < leases; ++l) {
+				kernel_pool::handle k = pool.acquire();
+				for (int r = 0; r < rounds; ++r) {
+					if (k->execute(prog).error || last_line(*k) != expected) {
+						++mismatches;
+					}
+				}
+			}
+		}));
+	}
+	for (size_t t = 0; t < threads.size(); ++t) {
+		threads[t].join();
+	}
+
+	thread_result result = { elapsed_ms(start), mismatches };
+	return result;
+}
+
+static int bench_threads(int argc, char** argv) {
+	int max_threads = arg_or(argc, argv, 2, std::max(1u, std::thread::hardware_concurrency()));
+	int iterations = arg_or(argc, argv, 3, 20000);
+	const int leases = 4;
+	const int rounds = 5;
+
+	std::string prog = thread_workload(iterations);
+	kernel_pool pool("", 0, max_threads);
+
+	std::string expected;
+	{
+		kernel_pool::handle k = pool.acquire();
+		k->execute(prog);
+		expected = last_line(*k);
+	}
+	std::cout << "threads: " << leases << " leases x " << rounds << " rounds per thread, " << iterations << " iterations per round, checksum " << expected << "\n\n";
+	std::cout << std::setw(8) << "threads" << std::setw(12) << "ms" << std::setw(14) << "rounds/s" << std::setw(10) << "speedup" << std::setw(12) << "efficiency" << std::setw(12) << "mismatches" << "\n";
+
+	std::vector<int> counts;
+	for (int n = 1; n < max_threads; n *= 2) {
+		counts.push_back(n);
+	}
+	counts.push_back(max_threads);
+
+	int failures = 0;
+	double base = 0;
+	BOOST_FOREACH(int n, counts) {
+		pool.reserve(n);
+		thread_result r = run_threads(pool, n, leases, rounds, prog, expected);
+		double throughput = n * leases * rounds / (r.ms / 1000);
+		if (n == 1) {
+			base = throughput;
+		}
+		std::cout << std::setw(8) << n << std::setw(12) << std::fixed << std::setprecision(1) << r.ms << std::setw(14) << throughput << std::setw(10) << std::setprecision(2)
+			  << throughput / base << std::setw(12) << throughput / base / n << std::setw(12) << r.mismatches << "\n";
+		failures += r.mismatches;
+	}
+
+	std::cout << "\n" << pool.get_stats();
+	return failures ? 1 : 0;
+}
+
+////
+// async: Push many small commands through a kernel_worker, with and without batching.
+////
+
+static double run_async(size_t max_batch, size_t max_queue, int commands, kernel_worker::stats& stats) {
+	std::string empty;
+	kernel_worker::kernel_ptr k(new kernel(empty.begin(), empty.end()));
+
+	bench_clock::time_point start = bench_clock::now();
+	{
+		kernel_worker worker(k, max_batch, max_queue);
+		std::future<kernel::event_result> last;
+		for (int i = 0; i < commands; ++i) {
+			if (i % 16 == 15) {
+				last = worker.fire_event("turn refresh");
+			} else {
+				last = worker.execute("n = (n or 0) + 1");
+			}
+		}
+		last.wait();
+		stats = worker.get_stats();
+	}
+	double ms = elapsed_ms(start);
+
+	std::cout << "max_batch " << max_batch << ", max_queue " << max_queue << ": " << commands << " commands in " << ms << " ms\n" << stats << "\n";
+	return ms;
+}
+
+// A callback which throws must not take the worker down with it.
+static int check_async_errors() {
+	std::string empty;
+	kernel_worker::kernel_ptr k(new kernel(empty.begin(), empty.end()));
+
+	kernel_worker::stats stats;
+	kernel::event_result after;
+	{
+		kernel_worker worker(k);
+		worker.execute("n = 1", [](const kernel::event_result&) { throw std::runtime_error("callback"); });
+		after = worker.execute("n = n + 1").get();
+		stats = worker.get_stats();
+	}
+	bool ok = !after.error && stats.callback_errors == 1 && stats.commands == 2;
+	std::cout << "throwing callback: " << stats.callback_errors << " callback errors, next command " << (after.error ? *after.error : std::string("succeeded")) << "\n";
+	return ok ? 0 : 1;
+}
+
+static int bench_async(int argc, char** argv) {
+	int commands = arg_or(argc, argv, 2, 100000);
+	size_t max_queue = arg_or(argc, argv, 3, 1024);
+
+	kernel_worker::stats unbatched_stats, batched_stats;
+	double unbatched = run_async(1, max_queue, commands, unbatched_stats);
+	double batched = run_async(64, max_queue, commands, batched_stats);
+	std::cout << "speedup from batching: " << unbatched / batched << "\n";
+
+	int failures = check_async_errors();
+	if (unbatched_stats.max_queue_depth > max_queue || batched_stats.max_queue_depth > max_queue) {
+		std::cout << "queue grew past " << max_queue << "\n";
+		++failures;
+	}
+	std::cout << (failures ? "FAILED" : "OK") << "\n";
+	return failures ? 1 : 0;
+}
+
+////
+// alloc: Run an allocation heavy workload with the malloc and pool allocators,
+// report the memory profile, and check that a memory limit is enforced.
+////
+
+static std::string alloc_workload(int iterations) {
+	std::ostringstream ss;
+	ss << "local t = {}\n"
+	   << "for i = 1, " << iterations << " do\n"
+	   << "  t[i % 512] = { x = i, y = -i, name = 'unit' .. i, f = function() return i end }\n"
+	   << "end\n";
+	return ss.str();
+}
+
+static void print_memory(const lua_memory_stats& s) {
+	std::cout << "  live " << s.live_bytes << " bytes, peak " << s.peak_bytes << " bytes, " << s.allocations << " allocations, " << s.frees << " frees, " << s.failures
+		  << " failures\n";
+	std::cout << "  by size:";
+	for (size_t i = 0; i < lua_memory_stats::nsize_buckets; ++i) {
+		if (s.size_histogram[i]) {
+			std::cout << " <=" << (8 << i) << ": " << s.size_histogram[i];
+		}
+	}
+	std::cout << "\n  by kind:";
+	for (size_t i = 0; i < lua_memory_stats::nkinds; ++i) {
+		if (s.kind_histogram[i]) {
+			std::cout << " " << lua_memory_stats::kind_name(i) << ": " << s.kind_histogram[i];
+		}
+	}
+	std::cout << "\n";
+}
+
+static double run_alloc(const std::string& name, const boost::shared_ptr<lua_allocator>& alloc, const std::string& prog, int rounds) {
+	std::string empty;
+	kernel k(empty.begin(), empty.end(), alloc);
+
+	bench_clock::time_point start = bench_clock::now();
+	for (int i = 0; i < rounds; ++i) {
+		k.execute(prog);
+	}
+	double ms = elapsed_ms(start);
+
+	std::cout << name << ": " << ms << " ms\n";
+	print_memory(k.memory_stats());
+	return ms;
+}
+
+static int bench_alloc(int argc, char** argv) {
+	int iterations = arg_or(argc, argv, 2, 200000);
+	int rounds = arg_or(argc, argv, 3, 5);
+	std::string prog = alloc_workload(iterations);
+
+	double with_malloc = run_alloc("malloc", boost::shared_ptr<lua_allocator>(new wesnoth::malloc_allocator()), prog, rounds);
+	boost::shared_ptr<wesnoth::pool_allocator> pool(new wesnoth::pool_allocator());
+	double with_pool = run_alloc("pool", pool, prog, rounds);
+	std::cout << "pool reserved " << pool->reserved_bytes() << " bytes in chunks\n";
+	std::cout << "speedup from pool: " << with_malloc / with_pool << "\n\n";
+
+	// A kernel under a limit must refuse to grow past it, and keep working afterwards.
+	std::string empty;
+	kernel k(empty.begin(), empty.end());
+	size_t limit = k.memory_stats().live_bytes + 256 * 1024;
+	k.set_memory_limit(limit);
+
+	kernel::event_result hog = k.execute("local t = {} for i = 1, 1e7 do t[i] = 'str' .. i end");
+	k.execute("collectgarbage() print(tostring(Memory.stats().live <= Memory.stats().limit))");
+	std::string after = last_line(k);
+
+	lua_memory_stats s = k.memory_stats();
+	std::cout << "limit " << limit << " bytes: hog " << (hog.error ? "failed (" + *hog.error + ")" : std::string("succeeded")) << ", peak " << s.peak_bytes << ", failures "
+		  << s.failures << ", lua sees live <= limit: " << after << "\n";
+
+	bool ok = hog.error && s.peak_bytes <= limit && after == "true";
+	std::cout << (ok ? "OK" : "FAILED") << "\n";
+	return ok ? 0 : 1;
+}
+
+////
+// reset: What one user of a pooled kernel leaves behind, however deeply nested, must not reach the
+// next one. And the pool may be destroyed while kernels are released on other threads.
+////
+
+static const char * const reset_check =
+	"print(tostring(leaked) .. ' ' .. tostring(string.leaked) .. ' ' .. tostring(Rng.leaked) .. ' ' .. tostring(getmetatable('').leaked) .. ' '"
+	" .. ('a'):upper() .. ' ' .. tostring(getmetatable(_G)) .. ' ' .. tostring(getmetatable(string)))";
+
+static const char * const reset_leaks[] = {
+	"leaked = 1 string.leaked = 1 Rng.leaked = 1",
+	"getmetatable('').leaked = 1 getmetatable('').__index = { upper = tostring }",
+	"setmetatable(_G, { __index = function() return 'leaked' end }) setmetatable(string, { __index = function() return 'leaked' end })",
+};
+
+static int bench_reset(int argc, char** argv) {
+	int rounds = arg_or(argc, argv, 2, 50);
+	int nthreads = arg_or(argc, argv, 3, 4);
+
+	int failures = 0;
+	{
+		kernel_pool pool("", 0, 1);
+		std::string expected;
+		{
+			kernel_pool::handle k = pool.acquire();
+			k->execute(reset_check);
+			expected = last_line(*k);
+		}
+		BOOST_FOREACH(const char * leak, reset_leaks) {
+			{
+				kernel_pool::handle k = pool.acquire();
+				k->execute(leak);
+			}
+			kernel_pool::handle k = pool.acquire();
+			std::string after = k->execute(reset_check).error ? "error" : last_line(*k);
+			std::cout << "after \"" << leak << "\": " << after << "\n";
+			failures += after != expected;
+		}
+		std::cout << "fresh kernel: " << expected << "\n" << pool.get_stats();
+	}
+
+	// The last handles go away on other threads while the pool is destroyed
+	std::atomic<int> errors(0);
+	bench_clock::time_point start = bench_clock::now();
+	for (int r = 0; r < rounds; ++r) {
+		kernel_pool * pool = new kernel_pool("", nthreads, nthreads);
+		std::vector<std::thread> threads;
+		for (int t = 0; t < nthreads; ++t) {
+			kernel_pool::handle k = pool->acquire();
+			threads.push_back(std::thread([k, &errors]() mutable {
+				if (k->execute("leaked = 1").error) {
+					++errors;
+				}
+				k.reset();
+			}));
+		}
+		delete pool;
+		for (size_t t = 0; t < threads.size(); ++t) {
+			threads[t].join();
+		}
+	}
+	std::cout << rounds << " pools destroyed while " << nthreads << " threads released their kernels, " << errors << " errors, "
+		  << elapsed_ms(start) / rounds << " ms per round\n";
+	failures += errors;
+
+	// Kernels released at once never fill the pool past its cap
+	{
+		const size_t max_idle = 2;
+		kernel_pool pool("", 0, max_idle);
+		std::vector<kernel_pool::handle> leased;
+		for (int t = 0; t < 2 * nthreads + 2; ++t) {
+			leased.push_back(pool.acquire());
+		}
+		std::vector<std::thread> threads;
+		for (size_t t = 0; t < leased.size(); ++t) {
+			threads.push_back(std::thread([&leased, t]() { leased[t].reset(); }));
+		}
+		for (size_t t = 0; t < threads.size(); ++t) {
+			threads[t].join();
+		}
+		kernel_pool::stats s = pool.get_stats();
+		std::cout << leased.size() << " kernels released at once into a pool of " << max_idle << ": " << s.idle << " kept\n";
+		failures += s.idle > max_idle || s.leased != 0;
+	}
+
+	std::cout << (failures ? "FAILED" : "OK") << "\n";
+	return failures ? 1 : 0;
+}
+
+int main(int argc, char** argv) {
+	std::string mode = argc > 1 ? argv[1] : "";
+
+	if (mode == "threads") {
+		return bench_threads(argc, argv);
+	}
+	if (mode == "async") {
+		return bench_async(argc, argv);
+	}
+	if (mode == "alloc") {
+		return bench_alloc(argc, argv);
+	}
+	if (mode == "reset") {
+		return bench_reset(argc, argv);
+	}
+
+	std::cerr << "usage: " << argv[0] << " <mode> [args]\n"
+		  << "  threads [max_threads] [iterations]  Run independent kernels concurrently, report scaling\n"
+		  << "  async [commands] [max_queue]        Queue commands to a kernel_worker, report latency with and without batching\n"
+		  << "  alloc [iterations] [rounds]         Compare the malloc and pool allocators, check the memory limit\n"
+		  << "  reset [rounds] [threads]            Check that pooled kernels forget nested state, and that the pool can go first\n";
+	return 2;
+}
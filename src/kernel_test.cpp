@@ -2,10 +2,199 @@
 
 #include <iostream>
 #include <fstream>
+#include <string>
+#include <vector>
 
 using std::ifstream;
 
+// Sides are allied when they share a team; a side set to nil has none, and anything else is an error.
+static bool check_alliances() {
+	std::string script =
+		"engine.construct_side(1, { teams = 'north' })\n"
+		"engine.construct_side(2, { teams = 'south,north' })\n"
+		"engine.construct_side(3, { teams = 'south' })\n"
+		"engine.construct_side(4, { teams = 'south' })\n"
+		"engine.construct_side(4, nil)\n"
+		"engine.construct_side(5, { teams = 'north' })\n"
+		"bad_side = not pcall(engine.construct_side, 5, 'south')\n"
+		"bad_teams = not pcall(engine.construct_side, 5, { teams = { 'south' } })\n";
+
+	wesnoth::kernel k(script.begin(), script.end());
+
+	int failures = 0;
+	const struct { int a, b; bool allied; } expected[] = {
+		{ 1, 2, true }, { 2, 3, true }, { 1, 3, false }, { 3, 1, false },
+		{ 4, 3, false }, { 4, 4, true }, { 5, 1, true }, { 5, 3, false },
+	};
+	for (size_t i = 0; i < sizeof(expected) / sizeof(expected[0]); ++i) {
+		if (k.is_allied(expected[i].a, expected[i].b) != expected[i].allied) {
+			std::cerr << "sides " << expected[i].a << " and " << expected[i].b << " should "
+				<< (expected[i].allied ? "" : "not ") << "be allied\n";
+			++failures;
+		}
+	}
+
+	wesnoth::kernel::event_result result = k.execute("assert(bad_side, 'a string side was accepted') assert(bad_teams, 'a table of teams was accepted')");
+	if (result.error) {
+		std::cerr << *result.error << "\n";
+		++failures;
+	}
+	return failures == 0;
+}
+
+static wesnoth::map_location loc(int x, int y) {
+	wesnoth::map_location l;
+	l.x = x;
+	l.y = y;
+	return l;
+}
+
+// The map_data given to the engine is the map, and hexes can then be changed one by one. A reset
+// runs the init script again on a cleared map.
+static bool check_map() {
+	std::string script =
+		"engine.update_terrain('Xu, Xu, Xu, Xu\\nXu, 1 Kh, Gg, Xu\\nXu, Gg, Gg, Xu\\n')\n"
+		"engine.update_terrain({ x = 2, y = 2 }, nil)\n"
+		"engine.update_terrain({ x = 5, y = 1 }, 'Wwf')\n"
+		"bad_location = not pcall(engine.update_terrain, { x = 1 }, 'Gg')\n"
+		"bad_terrain = not pcall(engine.update_terrain, { x = 1, y = 1 }, {})\n"
+		"far = not pcall(engine.update_terrain, { x = 1e9, y = 1e9 }, 'Gg')\n"
+		"wrapped = not pcall(engine.update_terrain, { x = 2^32 + 1, y = 1 }, 'Gg')\n"
+		"huge = not pcall(engine.update_terrain, { x = 30000, y = 30000 }, 'Gg')\n";
+
+	wesnoth::kernel k(script.begin(), script.end());
+
+	int failures = 0;
+	const struct { int x, y; bool on_map; } expected[] = {
+		{ 0, 0, true }, { 1, 1, true }, { 2, 1, true }, { 3, 2, true }, { 2, 2, false },
+		{ 5, 1, true }, { 4, 1, false }, { 0, 3, false }, { -1, 0, false },
+	};
+	for (int round = 0; round < 2; ++round) {
+		for (size_t i = 0; i < sizeof(expected) / sizeof(expected[0]); ++i) {
+			if (k.is_on_map(loc(expected[i].x, expected[i].y)) != expected[i].on_map) {
+				std::cerr << "hex " << expected[i].x << "," << expected[i].y << " should "
+					<< (expected[i].on_map ? "" : "not ") << "be on the map\n";
+				++failures;
+			}
+		}
+		k.reset();
+	}
+
+	wesnoth::kernel::event_result result = k.execute("assert(bad_location, 'a location without y was accepted') assert(bad_terrain, 'a table terrain was accepted') "
+		"assert(far and wrapped, 'a hex out of range was accepted') assert(huge, 'a hex far from the map was accepted')");
+	if (result.error) {
+		std::cerr << *result.error << "\n";
+		++failures;
+	}
+	return failures == 0;
+}
+
+// A batch of chunks reports the same errors as the chunks executed one by one.
+static bool check_batch() {
+	std::string empty;
+	wesnoth::kernel k(empty.begin(), empty.end());
+
+	std::vector<std::string> chunks;
+	chunks.push_back("x = 1");
+	chunks.push_back("error()");
+	chunks.push_back("error(nil)");
+	chunks.push_back("error('boom')");
+	chunks.push_back("this is not lua");
+	chunks.push_back("x = x + 1");
+
+	std::vector<wesnoth::kernel::event_result> batched = k.execute_batch(chunks);
+	int failures = batched.size() != chunks.size();
+	for (size_t i = 0; i < chunks.size() && !failures; ++i) {
+		wesnoth::kernel::event_result single = k.execute(chunks[i]);
+		if (batched[i].error != single.error) {
+			std::cerr << "'" << chunks[i] << "': batched " << (batched[i].error ? *batched[i].error : "no error") << ", alone "
+				<< (single.error ? *single.error : "no error") << "\n";
+			++failures;
+		}
+	}
+	return failures == 0;
+}
+
+// Adjacency follows the hexes: odd columns are half a hex lower than even ones.
+static bool check_adjacency() {
+	std::string empty;
+	wesnoth::kernel k(empty.begin(), empty.end());
+
+	int failures = 0;
+	const struct { int x1, y1, x2, y2; bool adjacent; } expected[] = {
+		{ 1, 1, 1, 2, true }, { 1, 1, 1, 0, true }, { 1, 1, 2, 1, true }, { 1, 1, 2, 2, true }, { 1, 1, 0, 2, true },
+		{ 2, 2, 1, 1, true }, { 2, 2, 3, 1, true }, { 2, 2, 3, 3, false }, { 1, 1, 2, 0, false }, { 1, 1, 3, 1, false },
+		{ 1, 1, 1, 3, false },
+	};
+	for (size_t i = 0; i < sizeof(expected) / sizeof(expected[0]); ++i) {
+		if (k.is_adjacent(loc(expected[i].x1, expected[i].y1), loc(expected[i].x2, expected[i].y2)) != expected[i].adjacent) {
+			std::cerr << "hexes " << expected[i].x1 << "," << expected[i].y1 << " and " << expected[i].x2 << "," << expected[i].y2 << " should "
+				<< (expected[i].adjacent ? "" : "not ") << "be adjacent\n";
+			++failures;
+		}
+	}
+	return failures == 0;
+}
+
+// Units given to the engine clear the fog of their side around them, and it comes back where they leave.
+static bool check_vision() {
+	std::string script =
+		"engine.update_terrain(string.rep(string.rep('Gg, ', 19) .. 'Gg\\n', 3))\n"
+		"engine.construct_side(1, { fog = true })\n"
+		"engine.construct_side(2, { fog = true })\n"
+		"engine.construct_side(3, {})\n"
+		"engine.update_unit({ id = 1, side = 1, location = { x = 1, y = 1 }, vision = 2 })\n"
+		"engine.update_unit({ id = 2, side = 1, location = { x = 10, y = 1 }, vision = 1 })\n"
+		"engine.update_unit({ id = 2, location = false })\n"
+		"engine.update_unit({ id = 3, side = 1, location = { x = 13, y = 1 }, vision = 1 })\n"
+		"engine.update_unit({ id = 3, location = { x = 17, y = 1 } })\n"
+		"bad_side = not pcall(engine.update_unit, { id = 4, side = -1, location = { x = 5, y = 2 } })\n";
+
+	wesnoth::kernel k(script.begin(), script.end());
+
+	int failures = 0;
+	const struct { int x, y, side; bool fogged; } expected[] = {
+		{ 1, 1, 1, false }, { 2, 2, 1, false }, { 8, 1, 1, true }, { 10, 1, 1, true },
+		{ 13, 1, 1, true }, { 17, 1, 1, false }, { 18, 1, 1, false }, { 1, 1, 2, true }, { 1, 1, 3, false },
+	};
+	for (size_t i = 0; i < sizeof(expected) / sizeof(expected[0]); ++i) {
+		if (k.is_fogged(loc(expected[i].x, expected[i].y), expected[i].side) != expected[i].fogged) {
+			std::cerr << "hex " << expected[i].x << "," << expected[i].y << " should " << (expected[i].fogged ? "" : "not ")
+				<< "be fogged for side " << expected[i].side << "\n";
+			++failures;
+		}
+	}
+
+	wesnoth::kernel::event_result result = k.execute("assert(bad_side, 'a unit on side -1 was accepted')");
+	if (result.error) {
+		std::cerr << *result.error << "\n";
+		++failures;
+	}
+	return failures == 0;
+}
+
 int main() {
+	if (!check_batch()) {
+		std::cerr << "Batch check FAILED\n";
+		return 1;
+	}
+	if (!check_alliances()) {
+		std::cerr << "Alliance check FAILED\n";
+		return 1;
+	}
+	if (!check_map()) {
+		std::cerr << "Map check FAILED\n";
+		return 1;
+	}
+	if (!check_vision()) {
+		std::cerr << "Vision check FAILED\n";
+		return 1;
+	}
+	if (!check_adjacency()) {
+		std::cerr << "Adjacency check FAILED\n";
+		return 1;
+	}
+
 	const std::string path = "data/kernel/init.lua";
 	ifstream reader;
 	reader.open(path);
@@ -46,6 +235,7 @@ int main() {
 		std::cout << str << std::endl;
 
 		wesnoth::kernel::event_result result = k.execute(str);
+		k.flush_log();
 
 		if (result.error) {
 			std::cout << "-------------------------\n";
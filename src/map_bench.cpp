@@ -0,0 +1,2622 @@
+#include "kernel/game_data.hpp"
+#include "kernel/kernel_types.hpp"
+#include "kernel/thread_pool.hpp"
+#include "kernel/vision.hpp"
+#include "string_utils.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <deque>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <dirent.h>
+
+#include <boost/bind.hpp>
+#include <boost/foreach.hpp>
+#include <boost/random/mersenne_twister.hpp>
+#include <boost/random/uniform_int_distribution.hpp>
+#include <boost/range/adaptor/map.hpp>
+
+using namespace wesnoth;
+
+typedef std::chrono::steady_clock bench_clock;
+
+static double elapsed_ms(bench_clock::time_point start) {
+	return std::chrono::duration<double, std::milli>(bench_clock::now() - start).count();
+}
+
+static int arg_or(int argc, char** argv, int index, int def) {
+	return index < argc ? std::atoi(argv[index]) : def;
+}
+
+static map_location make_loc(int x, int y) {
+	map_location loc;
+	loc.x = x;
+	loc.y = y;
+	return loc;
+}
+
+////
+// Maps
+////
+
+static std::string trim(const std::string & s) {
+	size_t b = s.find_first_not_of(" \t\r");
+	size_t e = s.find_last_not_of(" \t\r");
+	return b == std::string::npos ? std::string() : s.substr(b, e - b + 1);
+}
+
+// The inline map_data of a scenario. Most of the multiplayer scenarios include their map from
+// a file which isn't part of this tree, then this is empty.
+static std::string load_map_data(const std::string & filename) {
+	std::ifstream file(filename.c_str());
+	std::stringstream ss;
+	ss << file.rdbuf();
+	std::string text = ss.str();
+
+	size_t begin = text.find("map_data=\"");
+	if (begin == std::string::npos) {
+		return std::string();
+	}
+	begin += 10;
+	size_t end = text.find('"', begin);
+	if (end == std::string::npos || text[begin] == '{') {
+		return std::string();
+	}
+	return text.substr(begin, end - begin);
+}
+
+// Reads map_data into a map, a string per hex
+static terrain_map parse_map_data(const std::string & map_data) {
+	terrain_map result;
+	std::istringstream data(map_data);
+	std::string line;
+	int y = 0;
+	while (std::getline(data, line)) {
+		if (trim(line).empty() || line.find('=') != std::string::npos) {
+			continue; // header
+		}
+		std::istringstream row(line);
+		std::string code;
+		int x = 0;
+		while (std::getline(row, code, ',')) {
+			code = trim(code);
+			size_t space = code.find(' ');
+			if (space != std::string::npos) {
+				code = code.substr(space + 1); // starting position
+			}
+			result[make_loc(x, y)] = code;
+			++x;
+		}
+		++y;
+	}
+	return result;
+}
+
+static terrain_map load_scenario_map(const std::string & filename) {
+	return parse_map_data(load_map_data(filename));
+}
+
+static terrain_map random_map(int w, int h, unsigned seed) {
+	static const char * const codes[] = { "Gg", "Gg", "Gg", "Gs^Fp", "Hh", "Mm", "Ww", "Re", "Ss", "Xu" };
+	boost::random::mt19937 gen(seed);
+	boost::random::uniform_int_distribution<> pick(0, sizeof(codes) / sizeof(codes[0]) - 1);
+
+	terrain_map result;
+	for (int y = 0; y < h; ++y) {
+		for (int x = 0; x < w; ++x) {
+			result[make_loc(x, y)] = codes[pick(gen)];
+		}
+	}
+	return result;
+}
+
+// Rough default movetype
+static size_t terrain_cost(const terrain_id & t) {
+	size_t cost;
+	switch (t.empty() ? 'G' : t[0]) {
+		case 'H': case 'D': case 'U': cost = 2; break;
+		case 'M': case 'W': case 'S': case 'A': cost = 3; break;
+		case 'X': case 'Q': return 99;
+		default: cost = 1;
+	}
+	if (t.find("^F") != std::string::npos) {
+		cost += 1;
+	}
+	return cost;
+}
+
+static size_t map_cost(const terrain_map * m, map_location loc) {
+	terrain_map::const_iterator it = m->find(loc);
+	return it == m->end() ? 99 : terrain_cost(it->second);
+}
+
+struct bench_map {
+	std::string name;
+	terrain_map terrain;
+};
+
+static std::vector<bench_map> bench_maps(int random_size) {
+	std::vector<bench_map> result;
+
+	static const char * const scenarios[] = { "Wesbench_AI", "Wesbench_Scroll", "8p_Mokena_Prairie", "8p_Morituri", "9p_Merkwuerdigliebe" };
+	BOOST_FOREACH(const char * name, scenarios) {
+		bench_map m;
+		m.name = name;
+		m.terrain = load_scenario_map(std::string("data/") + name + ".cfg");
+		if (m.terrain.empty()) {
+			// The map file is not in the tree, use a random map of comparable size
+			m.terrain = random_map(random_size, random_size, result.size());
+			std::ostringstream ss;
+			ss << name << " (random " << random_size << "x" << random_size << ")";
+			m.name = ss.str();
+		}
+		result.push_back(m);
+	}
+	return result;
+}
+
+// Scatter some units of two sides over the map, avoiding impassable hexes.
+static void place_units(unit_map & units, const terrain_map & terrain, int count, unsigned seed) {
+	std::vector<map_location> hexes;
+	BOOST_FOREACH(const terrain_map::value_type & v, terrain) {
+		if (terrain_cost(v.second) < 99) {
+			hexes.push_back(v.first);
+		}
+	}
+	boost::random::mt19937 gen(seed);
+	boost::random::uniform_int_distribution<> pick(0, hexes.size() - 1);
+
+	for (int i = 0; i < count; ++i) {
+		unit_state state;
+		state.side = 1 + i % 2;
+		units.insert(unit_rec(i + 1, hexes[pick(gen)], unit()), state);
+	}
+}
+
+////
+// pathfind: Compare the dense pathfinder with the previous std::map based implementation.
+////
+
+namespace reference {
+
+// The map based dijkstra which pathfind_context::compute_tree used before, with its heap order
+// corrected so that it settles the best node first.
+
+typedef std::pair<map_location, pathing_node> heap_entry;
+
+struct comp {
+	bool operator()(const heap_entry & a, const heap_entry & b) {
+		return a.second.turns_left < b.second.turns_left ||
+			(a.second.turns_left == b.second.turns_left && a.second.moves_left < b.second.moves_left);
+	}
+};
+
+static const unit_rec * get_visible_enemy(map_location neighbor, const pathfind_context::pathing_query & query, bool must_exert_zoc) {
+	const unit_map::index<by_loc>::type & u_map = query.units->get<by_loc>();
+	auto u_it = u_map.find(neighbor);
+	if (u_it == u_map.end()) {
+		return NULL;
+	}
+	const unit_rec & u = *u_it;
+	unit_state state = query.units->state(u);
+	if ((!must_exert_zoc || state.emits_zoc) && !query.sides_->are_allied(state.side, *query.moving_side)) {
+		return &u;
+	}
+	return NULL;
+}
+
+static shortest_path_tree compute_tree(geometry & geom, const pathfind_context::pathing_query & query) {
+	shortest_path_tree result;
+	std::deque<heap_entry> priority_queue(1, heap_entry(query.start, pathing_node(query.moves, query.turns, query.start)));
+	comp heap_comparator;
+
+	while (!priority_queue.empty()) {
+		heap_entry he = priority_queue.front();
+		std::pop_heap(priority_queue.begin(), priority_queue.end(), heap_comparator); priority_queue.pop_back();
+		const map_location & loc = he.first;
+
+		if (!result.insert(he).second) {
+			continue;
+		}
+
+		BOOST_FOREACH(map_location neighbor, geom.neighbors(loc)) {
+			if (result.find(neighbor) != result.end()) {
+				continue;
+			}
+			if (query.tmap_->find(neighbor) == query.tmap_->end()) {
+				continue;
+			}
+
+			size_t cost_of_move = (query.cost_map ? (*query.cost_map)(neighbor) : 1);
+			size_t turns_left = he.second.turns_left;
+			size_t moves_left = he.second.moves_left;
+
+			if (cost_of_move > moves_left && turns_left > 0) {
+				turns_left--;
+				moves_left = query.max_moves;
+			}
+			if (cost_of_move > moves_left) {
+				continue;
+			}
+			moves_left = moves_left - cost_of_move;
+
+			if (query.moving_side) {
+				if (get_visible_enemy(neighbor, query, false)) {
+					continue;
+				}
+				if (!query.ignore_zoc && moves_left > 0) {
+					BOOST_FOREACH(map_location neighbor2, geom.neighbors(neighbor)) {
+						if (get_visible_enemy(neighbor2, query, true)) {
+							moves_left = 0;
+							break;
+						}
+					}
+				}
+			}
+
+			priority_queue.push_back(std::make_pair(neighbor, pathing_node(moves_left, turns_left, loc)));
+			std::push_heap(priority_queue.begin(), priority_queue.end(), heap_comparator);
+		}
+	}
+	return result;
+}
+
+} // end namespace reference
+
+static bool same_costs(const shortest_path_tree & a, const shortest_path_tree & b) {
+	if (a.size() != b.size()) {
+		return false;
+	}
+	for (shortest_path_tree::const_iterator i = a.begin(), j = b.begin(); i != a.end(); ++i, ++j) {
+		if (!(i->first == j->first) || i->second.turns_left != j->second.turns_left || i->second.moves_left != j->second.moves_left) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static int bench_pathfind(int argc, char** argv) {
+	int queries = arg_or(argc, argv, 2, 200);
+	int random_size = arg_or(argc, argv, 3, 64);
+	int nunits = arg_or(argc, argv, 4, 40);
+
+	std::cout << "pathfind: " << queries << " trees per map, 5 moves, 3 turns, " << nunits << " units\n\n";
+	std::cout << std::left << std::setw(40) << "map" << std::right << std::setw(8) << "hexes" << std::setw(10) << "reached" << std::setw(14) << "map us/tree" << std::setw(14)
+		  << "dense us/tree" << std::setw(10) << "speedup" << std::setw(12) << "mismatches" << "\n";
+
+	int failures = 0;
+	BOOST_FOREACH(const bench_map & m, bench_maps(random_size)) {
+		hex geom;
+		unit_map units;
+		place_units(units, m.terrain, nunits, 17);
+		sides s;
+		pathfind_context context(geom);
+
+		std::vector<map_location> starts;
+		boost::random::mt19937 gen(42);
+		boost::random::uniform_int_distribution<> pick(0, m.terrain.size() - 1);
+		while (static_cast<int>(starts.size()) < queries) {
+			terrain_map::const_iterator it = m.terrain.begin();
+			std::advance(it, pick(gen));
+			if (terrain_cost(it->second) < 99 && units.get<by_loc>().find(it->first) == units.get<by_loc>().end()) {
+				starts.push_back(it->first);
+			}
+		}
+
+		pathfind_context::pathing_query q;
+		q.cost_map = move_cost_fcn(boost::bind(&map_cost, &m.terrain, _1));
+		q.moves = 5;
+		q.turns = 3;
+		q.max_moves = 5;
+		q.moving_side = 1;
+		q.ignore_zoc = false;
+		q.tmap_ = const_cast<terrain_map *>(&m.terrain);
+		q.units = &units;
+		q.sides_ = &s;
+
+		std::vector<shortest_path_tree> expected;
+		bench_clock::time_point start = bench_clock::now();
+		BOOST_FOREACH(map_location loc, starts) {
+			q.start = loc;
+			expected.push_back(reference::compute_tree(geom, q));
+		}
+		double map_ms = elapsed_ms(start);
+
+		int mismatches = 0;
+		size_t reached = 0;
+		start = bench_clock::now();
+		for (size_t i = 0; i < starts.size(); ++i) {
+			q.start = starts[i];
+			shortest_path_tree tree = context.compute_tree(q);
+			reached += tree.size();
+			if (!same_costs(tree, expected[i])) {
+				++mismatches;
+			}
+		}
+		double dense_ms = elapsed_ms(start);
+
+		std::cout << std::left << std::setw(40) << m.name << std::right << std::setw(8) << m.terrain.size() << std::setw(10) << reached / starts.size() << std::fixed
+			  << std::setprecision(1) << std::setw(14) << 1000 * map_ms / queries << std::setw(14) << 1000 * dense_ms / queries << std::setprecision(2) << std::setw(10)
+			  << map_ms / dense_ms << std::setw(12) << mismatches << "\n";
+		failures += mismatches;
+	}
+	return failures ? 1 : 0;
+}
+
+////
+// neighbors: Set based neighbor queries against the fixed size buffer, and the closed form adjacency test.
+////
+
+// Uses the generic, set based adjacency test of the base class
+class slow_hex : public hex {
+public:
+	geometry* clone() const { return new slow_hex(*this); }
+	bool adjacent(map_location a, map_location b) { return geometry::adjacent(a, b); }
+};
+
+static int bench_neighbors(int argc, char** argv) {
+	int size = arg_or(argc, argv, 2, 64);
+	int rounds = arg_or(argc, argv, 3, 50);
+
+	hex geom;
+	slow_hex slow;
+	pathfind_context context(geom);
+
+	long checksum_set = 0, checksum_array = 0, checksum_range = 0;
+	bench_clock::time_point start = bench_clock::now();
+	for (int r = 0; r < rounds; ++r) {
+		for (int y = 0; y < size; ++y) {
+			for (int x = 0; x < size; ++x) {
+				BOOST_FOREACH(map_location n, context.neighbors(make_loc(x, y))) {
+					checksum_set += n.x * 7 + n.y;
+				}
+			}
+		}
+	}
+	double set_ms = elapsed_ms(start);
+
+	adjacent_hexes adj;
+	start = bench_clock::now();
+	for (int r = 0; r < rounds; ++r) {
+		for (int y = 0; y < size; ++y) {
+			for (int x = 0; x < size; ++x) {
+				geom.get_adjacent(make_loc(x, y), adj);
+				BOOST_FOREACH(map_location n, adj) {
+					checksum_array += n.x * 7 + n.y;
+				}
+			}
+		}
+	}
+	double array_ms = elapsed_ms(start);
+
+	pathfind_context::neighbor_range range;
+	start = bench_clock::now();
+	for (int r = 0; r < rounds; ++r) {
+		for (int y = 0; y < size; ++y) {
+			for (int x = 0; x < size; ++x) {
+				context.neighbors(make_loc(x, y), range);
+				range.for_each([&](map_location n) { checksum_range += n.x * 7 + n.y; });
+			}
+		}
+	}
+	double range_ms = elapsed_ms(start);
+
+	// Every pair of hexes at most two columns and rows apart, both ways
+	int mismatches = 0;
+	long pairs = 0;
+	double slow_ms = 0, fast_ms = 0;
+	for (int y = 0; y < size; ++y) {
+		for (int x = 0; x < size; ++x) {
+			for (int dy = -2; dy <= 2; ++dy) {
+				for (int dx = -2; dx <= 2; ++dx) {
+					map_location a = make_loc(x, y), b = make_loc(x + dx, y + dy);
+					bench_clock::time_point t = bench_clock::now();
+					bool expected = slow.adjacent(a, b);
+					slow_ms += elapsed_ms(t);
+					t = bench_clock::now();
+					bool got = geom.adjacent(a, b);
+					fast_ms += elapsed_ms(t);
+					if (got != expected || geom.adjacent(b, a) != got) {
+						++mismatches;
+					}
+					++pairs;
+				}
+			}
+		}
+	}
+
+	std::cout << "neighbors of " << size << "x" << size << " hexes, " << rounds << " rounds\n";
+	std::cout << "  std::set:         " << set_ms << " ms\n";
+	std::cout << "  adjacent_hexes:   " << array_ms << " ms (" << set_ms / array_ms << "x)\n";
+	std::cout << "  neighbor_range:   " << range_ms << " ms (" << set_ms / range_ms << "x)\n";
+	std::cout << "adjacency of " << pairs << " pairs: set based " << slow_ms << " ms, closed form " << fast_ms << " ms (timer overhead included)\n";
+
+	bool ok = mismatches == 0 && checksum_set == checksum_array && checksum_range == checksum_array;
+	std::cout << (ok ? "OK" : "FAILED") << " (" << mismatches << " adjacency mismatches)\n";
+	return ok ? 0 : 1;
+}
+
+////
+// astar: Check that A* finds paths as good as dijkstra's, and time both on long paths.
+////
+
+static size_t costly_terrain_cost(const terrain_map * m, map_location loc) {
+	return map_cost(m, loc) + 1; // a movetype with no terrain cheaper than 2
+}
+
+static int bench_astar(int argc, char** argv) {
+	int trials = arg_or(argc, argv, 2, 300);
+	int size = arg_or(argc, argv, 3, 64);
+
+	int failures = 0;
+	boost::random::mt19937 gen(2015);
+
+	// hex::distance against breadth first search
+	{
+		hex geom;
+		map_location origin = make_loc(7, 8);
+		std::map<map_location, size_t> dist;
+		std::deque<map_location> frontier(1, origin);
+		dist[origin] = 0;
+		while (!frontier.empty()) {
+			map_location loc = frontier.front();
+			frontier.pop_front();
+			adjacent_hexes adj;
+			geom.get_adjacent(loc, adj);
+			BOOST_FOREACH(map_location n, adj) {
+				if (n.x >= -10 && n.y >= -10 && n.x < 30 && n.y < 30 && dist.insert(std::make_pair(n, dist[loc] + 1)).second) {
+					frontier.push_back(n);
+				}
+			}
+		}
+		int wrong = 0;
+		typedef std::pair<const map_location, size_t> dist_entry;
+		BOOST_FOREACH(const dist_entry & d, dist) {
+			if (geom.distance(origin, d.first) != d.second || geom.distance(d.first, origin) != d.second) {
+				++wrong;
+			}
+		}
+		std::cout << "hex::distance: " << wrong << " of " << dist.size() << " hexes differ from breadth first search\n";
+		failures += wrong;
+	}
+
+	// Randomized equivalence: the destination must be reached with the same turns and moves left as by a full dijkstra
+	int compared = 0, mismatches = 0, bad_paths = 0;
+	for (int t = 0; t < trials; ++t) {
+		terrain_map terrain = random_map(12 + t % 20, 12 + (t * 7) % 20, t);
+		unit_map units;
+		place_units(units, terrain, t % 12, t);
+		sides s;
+		hex geom;
+		pathfind_context context(geom);
+
+		std::vector<map_location> hexes;
+		BOOST_FOREACH(const terrain_map::value_type & v, terrain) {
+			hexes.push_back(v.first);
+		}
+		boost::random::uniform_int_distribution<> pick(0, hexes.size() - 1);
+
+		pathfind_context::pathing_query q;
+		q.start = hexes[pick(gen)];
+		bool costly = t % 3 == 0;
+		q.cost_map = move_cost_fcn(boost::bind(costly ? &costly_terrain_cost : &map_cost, &terrain, _1));
+		if (costly) {
+			q.min_move_cost = 2;
+		}
+		q.moves = 1 + t % 7;
+		q.max_moves = 3 + t % 5;
+		q.turns = 2 + t % 9;
+		if (t % 4) {
+			q.moving_side = 1 + t % 2;
+		}
+		q.ignore_zoc = t % 5 == 0;
+		q.tmap_ = &terrain;
+		q.units = &units;
+		q.sides_ = &s;
+
+		shortest_path_tree full = context.compute_tree(q);
+		for (int k = 0; k < 10; ++k) {
+			map_location dest = hexes[pick(gen)];
+			shortest_path_tree::const_iterator expected = full.find(dest);
+			if (expected == full.end() || dest == q.start) {
+				continue;
+			}
+			++compared;
+
+			shortest_path_tree partial = context.compute_tree(q, dest);
+			shortest_path_tree::const_iterator got = partial.find(dest);
+			if (got == partial.end() || got->second.turns_left != expected->second.turns_left || got->second.moves_left != expected->second.moves_left
+					|| context.shortest_path_distance(dest, q) != q.turns - expected->second.turns_left + 1) {
+				++mismatches;
+				continue;
+			}
+
+			path p = context.shortest_path(dest, q);
+			bool ok = p.front() == dest && p.back() == q.start;
+			for (size_t i = 1; ok && i < p.size(); ++i) {
+				ok = geom.adjacent(p[i - 1], p[i]);
+			}
+			if (!ok) {
+				++bad_paths;
+			}
+		}
+	}
+	std::cout << "A* against dijkstra: " << compared << " destinations, " << mismatches << " mismatches, " << bad_paths << " broken paths\n\n";
+	failures += mismatches + bad_paths;
+
+	// Speed on long paths: dijkstra stopping at the destination (min_move_cost 0 turns the bound off) against A*
+	std::cout << std::left << std::setw(40) << "map" << std::right << std::setw(12) << "dijkstra us" << std::setw(10) << "A* us" << std::setw(10) << "speedup" << "\n";
+	BOOST_FOREACH(const bench_map & m, bench_maps(size)) {
+		hex geom;
+		unit_map units;
+		sides s;
+		pathfind_context context(geom);
+
+		std::vector<map_location> hexes;
+		BOOST_FOREACH(const terrain_map::value_type & v, m.terrain) {
+			if (terrain_cost(v.second) < 99) {
+				hexes.push_back(v.first);
+			}
+		}
+		boost::random::uniform_int_distribution<> pick(0, hexes.size() - 1);
+
+		pathfind_context::pathing_query q;
+		q.cost_map = move_cost_fcn(boost::bind(&map_cost, &m.terrain, _1));
+		q.moves = 5;
+		q.max_moves = 5;
+		q.turns = 1000;
+		q.ignore_zoc = true;
+		q.tmap_ = const_cast<terrain_map *>(&m.terrain);
+		q.units = &units;
+		q.sides_ = &s;
+
+		// Pairs far apart, which some path connects
+		std::vector<std::pair<map_location, map_location> > pairs;
+		size_t far = 0;
+		BOOST_FOREACH(map_location a, hexes) {
+			far = std::max(far, geom.distance(hexes.front(), a));
+		}
+		far = far * 2 / 3;
+		while (pairs.size() < 50) {
+			q.start = hexes[pick(gen)];
+			map_location b = hexes[pick(gen)];
+			if (geom.distance(q.start, b) >= far && context.compute_tree(q, b).count(b)) {
+				pairs.push_back(std::make_pair(q.start, b));
+			}
+		}
+
+		size_t checksum[2] = { 0, 0 };
+		double ms[2];
+		for (int astar = 0; astar < 2; ++astar) {
+			q.min_move_cost = astar ? 1 : 0;
+			bench_clock::time_point start = bench_clock::now();
+			for (int r = 0; r < 4; ++r) {
+				for (size_t i = 0; i < pairs.size(); ++i) {
+					q.start = pairs[i].first;
+					checksum[astar] += context.shortest_path_distance(pairs[i].second, q);
+				}
+			}
+			ms[astar] = elapsed_ms(start);
+		}
+		if (checksum[0] != checksum[1]) {
+			++failures;
+		}
+		std::cout << std::left << std::setw(40) << m.name << std::right << std::fixed << std::setprecision(1) << std::setw(12) << 1000 * ms[0] / (4 * pairs.size())
+			  << std::setw(10) << 1000 * ms[1] / (4 * pairs.size()) << std::setprecision(2) << std::setw(10) << ms[0] / ms[1] << (checksum[0] == checksum[1] ? "" : "  MISMATCH")
+			  << "\n";
+	}
+
+	std::cout << (failures ? "FAILED" : "OK") << "\n";
+	return failures ? 1 : 0;
+}
+
+////
+// oracle: Tunnel bookkeeping, and landmark bounds on maps with holes and tunnels.
+////
+
+// A random map with walls across it, each with a gap, so that the hex distance is a poor bound
+static int pick_coordinate(boost::random::mt19937 & gen, int n) {
+	return boost::random::uniform_int_distribution<>(0, n - 1)(gen);
+}
+
+static terrain_map walled_map(int w, int h, unsigned seed) {
+	terrain_map m = random_map(w, h, seed);
+	boost::random::mt19937 gen(seed);
+	for (int x = 4; x + 2 < w; x += 6) {
+		boost::random::uniform_int_distribution<> gap(0, h - 3);
+		int g = gap(gen);
+		for (int y = 0; y < h; ++y) {
+			if (y < g || y > g + 2) {
+				m.erase(make_loc(x, y));
+			}
+		}
+	}
+	return m;
+}
+
+static int bench_oracle(int argc, char** argv) {
+	int trials = arg_or(argc, argv, 2, 100);
+	int size = arg_or(argc, argv, 3, 64);
+
+	int failures = 0;
+	boost::random::mt19937 gen(37);
+
+	// Tunnels: adding twice, removing what isn't there
+	{
+		hex geom;
+		pathfind_context context(geom);
+		map_location a = make_loc(1, 1), b = make_loc(9, 9), c = make_loc(5, 5);
+		bool ok = context.add_tunnel(a, b) && !context.add_tunnel(a, b) && context.neighbors(a).count(b)
+			&& !context.remove_tunnel(a, c) && !context.remove_tunnel(c, a)
+			&& context.remove_tunnel(a, b) && !context.remove_tunnel(a, b) && !context.neighbors(a).count(b)
+			&& !context.adjacent(b, a);
+		std::cout << "tunnels: " << (ok ? "ok" : "WRONG") << "\n";
+		failures += ok ? 0 : 1;
+	}
+
+	// Bounds must never exceed the true number of steps, and A* must agree with dijkstra
+	int pairs = 0, overestimates = 0, compared = 0, mismatches = 0;
+	double hex_ratio = 0, oracle_ratio = 0;
+	for (int t = 0; t < trials; ++t) {
+		terrain_map terrain = walled_map(16 + t % 20, 12 + (t * 7) % 20, t);
+		unit_map units;
+		sides s;
+		hex geom;
+		pathfind_context context(geom);
+
+		std::vector<map_location> hexes;
+		BOOST_FOREACH(const terrain_map::value_type & v, terrain) {
+			hexes.push_back(v.first);
+		}
+		boost::random::uniform_int_distribution<> pick(0, hexes.size() - 1);
+		for (int k = 0; k < t % 4; ++k) {
+			context.add_tunnel(hexes[pick(gen)], hexes[pick(gen)]);
+		}
+		if (t % 2) {
+			context.add_tunnel(hexes[pick(gen)], hexes[pick(gen)]);
+			context.remove_tunnel(hexes[pick(gen)], hexes[pick(gen)]);
+		}
+
+		pathfind_context::pathing_query q;
+		q.cost_map = move_cost_fcn(boost::bind(&map_cost, &terrain, _1));
+		q.moves = 1 + t % 7;
+		q.max_moves = 3 + t % 5;
+		q.turns = 40;
+		q.ignore_zoc = true;
+		q.tmap_ = &terrain;
+		q.units = &units;
+		q.sides_ = &s;
+
+		// Exact steps from the start, with every move costing 1 and enough moves for anything
+		q.start = hexes[pick(gen)];
+		pathfind_context::pathing_query steps = q;
+		steps.cost_map = boost::none;
+		steps.moves = 0;
+		steps.max_moves = 1;
+		steps.turns = 100000;
+		shortest_path_tree exact = context.compute_tree(steps);
+		shortest_path_tree full = context.compute_tree(q);
+
+		for (int k = 0; k < 10; ++k) {
+			map_location dest = hexes[pick(gen)];
+			if (dest == q.start) {
+				continue;
+			}
+			context.shortest_path_distance(q.start, steps); // builds the landmarks
+			shortest_path_tree::const_iterator e = exact.find(dest);
+			if (e != exact.end()) {
+				size_t d = steps.turns - e->second.turns_left;
+				size_t h = context.heuristic_distance(q.start, dest);
+				++pairs;
+				overestimates += h > d ? 1 : 0;
+				hex_ratio += static_cast<double>(geom.distance(q.start, dest)) / d;
+				oracle_ratio += static_cast<double>(h) / d;
+			}
+
+			shortest_path_tree::const_iterator expected = full.find(dest);
+			if (expected == full.end()) {
+				continue;
+			}
+			++compared;
+			shortest_path_tree partial = context.compute_tree(q, dest);
+			shortest_path_tree::const_iterator got = partial.find(dest);
+			if (got == partial.end() || got->second.turns_left != expected->second.turns_left || got->second.moves_left != expected->second.moves_left) {
+				++mismatches;
+			}
+		}
+	}
+	std::cout << "bounds: " << pairs << " pairs, " << overestimates << " overestimates, hex distance " << std::fixed << std::setprecision(2)
+		  << (pairs ? hex_ratio / pairs : 0) << " of the steps on average, with landmarks " << (pairs ? oracle_ratio / pairs : 0) << "\n";
+	std::cout << "A* against dijkstra: " << compared << " destinations, " << mismatches << " mismatches\n\n";
+	failures += overestimates + mismatches;
+
+	// Speed on a walled map, across the walls, with every move costing 1 and with the terrain costs
+	for (int uniform = 1; uniform >= 0; --uniform) {
+		terrain_map terrain = walled_map(size, size, 5);
+		unit_map units;
+		sides s;
+		hex geom;
+		pathfind_context context(geom);
+
+		pathfind_context::pathing_query q;
+		if (!uniform) {
+			q.cost_map = move_cost_fcn(boost::bind(&map_cost, &terrain, _1));
+		}
+		q.moves = 5;
+		q.max_moves = 5;
+		q.turns = 1000;
+		q.ignore_zoc = true;
+		q.tmap_ = &terrain;
+		q.units = &units;
+		q.sides_ = &s;
+
+		std::vector<std::pair<map_location, map_location> > ends;
+		while (ends.size() < 50) {
+			map_location a = make_loc(pick_coordinate(gen, 3), pick_coordinate(gen, size));
+			map_location b = make_loc(size - 1 - pick_coordinate(gen, 3), pick_coordinate(gen, size));
+			if (terrain.count(a) && terrain.count(b) && terrain_cost(terrain[a]) < 99 && terrain_cost(terrain[b]) < 99) {
+				q.start = a;
+				if (context.compute_tree(q, b).count(b)) {
+					ends.push_back(std::make_pair(a, b));
+				}
+			}
+		}
+
+		size_t checksum[2] = { 0, 0 };
+		double ms[2];
+		for (int astar = 0; astar < 2; ++astar) {
+			q.min_move_cost = astar ? 1 : 0;
+			bench_clock::time_point start = bench_clock::now();
+			for (size_t i = 0; i < ends.size(); ++i) {
+				q.start = ends[i].first;
+				checksum[astar] += context.shortest_path_distance(ends[i].second, q);
+			}
+			ms[astar] = elapsed_ms(start);
+		}
+		std::cout << "walled " << size << "x" << size << (uniform ? ", uniform costs: " : ", terrain costs: ") << "dijkstra " << std::setprecision(1)
+			  << 1000 * ms[0] / ends.size() << " us, A* " << 1000 * ms[1] / ends.size() << " us" << (checksum[0] == checksum[1] ? "" : "  MISMATCH") << "\n";
+		failures += checksum[0] == checksum[1] ? 0 : 1;
+	}
+
+	std::cout << (failures ? "FAILED" : "OK") << "\n";
+	return failures ? 1 : 0;
+}
+
+////
+// reach: Reachability for a whole side at once, against one reachable_hexes query per unit.
+////
+
+static bool bench_movement(const terrain_map * m, const unit_rec &, pathfind_context::pathing_query & q) {
+	q.cost_map = move_cost_fcn(boost::bind(&map_cost, m, _1));
+	q.moves = 5;
+	q.turns = 2;
+	q.max_moves = 5;
+	q.ignore_zoc = false;
+	return true;
+}
+
+static int bench_reach(int argc, char** argv) {
+	int nunits = arg_or(argc, argv, 2, 200);
+	int random_size = arg_or(argc, argv, 3, 64);
+	int nthreads = arg_or(argc, argv, 4, std::max(1u, std::thread::hardware_concurrency()));
+	int rounds = 5;
+
+	thread_pool pool(nthreads);
+
+	std::cout << "reach: side 1 of " << nunits << " units, 5 moves, 2 turns, " << nthreads << " threads, best of " << rounds << "\n\n";
+	std::cout << std::left << std::setw(40) << "map" << std::right << std::setw(8) << "units" << std::setw(14) << "per unit ms" << std::setw(12) << "batch ms"
+		  << std::setw(12) << "pooled ms" << std::setw(10) << "speedup" << std::setw(12) << "mismatches" << "\n";
+
+	int failures = 0;
+	BOOST_FOREACH(const bench_map & m, bench_maps(random_size)) {
+		hex geom;
+		unit_map units;
+		place_units(units, m.terrain, nunits, 23);
+		sides s;
+		pathfind_context context(geom);
+
+		pathfind_context::pathing_query q;
+		q.tmap_ = const_cast<terrain_map *>(&m.terrain);
+		q.units = &units;
+		q.sides_ = &s;
+		pathfind_context::movement_fcn describe = boost::bind(&bench_movement, &m.terrain, _1, _2);
+
+		std::map<int, loc_set> expected; // by unit id, since the batches come back in table order
+		double single_ms = 1e9;
+		for (int r = 0; r < rounds; ++r) {
+			expected.clear();
+			bench_clock::time_point start = bench_clock::now();
+			BOOST_FOREACH(const unit_rec & u, units) {
+				if (units.side(u) != 1) {
+					continue;
+				}
+				pathfind_context::pathing_query uq = q;
+				uq.start = u.loc_;
+				uq.moving_side = 1;
+				bench_movement(&m.terrain, u, uq);
+				expected[u.id_] = context.reachable_hexes(uq);
+			}
+			single_ms = std::min(single_ms, elapsed_ms(start));
+		}
+
+		std::vector<pathfind_context::unit_reach> batch, pooled;
+		double batch_ms = 1e9, pooled_ms = 1e9;
+		for (int r = 0; r < rounds; ++r) {
+			bench_clock::time_point start = bench_clock::now();
+			batch = context.reachable_hexes_for_side(1, boost::none, q, describe);
+			batch_ms = std::min(batch_ms, elapsed_ms(start));
+
+			start = bench_clock::now();
+			pooled = context.reachable_hexes_for_side(1, boost::none, q, describe, &pool);
+			pooled_ms = std::min(pooled_ms, elapsed_ms(start));
+		}
+
+		int mismatches = 0;
+		if (batch.size() != expected.size() || pooled.size() != expected.size()) {
+			mismatches = expected.size();
+		} else {
+			for (size_t i = 0; i < expected.size(); ++i) {
+				loc_set a, b;
+				batch[i].reachable.for_each([&](map_location loc) { a.insert(loc); });
+				pooled[i].reachable.for_each([&](map_location loc) { b.insert(loc); });
+				std::map<int, loc_set>::const_iterator e = expected.find(batch[i].id);
+				if (e == expected.end() || pooled[i].id != batch[i].id || a != e->second || b != e->second) {
+					++mismatches;
+				}
+			}
+		}
+
+		std::cout << std::left << std::setw(40) << m.name << std::right << std::setw(8) << expected.size() << std::fixed << std::setprecision(2)
+			  << std::setw(14) << single_ms << std::setw(12) << batch_ms << std::setw(12) << pooled_ms << std::setw(10) << single_ms / pooled_ms
+			  << std::setw(12) << mismatches << "\n";
+		failures += mismatches;
+	}
+	return failures ? 1 : 0;
+}
+
+////
+// costs: Cost grids against cost maps, with terrain changes in between.
+////
+
+static int bench_costs(int argc, char** argv) {
+	int queries = arg_or(argc, argv, 2, 200);
+	int random_size = arg_or(argc, argv, 3, 64);
+
+	std::cout << "costs: " << queries << " trees per map, 5 moves, 3 turns, 40 units, terrain changed every 10 trees\n\n";
+	std::cout << std::left << std::setw(40) << "map" << std::right << std::setw(8) << "hexes" << std::setw(14) << "fcn us/tree" << std::setw(14)
+		  << "grid us/tree" << std::setw(10) << "speedup" << std::setw(12) << "mismatches" << "\n";
+
+	static const char * const terrains[] = { "Gg", "Hh", "Mm", "Wwf", "Gg^Fds", "Xu" };
+
+	int failures = 0;
+	BOOST_FOREACH(const bench_map & m, bench_maps(random_size)) {
+		hex geom;
+		unit_map units;
+		place_units(units, m.terrain, 40, 17);
+		sides s;
+		pathfind_context context(geom);
+		terrain_map terrain = m.terrain;
+
+		pathfind_context::pathing_query q;
+		q.moves = 5;
+		q.turns = 3;
+		q.max_moves = 5;
+		q.moving_side = 1;
+		q.ignore_zoc = false;
+		q.tmap_ = &terrain;
+		q.units = &units;
+		q.sides_ = &s;
+
+		pathfind_context::pathing_query fq = q;
+		fq.cost_map = move_cost_fcn(boost::bind(&map_cost, &terrain, _1));
+		pathfind_context::pathing_query gq = q;
+		gq.costs = context.add_movetype(terrain_cost_fcn(&terrain_cost));
+
+		std::vector<map_location> hexes;
+		BOOST_FOREACH(const terrain_map::value_type & v, terrain) {
+			hexes.push_back(v.first);
+		}
+		boost::random::mt19937 gen(42);
+		boost::random::uniform_int_distribution<> pick(0, hexes.size() - 1);
+		boost::random::uniform_int_distribution<> pick_terrain(0, 5);
+
+		double fcn_ms = 0, grid_ms = 0;
+		int mismatches = 0;
+		for (int i = 0; i < queries; ++i) {
+			if (i % 10 == 0) {
+				for (int k = 0; k < 20; ++k) {
+					context.set_terrain(terrain, hexes[pick(gen)], terrains[pick_terrain(gen)]);
+				}
+			}
+			fq.start = gq.start = hexes[pick(gen)];
+
+			bench_clock::time_point start = bench_clock::now();
+			shortest_path_tree a = context.compute_tree(fq);
+			fcn_ms += elapsed_ms(start);
+
+			start = bench_clock::now();
+			shortest_path_tree b = context.compute_tree(gq);
+			grid_ms += elapsed_ms(start);
+
+			if (!same_costs(a, b)) {
+				++mismatches;
+			}
+		}
+
+		std::cout << std::left << std::setw(40) << m.name << std::right << std::setw(8) << terrain.size() << std::fixed << std::setprecision(1)
+			  << std::setw(14) << 1000 * fcn_ms / queries << std::setw(14) << 1000 * grid_ms / queries << std::setprecision(2) << std::setw(10)
+			  << fcn_ms / grid_ms << std::setw(12) << mismatches << "\n";
+		failures += mismatches;
+	}
+	return failures ? 1 : 0;
+}
+
+////
+// repair: Keeping the trees of a side up to date while the enemy moves, against searching again.
+////
+
+static int bench_repair(int argc, char** argv) {
+	int moves = arg_or(argc, argv, 2, 200);
+	int random_size = arg_or(argc, argv, 3, 42);
+	int nunits = arg_or(argc, argv, 4, 60);
+
+	std::cout << "repair: " << moves << " enemy moves of up to 3 hexes, one terrain change in 4, trees of every unit of side 1, "
+		  << nunits << " units, 5 moves, 2 turns\n\n";
+	std::cout << std::left << std::setw(40) << "map" << std::right << std::setw(8) << "trees" << std::setw(16) << "search us/tree"
+		  << std::setw(16) << "repair us/tree" << std::setw(10) << "speedup" << std::setw(12) << "mismatches" << "\n";
+
+	static const char * const terrains[] = { "Gg", "Hh", "Mm", "Wwf", "Gg^Fds", "Xu" };
+
+	int failures = 0;
+	boost::random::mt19937 gen(38);
+	BOOST_FOREACH(const bench_map & m, bench_maps(random_size)) {
+		hex geom;
+		unit_map units;
+		terrain_map terrain = m.terrain;
+		place_units(units, terrain, nunits, 29);
+		sides s;
+		pathfind_context context(geom);
+
+		pathfind_context::pathing_query q;
+		q.cost_map = move_cost_fcn(boost::bind(&map_cost, &terrain, _1));
+		q.moves = 5;
+		q.turns = 2;
+		q.max_moves = 5;
+		q.moving_side = 1;
+		q.ignore_zoc = false;
+		q.tmap_ = &terrain;
+		q.units = &units;
+		q.sides_ = &s;
+
+		std::vector<pathfind_context::dynamic_tree> trees;
+		std::vector<int> enemies;
+		BOOST_FOREACH(const unit_rec & u, units) {
+			if (units.side(u) == 1) {
+				trees.push_back(pathfind_context::dynamic_tree());
+				q.start = u.loc_;
+				context.build_tree(q, trees.back());
+			} else {
+				enemies.push_back(u.id_);
+			}
+		}
+
+		std::vector<map_location> hexes;
+		BOOST_FOREACH(const terrain_map::value_type & v, terrain) {
+			hexes.push_back(v.first);
+		}
+		boost::random::uniform_int_distribution<> pick_enemy(0, enemies.size() - 1);
+		boost::random::uniform_int_distribution<> pick_hex(0, hexes.size() - 1);
+		boost::random::uniform_int_distribution<> pick_offset(-3, 3);
+		boost::random::uniform_int_distribution<> pick_terrain(0, 5);
+
+		double search_ms = 0, repair_ms = 0;
+		int mismatches = 0, steps = 0;
+		for (int k = 0; k < moves; ++k) {
+			std::vector<map_location> changed;
+			if (k % 4 == 3) {
+				map_location loc = hexes[pick_hex(gen)];
+				context.set_terrain(terrain, loc, terrains[pick_terrain(gen)]);
+				changed.push_back(loc);
+			} else {
+				unit_map::iterator it = units.find(enemies[pick_enemy(gen)]);
+				map_location to = make_loc(it->loc_.x + pick_offset(gen), it->loc_.y + pick_offset(gen));
+				if (!terrain.count(to) || terrain_cost(terrain[to]) >= 99 || units.get<by_loc>().count(to)) {
+					continue;
+				}
+				changed.push_back(it->loc_);
+				changed.push_back(to);
+				units.modify(it, [&](unit_rec & u) { u.loc_ = to; });
+				context.units_changed(changed, q);
+			}
+
+			++steps;
+			bench_clock::time_point start = bench_clock::now();
+			BOOST_FOREACH(pathfind_context::dynamic_tree & t, trees) {
+				context.repair_tree(t, changed);
+			}
+			repair_ms += elapsed_ms(start);
+
+			start = bench_clock::now();
+			std::vector<shortest_path_tree> expected;
+			BOOST_FOREACH(const pathfind_context::dynamic_tree & t, trees) {
+				expected.push_back(context.compute_tree(t.query()));
+			}
+			search_ms += elapsed_ms(start);
+
+			for (size_t i = 0; i < trees.size(); ++i) {
+				if (!same_costs(context.get_tree(trees[i]), expected[i])) {
+					++mismatches;
+				}
+			}
+		}
+
+		double per_tree = static_cast<double>(steps) * trees.size() / 1000;
+		std::cout << std::left << std::setw(40) << m.name << std::right << std::setw(8) << trees.size() << std::fixed << std::setprecision(1)
+			  << std::setw(16) << search_ms / per_tree << std::setw(16) << repair_ms / per_tree << std::setprecision(2) << std::setw(10)
+			  << search_ms / repair_ms << std::setw(12) << mismatches << "\n";
+		failures += mismatches;
+	}
+	return failures ? 1 : 0;
+}
+
+////
+// field: Distance fields from many sources, against one tree per source merged in a std::map.
+////
+
+static void merge_tree(std::map<map_location, boost::uint32_t> & best, const shortest_path_tree & tree, size_t turns) {
+	BOOST_FOREACH(const shortest_path_tree::value_type & v, tree) {
+		boost::uint32_t e = distance_field::encode(turns - v.second.turns_left + 1, v.second.moves_left);
+		std::map<map_location, boost::uint32_t>::iterator it = best.find(v.first);
+		if (it == best.end()) {
+			best.insert(std::make_pair(v.first, e));
+		} else {
+			it->second = std::min(it->second, e);
+		}
+	}
+}
+
+static int field_mismatches(const distance_field & field, const std::map<map_location, boost::uint32_t> & best, const terrain_map & terrain) {
+	int wrong = 0;
+	BOOST_FOREACH(const terrain_map::value_type & v, terrain) {
+		std::map<map_location, boost::uint32_t>::const_iterator it = best.find(v.first);
+		int i = field.index(v.first);
+		boost::uint32_t got = i < 0 ? distance_field::UNREACHED : field[i];
+		if (got != (it == best.end() ? distance_field::UNREACHED : it->second)) {
+			++wrong;
+		}
+	}
+	return wrong;
+}
+
+static int bench_field(int argc, char** argv) {
+	int nsources = arg_or(argc, argv, 2, 30);
+	int random_size = arg_or(argc, argv, 3, 64);
+	int nthreads = arg_or(argc, argv, 4, std::max(1u, std::thread::hardware_concurrency()));
+
+	thread_pool pool(nthreads);
+	int failures = 0;
+
+	std::cout << "field: " << nsources << " villages with one movetype, then the units of side 2 with two movetypes, 5 moves, 6 turns, " << nthreads << " threads\n\n";
+	std::cout << std::left << std::setw(40) << "map" << std::right << std::setw(14) << "villages ms" << std::setw(10) << "field ms" << std::setw(12) << "units ms"
+		  << std::setw(10) << "field ms" << std::setw(10) << "pooled ms" << std::setw(12) << "mismatches" << "\n";
+
+	boost::random::mt19937 gen(39);
+	BOOST_FOREACH(const bench_map & m, bench_maps(random_size)) {
+		hex geom;
+		unit_map units;
+		place_units(units, m.terrain, 2 * nsources, 31);
+		sides s;
+		pathfind_context context(geom);
+
+		pathfind_context::pathing_query q;
+		q.cost_map = move_cost_fcn(boost::bind(&map_cost, &m.terrain, _1));
+		q.moves = 5;
+		q.turns = 6;
+		q.max_moves = 5;
+		q.ignore_zoc = false;
+		q.tmap_ = const_cast<terrain_map *>(&m.terrain);
+		q.units = &units;
+		q.sides_ = &s;
+
+		std::vector<map_location> villages;
+		boost::random::uniform_int_distribution<> pick(0, m.terrain.size() - 1);
+		while (static_cast<int>(villages.size()) < nsources) {
+			terrain_map::const_iterator it = m.terrain.begin();
+			std::advance(it, pick(gen));
+			villages.push_back(it->first);
+		}
+
+		bench_clock::time_point start = bench_clock::now();
+		std::map<map_location, boost::uint32_t> best;
+		BOOST_FOREACH(map_location v, villages) {
+			q.start = v;
+			merge_tree(best, context.compute_tree(q), q.turns);
+		}
+		double trees_ms = elapsed_ms(start);
+
+		start = bench_clock::now();
+		distance_field villages_field = context.distance_field_from(villages, q);
+		double field_ms = elapsed_ms(start);
+		int mismatches = field_mismatches(villages_field, best, m.terrain);
+
+		// The enemy units, every other one with a costlier movetype
+		std::vector<pathfind_context::pathing_query> queries;
+		BOOST_FOREACH(const unit_rec & u, units) {
+			if (units.side(u) == 2) {
+				pathfind_context::pathing_query uq = q;
+				uq.start = u.loc_;
+				uq.moving_side = 2;
+				if (queries.size() % 2) {
+					uq.cost_map = move_cost_fcn(boost::bind(&costly_terrain_cost, &m.terrain, _1));
+				}
+				queries.push_back(uq);
+			}
+		}
+
+		start = bench_clock::now();
+		best.clear();
+		BOOST_FOREACH(const pathfind_context::pathing_query & uq, queries) {
+			merge_tree(best, context.compute_tree(uq), uq.turns);
+		}
+		double unit_trees_ms = elapsed_ms(start);
+
+		start = bench_clock::now();
+		distance_field units_field = context.merged_distance_field(queries);
+		double units_field_ms = elapsed_ms(start);
+
+		start = bench_clock::now();
+		distance_field pooled_field = context.merged_distance_field(queries, &pool);
+		double pooled_ms = elapsed_ms(start);
+
+		mismatches += field_mismatches(units_field, best, m.terrain) + field_mismatches(pooled_field, best, m.terrain);
+
+		std::cout << std::left << std::setw(40) << m.name << std::right << std::fixed << std::setprecision(2) << std::setw(14) << trees_ms << std::setw(10) << field_ms
+			  << std::setw(12) << unit_trees_ms << std::setw(10) << units_field_ms << std::setw(10) << pooled_ms << std::setw(12) << mismatches << "\n";
+		failures += mismatches;
+	}
+
+	// The merge of whole fields against a plain loop
+	{
+		const int w = random_size, h = random_size, rounds = 2000;
+		distance_field a(0, 0, w, h), b(0, 0, w, h);
+		boost::random::uniform_int_distribution<boost::uint32_t> value(0, 0xFFFFFFFF);
+		for (size_t i = 0; i < a.size(); ++i) {
+			a[i] = value(gen);
+			b[i] = i % 7 ? value(gen) : distance_field::UNREACHED;
+		}
+		std::vector<boost::uint32_t> expected(a.size());
+		for (size_t i = 0; i < a.size(); ++i) {
+			expected[i] = std::min(a[i], b[i]);
+		}
+
+		distance_field c = a;
+		c.merge(b);
+		int wrong = c.values() == expected ? 0 : 1;
+
+		std::vector<boost::uint32_t> plain = a.values();
+		bench_clock::time_point start = bench_clock::now();
+		for (int r = 0; r < rounds; ++r) {
+			for (size_t i = 0; i < plain.size(); ++i) {
+				plain[i] = std::min(plain[i], b[i]);
+			}
+		}
+		double plain_ms = elapsed_ms(start);
+
+		start = bench_clock::now();
+		for (int r = 0; r < rounds; ++r) {
+			c.merge(b);
+		}
+		double merge_ms = elapsed_ms(start);
+
+		std::cout << "\nmerge of " << w << "x" << h << " fields: plain loop " << std::setprecision(2) << 1000 * plain_ms / rounds << " us, merge "
+			  << 1000 * merge_ms / rounds << " us" << (wrong ? ", WRONG" : "") << "\n";
+		failures += wrong;
+	}
+	return failures ? 1 : 0;
+}
+
+////
+// paths: The paths to every hex reached, from the predecessor array against walking the tree map once per hex.
+////
+
+static path map_walk_path(const shortest_path_tree & tree, map_location loc) {
+	shortest_path_tree::const_iterator it = tree.find(loc);
+	path ret(1, loc);
+	while (!(it->second.pred == it->first)) {
+		ret.push_back(it->second.pred);
+		it = tree.find(it->second.pred);
+	}
+	return ret;
+}
+
+static int bench_paths(int argc, char** argv) {
+	int trials = arg_or(argc, argv, 2, 20);
+	int random_size = arg_or(argc, argv, 3, 64);
+	int failures = 0;
+
+	std::cout << "paths: all the paths of " << trials << " queries per map, 5 moves, 6 turns\n\n";
+	std::cout << std::left << std::setw(40) << "map" << std::right << std::setw(10) << "paths" << std::setw(12) << "tree ms" << std::setw(12) << "flat ms"
+		  << std::setw(12) << "bulk ms" << std::setw(12) << "mismatches" << "\n";
+
+	BOOST_FOREACH(const bench_map & m, bench_maps(random_size)) {
+		hex geom;
+		unit_map units;
+		place_units(units, m.terrain, 40, 40);
+		sides s;
+		pathfind_context context(geom);
+
+		std::vector<map_location> hexes;
+		BOOST_FOREACH(const terrain_map::value_type & v, m.terrain) {
+			if (terrain_cost(v.second) < 99) {
+				hexes.push_back(v.first);
+			}
+		}
+		boost::random::mt19937 gen(40);
+		boost::random::uniform_int_distribution<> pick(0, hexes.size() - 1);
+
+		size_t total = 0;
+		int mismatches = 0;
+		double tree_ms = 0, flat_ms = 0, bulk_ms = 0;
+		std::vector<map_location> buffer;
+		std::vector<size_t> offsets;
+		for (int t = 0; t < trials; ++t) {
+			pathfind_context::pathing_query q;
+			q.start = hexes[pick(gen)];
+			q.cost_map = move_cost_fcn(boost::bind(&map_cost, &m.terrain, _1));
+			q.moves = 5;
+			q.turns = 6;
+			q.max_moves = 5;
+			q.moving_side = 1 + t % 2;
+			q.ignore_zoc = false;
+			q.tmap_ = const_cast<terrain_map *>(&m.terrain);
+			q.units = &units;
+			q.sides_ = &s;
+
+			bench_clock::time_point start = bench_clock::now();
+			shortest_path_tree tree = context.compute_tree(q);
+			std::vector<path> expected;
+			BOOST_FOREACH(const shortest_path_tree::value_type & v, tree) {
+				expected.push_back(map_walk_path(tree, v.first));
+			}
+			tree_ms += elapsed_ms(start);
+
+			start = bench_clock::now();
+			reachable_paths paths = context.reachable_hexes_with_paths(q);
+			flat_ms += elapsed_ms(start);
+
+			start = bench_clock::now();
+			paths.all_paths(buffer, offsets);
+			bulk_ms += elapsed_ms(start);
+
+			total += paths.size();
+			if (paths.size() != expected.size()) {
+				++mismatches;
+				continue;
+			}
+			for (size_t n = 0; n < paths.size(); ++n) {
+				const path & e = expected[n];
+				bool ok = paths.location(n) == e.front() && paths.find(e.front()) == static_cast<int>(n) && paths.length(n) == e.size()
+					&& offsets[n + 1] - offsets[n] == e.size() && std::equal(e.begin(), e.end(), buffer.begin() + offsets[n]);
+				if (ok && n % 17 == 0) {
+					ok = paths.get_path(n) == e;
+				}
+				if (!ok) {
+					++mismatches;
+				}
+			}
+		}
+
+		std::cout << std::left << std::setw(40) << m.name << std::right << std::fixed << std::setprecision(2) << std::setw(10) << total << std::setw(12) << tree_ms
+			  << std::setw(12) << flat_ms << std::setw(12) << bulk_ms << std::setw(12) << mismatches << "\n";
+		failures += mismatches;
+	}
+	return failures ? 1 : 0;
+}
+
+////
+// shroud: Units walking through shroud and fog, with the shroud and fog planes against the maps they replace.
+////
+
+// Sides 1 and 3 are the north team, as side 1 of the scenario and its ally
+static bool north_allied(int a, int b) {
+	return a == b || (a % 2 && b % 2);
+}
+
+// The shroud and fog tables as sides kept them before, one std::map per side
+struct map_vision {
+	std::map<int, loc_map<bool> > shroud_table_;
+	std::map<int, loc_map<bool> > fog_table_;
+	std::map<int, loc_map<bool> > fog_override_table_;
+	std::map<int, bool> share_maps_, share_vision_;
+
+	boost::optional<bool> get_fog_override(map_location l, int t) {
+		auto tab = fog_override_table_[t];
+		auto it = tab.find(l);
+		if (it == tab.end()) {
+			return boost::none;
+		}
+		return it->second;
+	}
+	bool override_adjusted_fog(map_location l, int s) {
+		if (auto b = get_fog_override(l, s)) {
+			return *b;
+		}
+		return fog_table_[s][l];
+	}
+	bool ally_adjusted_fog(map_location l, int s) {
+		if (!override_adjusted_fog(l, s)) return false;
+		BOOST_FOREACH(int t, share_vision_ | boost::adaptors::map_keys) {
+			if (north_allied(s, t) && share_vision_[t] && !override_adjusted_fog(l, t))
+				return false;
+		}
+		return true;
+	}
+	bool true_shroud(map_location l, int s) {
+		return shroud_table_[s][l];
+	}
+	bool ally_adjusted_shroud(map_location l, int s) {
+		if (!true_shroud(l, s)) return false;
+		BOOST_FOREACH(int t, share_maps_ | boost::adaptors::map_keys) {
+			if (north_allied(s, t) && share_maps_[t] && !true_shroud(l, t))
+				return false;
+		}
+		return true;
+	}
+};
+
+// The positions of the units placed by a macro of the scenario, as in {PLACE_UNIT 3,1}
+static std::vector<map_location> load_scenario_units(const std::string & filename, const std::string & macro) {
+	std::vector<map_location> result;
+	std::ifstream file(filename.c_str());
+	std::string line;
+	while (std::getline(file, line)) {
+		size_t at = line.find("{" + macro + " ");
+		int x, y;
+		char comma;
+		std::istringstream ss(at == std::string::npos ? std::string() : line.substr(at + macro.size() + 2));
+		if (ss >> x >> comma >> y) {
+			result.push_back(make_loc(x, y));
+		}
+	}
+	return result;
+}
+
+static int bench_shroud(int argc, char** argv) {
+	int rounds = arg_or(argc, argv, 2, 20);
+	int radius = arg_or(argc, argv, 3, 5);
+
+	const std::string filename = "data/Wesbench_Shroud_Walk.cfg";
+	terrain_map terrain = load_scenario_map(filename);
+	std::vector<map_location> walkers = load_scenario_units(filename, "PLACE_UNIT");
+	if (terrain.empty() || walkers.empty()) {
+		std::cerr << "Could not read the map and units of " << filename << "\n";
+		return 1;
+	}
+	int w = 0, h = 0;
+	BOOST_FOREACH(const terrain_map::value_type & v, terrain) {
+		w = std::max(w, v.first.x + 1);
+		h = std::max(h, v.first.y + 1);
+	}
+
+	std::cout << "shroud: " << walkers.size() << " units of side 1 walking through " << w << "x" << h << " hexes of shroud and fog for " << rounds
+		  << " rounds, vision " << radius << ", allied side 3 sharing maps and vision\n\n";
+
+	hex geom;
+	map_vision maps;
+	sides planes;
+	planes.set_bounds(0, 0, w, h);
+	planes.set_teams(1, "north");
+	planes.set_teams(2, "south");
+	planes.set_teams(3, "north");
+	for (int side = 1; side <= 3; ++side) {
+		maps.share_maps_[side] = maps.share_vision_[side] = true;
+		planes.set_share_maps(side, true);
+		planes.set_share_vision(side, true);
+	}
+
+	// All sides start under shroud, but for the west edge which side 3 has seen, and side 3 has
+	// its fog overridden off on one hex in 13
+	hex_bitset everything = planes.make_plane();
+	everything.fill();
+	bench_clock::time_point start = bench_clock::now();
+	BOOST_FOREACH(const terrain_map::value_type & v, terrain) {
+		for (int side = 1; side <= 3; ++side) {
+			maps.shroud_table_[side][v.first] = side != 3 || v.first.x > 4;
+		}
+		maps.fog_table_[3][v.first] = true;
+		if ((v.first.x * 7 + v.first.y) % 13 == 0) {
+			maps.fog_override_table_[3][v.first] = false;
+		}
+	}
+	double maps_ms = elapsed_ms(start);
+	start = bench_clock::now();
+	hex_bitset west_edge = planes.make_plane();
+	for (int x = 0; x <= 4; ++x) {
+		for (int y = 0; y < h; ++y) {
+			west_edge.set(make_loc(x, y));
+		}
+	}
+	for (int side = 1; side <= 3; ++side) {
+		planes.place_shroud(side, everything);
+	}
+	planes.remove_shroud(3, west_edge);
+	planes.place_fog(3, everything);
+	BOOST_FOREACH(const terrain_map::value_type & v, terrain) {
+		if ((v.first.x * 7 + v.first.y) % 13 == 0) {
+			planes.set_fog_override(v.first, 3, false);
+		}
+	}
+	double planes_ms = elapsed_ms(start);
+
+	double maps_query_ms = 0, planes_query_ms = 0;
+	int mismatches = 0;
+	size_t shrouded = 0, fogged = 0;
+	hex_bitset seen = planes.make_plane();
+	for (int round = 0; round < rounds; ++round) {
+		// Each round the fog comes back, the units of side 1 step south and see around them
+		BOOST_FOREACH(map_location & l, walkers) {
+			l.y = std::min(l.y + 1, h - 1);
+		}
+
+		start = bench_clock::now();
+		BOOST_FOREACH(const terrain_map::value_type & v, terrain) {
+			maps.fog_table_[1][v.first] = true;
+		}
+		BOOST_FOREACH(map_location u, walkers) {
+			for (int x = u.x - radius; x <= u.x + radius; ++x) {
+				for (int y = u.y - radius; y <= u.y + radius; ++y) {
+					map_location l = make_loc(x, y);
+					if (terrain.count(l) && geom.distance(u, l) <= static_cast<size_t>(radius)) {
+						maps.shroud_table_[1][l] = false;
+						maps.fog_table_[1][l] = false;
+					}
+				}
+			}
+		}
+		maps_ms += elapsed_ms(start);
+
+		start = bench_clock::now();
+		seen.clear();
+		BOOST_FOREACH(map_location u, walkers) {
+			for (int x = u.x - radius; x <= u.x + radius; ++x) {
+				for (int y = u.y - radius; y <= u.y + radius; ++y) {
+					map_location l = make_loc(x, y);
+					if (seen.index(l) >= 0 && geom.distance(u, l) <= static_cast<size_t>(radius)) {
+						seen.set(l);
+					}
+				}
+			}
+		}
+		planes.place_fog(1, everything);
+		planes.remove_fog(1, seen);
+		planes.remove_shroud(1, seen);
+		planes_ms += elapsed_ms(start);
+
+		// What each side sees of the whole map
+		std::vector<bool> expected;
+		start = bench_clock::now();
+		BOOST_FOREACH(const terrain_map::value_type & v, terrain) {
+			for (int side = 1; side <= 3; ++side) {
+				expected.push_back(maps.ally_adjusted_shroud(v.first, side));
+				expected.push_back(maps.ally_adjusted_fog(v.first, side));
+			}
+		}
+		maps_query_ms += elapsed_ms(start);
+
+		std::vector<bool> got;
+		start = bench_clock::now();
+		BOOST_FOREACH(const terrain_map::value_type & v, terrain) {
+			for (int side = 1; side <= 3; ++side) {
+				got.push_back(planes.ally_adjusted_shroud(v.first, side));
+				got.push_back(planes.ally_adjusted_fog(v.first, side));
+			}
+		}
+		planes_query_ms += elapsed_ms(start);
+
+		for (size_t k = 0; k < expected.size(); ++k) {
+			mismatches += expected[k] != got[k];
+		}
+		shrouded = std::count(got.begin(), got.end(), true);
+		fogged = 0;
+		for (size_t k = 1; k < got.size(); k += 6) {
+			fogged += got[k];
+		}
+	}
+
+	std::cout << std::left << std::setw(12) << "" << std::right << std::setw(14) << "updates ms" << std::setw(14) << "queries ms" << "\n";
+	std::cout << std::left << std::setw(12) << "maps" << std::right << std::fixed << std::setprecision(2) << std::setw(14) << maps_ms << std::setw(14) << maps_query_ms << "\n";
+	std::cout << std::left << std::setw(12) << "planes" << std::right << std::setw(14) << planes_ms << std::setw(14) << planes_query_ms << "\n";
+	std::cout << "\nafter the last round " << fogged << " hexes fogged for side 1, " << shrouded << " answers true, " << mismatches << " mismatches\n";
+	return mismatches ? 1 : 0;
+}
+
+////
+// vision: Units walking through shroud and fog, seeing incrementally against seeing everything again.
+////
+
+static bool bench_vision(const terrain_map * m, const unit_map * units, const unit_rec & u, vision_engine::unit_vision & v) {
+	v.vision = 5;
+	v.costs = move_cost_fcn(boost::bind(&map_cost, m, _1));
+	v.jamming = units->side(u) == 2 && u.id_ % 8 == 0 ? 3 : 0; // some of the enemies are jammers
+	return true;
+}
+
+static int bench_vision_walk(int argc, char** argv) {
+	int rounds = arg_or(argc, argv, 2, 10);
+
+	const std::string filename = "data/Wesbench_Shroud_Walk.cfg";
+	terrain_map terrain = load_scenario_map(filename);
+	std::vector<map_location> walkers = load_scenario_units(filename, "PLACE_UNIT");
+	std::vector<map_location> enemies = load_scenario_units(filename, "PLACE_ENEMY");
+	if (terrain.empty() || walkers.empty()) {
+		std::cerr << "Could not read the map and units of " << filename << "\n";
+		return 1;
+	}
+
+	unit_map units;
+	int next_id = 1;
+	unit_state walker, enemy;
+	walker.side = 1;
+	enemy.side = 2;
+	BOOST_FOREACH(map_location l, walkers) {
+		units.insert(unit_rec(next_id++, l, unit()), walker);
+	}
+	BOOST_FOREACH(map_location l, enemies) {
+		units.insert(unit_rec(next_id++, l, unit()), enemy);
+	}
+
+	hex geom;
+	pathfind_context context(geom);
+	sides incremental_sides, rebuilt_sides;
+	vision_engine::vision_fcn describe = boost::bind(&bench_vision, &terrain, &units, _1, _2);
+	vision_engine incremental(context, geom, incremental_sides, describe);
+	vision_engine rebuilt(context, geom, rebuilt_sides, describe);
+
+	pathfind_context::pathing_query resources;
+	resources.tmap_ = &terrain;
+	resources.units = &units;
+	resources.sides_ = &incremental_sides;
+
+	// Side 1 starts under shroud, both sides have fog
+	hex_bitset everything = incremental_sides.make_plane();
+	everything.fill();
+	incremental_sides.place_shroud(1, everything);
+	for (int side = 1; side <= 2; ++side) {
+		incremental.use_fog(side, true);
+		rebuilt.use_fog(side, true);
+	}
+	incremental.use_shroud(1, true);
+	incremental.rebuild(resources);
+
+	std::cout << "vision: " << walkers.size() << " units of side 1 walking south through Wesbench_Shroud_Walk, " << enemies.size()
+		  << " of side 2 walking north (one in 8 jamming), vision 5, " << rounds << " rounds\n\n";
+
+	double incremental_ms = 0, rebuild_ms = 0;
+	size_t moves = 0;
+	int mismatches = 0, shroud_errors = 0, mask_errors = 0;
+	for (int round = 0; round < rounds; ++round) {
+		std::vector<int> ids;
+		BOOST_FOREACH(const unit_rec & u, units) {
+			ids.push_back(u.id_);
+		}
+		BOOST_FOREACH(int id, ids) {
+			unit_map::iterator it = units.find(id);
+			map_location to = it->loc_;
+			to.y += units.side(*it) == 1 ? 1 : -1;
+			terrain_map::const_iterator t = terrain.find(to);
+			if (t == terrain.end() || terrain_cost(t->second) >= 99 || units.get<by_loc>().count(to)) {
+				continue;
+			}
+			units.modify(it, [&](unit_rec & u) { u.loc_ = to; });
+
+			bench_clock::time_point start = bench_clock::now();
+			incremental.unit_changed(*it, resources);
+			incremental_ms += elapsed_ms(start);
+			++moves;
+		}
+
+		bench_clock::time_point start = bench_clock::now();
+		rebuilt.rebuild(resources);
+		rebuild_ms += elapsed_ms(start);
+
+		BOOST_FOREACH(const terrain_map::value_type & v, terrain) {
+			for (int side = 1; side <= 2; ++side) {
+				if (incremental.viewers(v.first, side) != rebuilt.viewers(v.first, side)
+						|| incremental_sides.true_fog(v.first, side) != rebuilt_sides.true_fog(v.first, side)) {
+					++mismatches;
+				}
+			}
+			if (rebuilt.viewers(v.first, 1) && incremental_sides.true_shroud(v.first, 1)) {
+				++shroud_errors;
+			}
+		}
+	}
+
+	// The masks which the context keeps for side 1 must follow its fog, as it is turned off and on again
+	pathfind_context::pathing_query q = resources;
+	q.moving_side = 1;
+	q.viewing_side = 1;
+	q.moves = 8;
+	q.max_moves = 8;
+	q.turns = 1;
+	q.cost_map = move_cost_fcn(boost::bind(&map_cost, &terrain, _1));
+	static const bool fog_states[] = { true, false, true };
+	BOOST_FOREACH(bool fog, fog_states) {
+		incremental.use_fog(1, fog);
+		BOOST_FOREACH(const unit_rec & u, units) {
+			if (units.side(u) == 1) {
+				q.start = u.loc_;
+				pathfind_context fresh(geom);
+				mask_errors += context.reachable_hexes(q) != fresh.reachable_hexes(q);
+			}
+		}
+	}
+
+	// Side 2 isn't allied with side 1, so its masks stay through changes to the fog of side 1
+	int cache_errors = 0;
+	BOOST_FOREACH(const unit_rec & u, units) {
+		if (units.side(u) == 2) {
+			q.start = u.loc_;
+			q.moving_side = 2;
+			q.viewing_side = 2;
+			context.reachable_hexes(q);
+			size_t computed = context.side_masks_computed();
+			incremental.use_fog(1, false);
+			incremental.use_fog(1, true);
+			context.reachable_hexes(q);
+			cache_errors += context.side_masks_computed() != computed;
+			break;
+		}
+	}
+
+	size_t unshrouded = 0;
+	BOOST_FOREACH(const terrain_map::value_type & v, terrain) {
+		unshrouded += !incremental_sides.true_shroud(v.first, 1);
+	}
+
+	std::cout << std::fixed << std::setprecision(1) << moves << " moves, " << 1000 * incremental_ms / std::max<size_t>(moves, 1) << " us per move seen incrementally, "
+		  << 1000 * rebuild_ms / rounds << " us to see everything again\n";
+	std::cout << unshrouded << " hexes unshrouded for side 1, " << mismatches << " mismatches, " << shroud_errors << " hexes seen but shrouded, "
+		  << mask_errors << " searches on stale masks, " << cache_errors << " masks of other sides dropped\n";
+	return mismatches + shroud_errors + mask_errors + cache_errors ? 1 : 0;
+}
+
+////
+// allies: Alliance queries from the ally matrix against splitting team strings into a cache of pairs.
+////
+
+// The teams of a side in a game of n sides, in teams of four and with some alliances across them
+static std::string bench_teams(int side) {
+	std::ostringstream ss;
+	ss << "team" << (side - 1) / 4;
+	if (side % 8 == 1) {
+		ss << ",pact" << side % 3;
+	}
+	return ss.str();
+}
+
+static bool split_allied(const std::vector<std::string> & teams, int a, int b) {
+	std::vector<std::string> ta = string_utils::split(teams[a]), tb = string_utils::split(teams[b]);
+	BOOST_FOREACH(const std::string & t, ta) {
+		if (std::find(tb.begin(), tb.end(), t) != tb.end()) {
+			return true;
+		}
+	}
+	return a == b;
+}
+
+static int bench_allies(int argc, char** argv) {
+	int nsides = std::min(arg_or(argc, argv, 2, 64), static_cast<int>(sides::MAX_SIDES));
+	int queries = arg_or(argc, argv, 3, 1000000);
+	int changes = arg_or(argc, argv, 4, 100);
+
+	std::cout << "allies: " << nsides << " sides, " << queries << " queries, " << changes << " changes of teams\n\n";
+
+	std::vector<std::string> teams(nsides + 1);
+	sides s;
+	for (int side = 1; side <= nsides; ++side) {
+		teams[side] = bench_teams(side);
+		s.set_teams(side, teams[side]);
+	}
+
+	boost::random::mt19937 gen(44);
+	boost::random::uniform_int_distribution<> pick(1, nsides);
+	std::vector<std::pair<int, int> > pairs;
+	for (int q = 0; q < queries; ++q) {
+		pairs.push_back(std::make_pair(pick(gen), pick(gen)));
+	}
+
+	// Each change of teams empties the cache of pairs, as it should have been
+	int mismatches = 0;
+	size_t allied = 0;
+	const int per_change = std::max(1, queries / std::max(1, changes));
+	std::map<std::pair<int, int>, bool> cache;
+	bench_clock::time_point start = bench_clock::now();
+	for (int q = 0; q < queries; ++q) {
+		if (q % per_change == 0) {
+			cache.clear();
+		}
+		auto it = cache.find(pairs[q]);
+		if (it == cache.end()) {
+			it = cache.insert(std::make_pair(pairs[q], split_allied(teams, pairs[q].first, pairs[q].second))).first;
+		}
+		allied += it->second;
+	}
+	double cache_ms = elapsed_ms(start);
+
+	size_t matrix_allied = 0;
+	start = bench_clock::now();
+	for (int q = 0; q < queries; ++q) {
+		if (q % per_change == 0) {
+			int side = pairs[q].first;
+			s.set_teams(side, teams[side]);
+		}
+		matrix_allied += s.are_allied(pairs[q].first, pairs[q].second);
+	}
+	double matrix_ms = elapsed_ms(start);
+
+	for (int a = 1; a <= nsides; ++a) {
+		for (int b = 1; b <= nsides; ++b) {
+			mismatches += s.are_allied(a, b) != split_allied(teams, a, b);
+		}
+	}
+	mismatches += allied != matrix_allied;
+
+	std::cout << std::fixed << std::setprecision(2) << "cache of pairs " << cache_ms << " ms, matrix " << matrix_ms << " ms, "
+		  << allied << " allied, " << mismatches << " mismatches\n";
+	return mismatches ? 1 : 0;
+}
+
+////
+// units: The unit_map slots and hashed ids vs the ordered multi_index it replaced, checking
+// that the unit table follows the units.
+////
+
+namespace reference {
+
+typedef boost::multi_index_container<
+	unit_rec,
+	indexed_by<
+		ordered_unique<tag<by_id>, member<unit_rec,const int,&unit_rec::id_> >,
+		ordered_unique<tag<by_loc>, member<unit_rec,const map_location,&unit_rec::loc_> >
+	>
+> ordered_unit_map;
+
+} // end namespace reference
+
+// A unit steps to an adjacent hex, or is taken off the map and put back there
+struct unit_step {
+	int id;
+	int direction;
+	bool reinsert;
+};
+
+static int bench_units(int argc, char** argv) {
+	int nunits = arg_or(argc, argv, 2, 600);
+	int steps = arg_or(argc, argv, 3, 200000);
+	int random_size = arg_or(argc, argv, 4, 64);
+
+	bench_map m;
+	BOOST_FOREACH(const bench_map & b, bench_maps(random_size)) {
+		if (b.name.compare(0, 17, "8p_Mokena_Prairie") == 0) {
+			m = b;
+		}
+	}
+
+	unit_map units;
+	units.fit(m.terrain);
+	place_units(units, m.terrain, nunits, 23);
+	reference::ordered_unit_map ordered(units.begin(), units.end());
+
+	hex_bitset passable;
+	{
+		map_location lo = m.terrain.begin()->first, hi = m.terrain.rbegin()->first;
+		BOOST_FOREACH(const terrain_map::value_type & v, m.terrain) {
+			lo.y = std::min(lo.y, v.first.y);
+			hi.y = std::max(hi.y, v.first.y);
+		}
+		passable = hex_bitset(lo.x, lo.y, hi.x - lo.x + 1, hi.y - lo.y + 1);
+		BOOST_FOREACH(const terrain_map::value_type & v, m.terrain) {
+			if (terrain_cost(v.second) < 99) {
+				passable.set(v.first);
+			}
+		}
+	}
+
+	std::cout << "units: " << m.name << ", " << units.size() << " units, " << steps << " steps\n\n";
+
+	// Lookups around each unit, as the pathfinder does for zones of control
+	hex geom;
+	std::vector<adjacent_hexes> around;
+	std::vector<int> ids;
+	BOOST_FOREACH(const unit_rec & u, units) {
+		around.push_back(adjacent_hexes());
+		geom.get_adjacent(u.loc_, around.back());
+		ids.push_back(u.id_);
+	}
+	const int rounds = 200;
+
+	size_t ordered_found = 0;
+	bench_clock::time_point start = bench_clock::now();
+	const reference::ordered_unit_map::index<by_loc>::type & ordered_by_loc = ordered.get<by_loc>();
+	for (int r = 0; r < rounds; ++r) {
+		BOOST_FOREACH(const adjacent_hexes & adj, around) {
+			BOOST_FOREACH(map_location a, adj) {
+				reference::ordered_unit_map::index<by_loc>::type::iterator it = ordered_by_loc.find(a);
+				ordered_found += it != ordered_by_loc.end() && it->id_ % 2 == 0; // the units of side 2
+			}
+		}
+	}
+	double ordered_loc_ms = elapsed_ms(start);
+
+	size_t grid_found = 0;
+	start = bench_clock::now();
+	for (int r = 0; r < rounds; ++r) {
+		BOOST_FOREACH(const adjacent_hexes & adj, around) {
+			BOOST_FOREACH(map_location a, adj) {
+				const unit_rec * u = units.at(a);
+				grid_found += u && units.table().side[u->row_] == 2;
+			}
+		}
+	}
+	double grid_loc_ms = elapsed_ms(start);
+
+	size_t ordered_sum = 0, hashed_sum = 0;
+	start = bench_clock::now();
+	for (int r = 0; r < rounds * 6; ++r) {
+		BOOST_FOREACH(int id, ids) {
+			ordered_sum += ordered.find(id)->loc_.x;
+		}
+	}
+	double ordered_id_ms = elapsed_ms(start);
+	start = bench_clock::now();
+	for (int r = 0; r < rounds * 6; ++r) {
+		BOOST_FOREACH(int id, ids) {
+			hashed_sum += units.find(id)->loc_.x;
+		}
+	}
+	double hashed_id_ms = elapsed_ms(start);
+
+	// The same steps for both, each refused where its own index says the hex is taken
+	std::vector<unit_step> plan;
+	boost::random::mt19937 gen(45);
+	boost::random::uniform_int_distribution<> pick_unit(0, ids.size() - 1), pick_direction(0, 5), pick_reinsert(0, 15);
+	for (int k = 0; k < steps; ++k) {
+		unit_step st = { ids[pick_unit(gen)], pick_direction(gen), pick_reinsert(gen) == 0 };
+		plan.push_back(st);
+	}
+
+	adjacent_hexes adj;
+	int ordered_moves = 0;
+	start = bench_clock::now();
+	BOOST_FOREACH(const unit_step & st, plan) {
+		reference::ordered_unit_map::iterator it = ordered.find(st.id);
+		geom.get_adjacent(it->loc_, adj);
+		map_location to = adj[st.direction];
+		if (!passable.test(to) || ordered_by_loc.count(to)) {
+			continue;
+		}
+		if (st.reinsert) {
+			unit_rec u = *it;
+			ordered.erase(it);
+			u.loc_ = to;
+			ordered.insert(u);
+		} else {
+			ordered.modify(it, [to](unit_rec & u) { u.loc_ = to; });
+		}
+		++ordered_moves;
+	}
+	double ordered_move_ms = elapsed_ms(start);
+
+	int grid_moves = 0;
+	start = bench_clock::now();
+	BOOST_FOREACH(const unit_step & st, plan) {
+		unit_map::iterator it = units.find(st.id);
+		geom.get_adjacent(it->loc_, adj);
+		map_location to = adj[st.direction];
+		if (!passable.test(to)) {
+			continue;
+		}
+		if (st.reinsert) {
+			if (units.count(to)) {
+				continue;
+			}
+			unit_rec u = *it;
+			unit_state state = units.state(u);
+			units.erase(it);
+			u.loc_ = to;
+			units.insert(u, state);
+		} else if (!units.move(it, to)) {
+			continue;
+		}
+		++grid_moves;
+	}
+	double grid_move_ms = elapsed_ms(start);
+
+	// Both indices and the slots agree with the ordered map everywhere
+	int mismatches = (ordered_found != grid_found) + (ordered_sum != hashed_sum) + (ordered_moves != grid_moves) + (ordered.size() != units.size());
+	for (int x = passable.x0() - 1; x <= passable.x0() + passable.width(); ++x) {
+		for (int y = passable.y0() - 1; y <= passable.y0() + passable.height(); ++y) {
+			map_location loc = make_loc(x, y);
+			reference::ordered_unit_map::index<by_loc>::type::iterator it = ordered_by_loc.find(loc);
+			const unit_rec * u = units.at(loc);
+			unit_map::index<by_loc>::type::iterator hashed = units.get<by_loc>().find(loc);
+			const unit_rec * h = hashed == units.get<by_loc>().end() ? NULL : &*hashed;
+			if ((it == ordered_by_loc.end()) != (u == NULL) || u != h || (u && u->id_ != it->id_)) {
+				++mismatches;
+			}
+		}
+	}
+	BOOST_FOREACH(const unit_rec & o, ordered) {
+		unit_map::iterator it = units.find(o.id_);
+		mismatches += it == units.end() || !(it->loc_ == o.loc_);
+	}
+	const unit_table & table = units.table();
+	for (size_t r = 0; r < table.size(); ++r) {
+		const unit_rec & u = *table.rec[r];
+		mismatches += u.row_ != r || !(u.loc_ == table.loc[r]) || table.side[r] != 2 - u.id_ % 2 || units.find(u.id_) == units.end();
+	}
+
+	std::cout << std::fixed << std::setprecision(2)
+		  << "by location: ordered " << ordered_loc_ms << " ms, grid " << grid_loc_ms << " ms (" << grid_found << " enemies next to units)\n"
+		  << "by id:       ordered " << ordered_id_ms << " ms, hashed " << hashed_id_ms << " ms\n"
+		  << "steps:       ordered " << ordered_move_ms << " ms, grid " << grid_move_ms << " ms (" << grid_moves << " made)\n"
+		  << mismatches << " mismatches\n";
+	return mismatches ? 1 : 0;
+}
+
+////
+// terrain: The terrain grid of interned codes vs the map of strings.
+////
+
+// Writes a map with its corner at (0, 0) back as map_data, for the maps which aren't in the tree
+static std::string map_data_of(const terrain_map & m) {
+	std::ostringstream ss;
+	for (int y = 0; m.count(make_loc(0, y)); ++y) {
+		for (int x = 0; m.count(make_loc(x, y)); ++x) {
+			ss << (x ? ", " : "") << m.find(make_loc(x, y))->second;
+		}
+		ss << "\n";
+	}
+	return ss.str();
+}
+
+static size_t grid_cost(const terrain_grid * g, map_location loc) {
+	return g->on_map(loc) ? terrain_cost(g->name(loc)) : 99;
+}
+
+static int bench_terrain(int argc, char** argv) {
+	int rounds = arg_or(argc, argv, 2, 20);
+	int random_size = arg_or(argc, argv, 3, 64);
+	int queries = arg_or(argc, argv, 4, 100);
+
+	std::cout << std::left << std::setw(40) << "map" << std::right << std::setw(8) << "hexes" << std::setw(8) << "codes" << std::setw(12) << "map read"
+		  << std::setw(12) << "grid read" << std::setw(12) << "map find" << std::setw(12) << "on_map" << std::setw(12) << "mismatches" << "  (ms)\n";
+
+	int failures = 0;
+	BOOST_FOREACH(const bench_map & m, bench_maps(random_size)) {
+		std::string data = map_data_of(m.terrain);
+
+		terrain_map by_string;
+		bench_clock::time_point start = bench_clock::now();
+		for (int r = 0; r < rounds; ++r) {
+			by_string = parse_map_data(data);
+		}
+		double map_read_ms = elapsed_ms(start) / rounds;
+
+		terrain_codes codes;
+		terrain_grid grid;
+		start = bench_clock::now();
+		for (int r = 0; r < rounds; ++r) {
+			read_map_data(data.data(), data.data() + data.size(), codes, grid);
+		}
+		double grid_read_ms = elapsed_ms(start) / rounds;
+
+		// Every hex of the rectangle and the ring around it
+		int mismatches = by_string.size() != grid.size();
+		size_t found = 0, on_map = 0;
+		start = bench_clock::now();
+		for (int r = 0; r < rounds; ++r) {
+			for (int x = grid.x0() - 1; x <= grid.x0() + grid.width(); ++x) {
+				for (int y = grid.y0() - 1; y <= grid.y0() + grid.height(); ++y) {
+					found += by_string.find(make_loc(x, y)) != by_string.end();
+				}
+			}
+		}
+		double find_ms = elapsed_ms(start) / rounds;
+		start = bench_clock::now();
+		for (int r = 0; r < rounds; ++r) {
+			for (int x = grid.x0() - 1; x <= grid.x0() + grid.width(); ++x) {
+				for (int y = grid.y0() - 1; y <= grid.y0() + grid.height(); ++y) {
+					on_map += grid.on_map(make_loc(x, y));
+				}
+			}
+		}
+		double on_map_ms = elapsed_ms(start) / rounds;
+		mismatches += found != on_map;
+		BOOST_FOREACH(const terrain_map::value_type & v, by_string) {
+			mismatches += !grid.on_map(v.first) || grid.name(v.first) != v.second || codes.find(v.second) != grid.code(v.first);
+		}
+
+		// The pathfinder lays out either map the same
+		hex geom;
+		pathfind_context on_strings(geom), on_codes(geom);
+		pathfind_context::pathing_query q;
+		q.moves = 5;
+		q.max_moves = 5;
+		q.turns = 2;
+		q.tmap_ = &by_string;
+		q.costs = on_strings.add_movetype(terrain_cost_fcn(&terrain_cost));
+		pathfind_context::pathing_query gq = q;
+		gq.tmap_ = NULL;
+		gq.terrain_ = &grid;
+		gq.costs = on_codes.add_movetype(terrain_cost_fcn(&terrain_cost));
+		pathfind_context::pathing_query cq = gq; // and with a cost map on the grid
+		cq.costs = NULL;
+		cq.cost_map = move_cost_fcn(boost::bind(&grid_cost, &grid, _1));
+
+		boost::random::mt19937 gen(47);
+		boost::random::uniform_int_distribution<> pick(0, by_string.size() - 1);
+		for (int k = 0; k < queries; ++k) {
+			terrain_map::const_iterator it = by_string.begin();
+			std::advance(it, pick(gen));
+			q.start = gq.start = cq.start = it->first;
+			loc_set expected = on_strings.reachable_hexes(q);
+			mismatches += expected != on_codes.reachable_hexes(gq);
+			mismatches += expected != on_codes.reachable_hexes(cq);
+		}
+
+		failures += mismatches;
+		std::cout << std::left << std::setw(40) << m.name << std::right << std::setw(8) << grid.size() << std::setw(8) << codes.size()
+			  << std::fixed << std::setprecision(3) << std::setw(12) << map_read_ms << std::setw(12) << grid_read_ms
+			  << std::setw(12) << find_ms << std::setw(12) << on_map_ms << std::setw(12) << mismatches << "\n";
+	}
+	return failures ? 1 : 0;
+}
+
+////
+// mapdata: The map_data decoder vs splitting the rows into strings, on all the scenarios of data/.
+////
+
+static std::vector<std::string> scenario_files() {
+	std::vector<std::string> result;
+	if (DIR * dir = opendir("data")) {
+		while (dirent * e = readdir(dir)) {
+			std::string name = e->d_name;
+			if (name.size() > 4 && name.compare(name.size() - 4, 4, ".cfg") == 0) {
+				result.push_back("data/" + name);
+			}
+		}
+		closedir(dir);
+	}
+	std::sort(result.begin(), result.end());
+	return result;
+}
+
+// map_data as the map editor writes it: a border, codes padded to a column, and the starting
+// positions of the players, for the scenarios whose map isn't in the tree
+static std::string random_map_data(int size, int players, unsigned seed) {
+	static const char * const codes[] = { "Gg", "Gg", "Gs^Fp", "Hh", "Mm", "Ww", "Re", "Ss", "Xu", "Gg^Vh", "Wwf", "Ds" };
+	boost::random::mt19937 gen(seed);
+	boost::random::uniform_int_distribution<> pick(0, sizeof(codes) / sizeof(codes[0]) - 1), pick_hex(1, size);
+
+	std::vector<std::string> cells(static_cast<size_t>(size + 2) * (size + 2));
+	BOOST_FOREACH(std::string & c, cells) {
+		c = codes[pick(gen)];
+	}
+	for (int p = 1; p <= players; ++p) {
+		std::ostringstream start;
+		start << p << " Kh";
+		cells[pick_hex(gen) * (size + 2) + pick_hex(gen)] = start.str();
+	}
+
+	std::ostringstream ss;
+	for (int y = 0; y < size + 2; ++y) {
+		for (int x = 0; x < size + 2; ++x) {
+			ss << (x ? ", " : "") << std::left << std::setw(12) << cells[y * (size + 2) + x];
+		}
+		ss << "\n";
+	}
+	return ss.str();
+}
+
+// Reads map_data the obvious way, splitting it into rows then cells
+static void split_map_data(const std::string & data, terrain_codes & codes, terrain_grid & out, start_positions & starts) {
+	out.reset(&codes, 0, 0, 0, 0);
+	int y = 0;
+	BOOST_FOREACH(const std::string & row, string_utils::split(data, '\n')) {
+		if (row.find('=') != std::string::npos) {
+			continue;
+		}
+		int x = 0;
+		BOOST_FOREACH(const std::string & cell, string_utils::split(row, ',', string_utils::STRIP_SPACES)) {
+			std::string code = cell;
+			size_t space = cell.find(' ');
+			if (space != std::string::npos) {
+				starts.push_back(std::make_pair(std::atoi(cell.c_str()), make_loc(x, y)));
+				code = trim(cell.substr(space + 1));
+			}
+			if (!code.empty()) {
+				out.set(make_loc(x, y), codes.intern(code));
+			}
+			++x;
+		}
+		++y;
+	}
+}
+
+static bool same_grid(const terrain_grid & a, const terrain_grid & b) {
+	bool same = a.size() == b.size();
+	a.for_each([&](map_location loc, terrain_code c) {
+		same = same && b.code(loc) == c;
+	});
+	return same;
+}
+
+static int bench_mapdata(int argc, char** argv) {
+	int rounds = arg_or(argc, argv, 2, 20);
+	int random_size = arg_or(argc, argv, 3, 40);
+
+	std::cout << std::left << std::setw(32) << "scenario" << std::right << std::setw(8) << "hexes" << std::setw(8) << "starts" << std::setw(12) << "split us"
+		  << std::setw(12) << "decode us" << std::setw(10) << "MB/s" << std::setw(10) << "allocs" << std::setw(12) << "mismatches" << "\n";
+
+	int failures = 0;
+	double split_total = 0, decode_total = 0;
+	terrain_codes codes;
+	terrain_grid grid, split_grid, kept, dropped;
+	start_positions starts, split_starts, kept_starts, dropped_starts;
+	BOOST_FOREACH(const std::string & filename, scenario_files()) {
+		std::string name = filename.substr(5, filename.size() - 9);
+		std::string data = load_map_data(filename);
+		if (data.empty()) {
+			int players = std::max(1, std::atoi(name.c_str()));
+			data = random_map_data(random_size, players, static_cast<unsigned>(filename.size() * 31 + name[0]));
+			name += " (random)";
+		}
+
+		bench_clock::time_point start = bench_clock::now();
+		for (int r = 0; r < rounds; ++r) {
+			split_starts.clear();
+			split_map_data(data, codes, split_grid, split_starts);
+		}
+		double split_us = elapsed_ms(start) * 1000 / rounds;
+
+		// Once the storage is there, the decoder shouldn't allocate: the grid, the table of codes and
+		// the starts keep their memory
+		read_map_data(data.data(), data.data() + data.size(), codes, grid, &starts);
+		int allocated = 0;
+		start = bench_clock::now();
+		for (int r = 0; r < rounds; ++r) {
+			const terrain_code * hexes = grid.codes_by_hex().data();
+			const start_positions::value_type * first_start = starts.data();
+			size_t ncodes = codes.size();
+			starts.clear();
+			read_map_data(data.data(), data.data() + data.size(), codes, grid, &starts);
+			allocated += hexes != grid.codes_by_hex().data() || first_start != starts.data() || ncodes != codes.size();
+		}
+		double decode_us = elapsed_ms(start) * 1000 / rounds;
+		split_total += split_us;
+		decode_total += decode_us;
+
+		// The same map and starts, and the border kept around (0, 0) or left off
+		int mismatches = !same_grid(grid, split_grid) || starts != split_starts;
+		kept_starts.clear();
+		dropped_starts.clear();
+		read_map_data(data.data(), data.data() + data.size(), codes, kept, &kept_starts, KEEP_BORDER);
+		read_map_data(data.data(), data.data() + data.size(), codes, dropped, &dropped_starts, DROP_BORDER);
+		const int b = 1; // none of the headers in data/ set another border_size
+		grid.for_each([&](map_location loc, terrain_code c) {
+			map_location moved = make_loc(loc.x - b, loc.y - b);
+			bool inside = moved.x >= 0 && moved.y >= 0 && moved.x < grid.width() - 2 * b && moved.y < grid.height() - 2 * b;
+			mismatches += kept.code(moved) != c;
+			mismatches += dropped.code(moved) != (inside ? c : terrain_codes::NONE);
+		});
+		mismatches += kept.size() != grid.size() || kept_starts.size() != starts.size();
+		for (size_t k = 0; k < starts.size() && k < kept_starts.size(); ++k) {
+			mismatches += !(kept_starts[k].second == make_loc(starts[k].second.x - b, starts[k].second.y - b));
+		}
+		BOOST_FOREACH(const start_positions::value_type & s, dropped_starts) {
+			mismatches += !dropped.on_map(s.second);
+		}
+
+		failures += mismatches + (allocated != 0);
+		std::cout << std::left << std::setw(32) << name << std::right << std::setw(8) << grid.size() << std::setw(8) << starts.size()
+			  << std::fixed << std::setprecision(1) << std::setw(12) << split_us << std::setw(12) << decode_us
+			  << std::setw(10) << data.size() / decode_us << std::setw(10) << allocated << std::setw(12) << mismatches << "\n";
+	}
+
+	std::cout << "\n" << std::fixed << std::setprecision(1) << "all maps: split " << split_total << " us, decode " << decode_total << " us, "
+		  << codes.size() << " terrain codes\n";
+	return failures ? 1 : 0;
+}
+
+////
+// locations: Containers keyed by location, ordered on map_location vs hashed and dense on
+// packed_location, for memory and lookups.
+////
+
+// The bytes the containers it is given to ask for (without what malloc adds to each block)
+static size_t container_bytes = 0;
+
+template<typename T>
+struct counting_allocator {
+	typedef T value_type;
+
+	counting_allocator() {}
+	template<typename U>
+	counting_allocator(const counting_allocator<U> &) {}
+
+	T * allocate(size_t n) {
+		container_bytes += n * sizeof(T);
+		return static_cast<T *>(::operator new(n * sizeof(T)));
+	}
+	void deallocate(T * p, size_t n) {
+		container_bytes -= n * sizeof(T);
+		::operator delete(p);
+	}
+
+	template<typename U>
+	bool operator==(const counting_allocator<U> &) const { return true; }
+	template<typename U>
+	bool operator!=(const counting_allocator<U> &) const { return false; }
+};
+
+typedef std::map<map_location, int, std::less<map_location>, counting_allocator<std::pair<const map_location, int> > > ordered_loc_table;
+typedef std::unordered_map<packed_location, int, std::hash<packed_location>, std::equal_to<packed_location>, counting_allocator<std::pair<const packed_location, int> > > hashed_loc_table;
+typedef std::vector<int, counting_allocator<int> > dense_loc_table;
+
+static int bench_locations(int argc, char** argv) {
+	int rounds = arg_or(argc, argv, 2, 20);
+	int random_size = arg_or(argc, argv, 3, 64);
+
+	std::cout << std::left << std::setw(40) << "map" << std::right << std::setw(8) << "hexes"
+		  << std::setw(10) << "map KB" << std::setw(10) << "hash KB" << std::setw(10) << "rows KB" << std::setw(10) << "morton KB"
+		  << std::setw(10) << "map ns" << std::setw(10) << "hash ns" << std::setw(10) << "rows ns" << std::setw(10) << "morton ns"
+		  << std::setw(12) << "mismatches" << "\n";
+
+	int failures = 0;
+	BOOST_FOREACH(const bench_map & m, bench_maps(random_size)) {
+		int x0 = m.terrain.begin()->first.x, y0 = m.terrain.begin()->first.y, x1 = x0, y1 = y0;
+		BOOST_FOREACH(const terrain_map::value_type & v, m.terrain) {
+			x0 = std::min(x0, v.first.x);
+			y0 = std::min(y0, v.first.y);
+			x1 = std::max(x1, v.first.x);
+			y1 = std::max(y1, v.first.y);
+		}
+		const int w = x1 - x0 + 1;
+		const packed_location corner(make_loc(x0, y0)), far_corner(make_loc(x1, y1));
+		const boost::uint32_t morton0 = std::min(corner.morton(), far_corner.morton());
+
+		// Each container maps the hexes of the map to their numbers
+		size_t before = container_bytes;
+		ordered_loc_table ordered;
+		int n = 0;
+		BOOST_FOREACH(const terrain_map::value_type & v, m.terrain) {
+			ordered.insert(std::make_pair(v.first, n++));
+		}
+		double ordered_kb = (container_bytes - before) / 1024.0;
+
+		before = container_bytes;
+		hashed_loc_table hashed;
+		n = 0;
+		BOOST_FOREACH(const terrain_map::value_type & v, m.terrain) {
+			hashed.insert(std::make_pair(packed_location(v.first), n++));
+		}
+		double hashed_kb = (container_bytes - before) / 1024.0;
+
+		before = container_bytes;
+		dense_loc_table rows(static_cast<size_t>(w) * (y1 - y0 + 1), -1);
+		n = 0;
+		BOOST_FOREACH(const terrain_map::value_type & v, m.terrain) {
+			rows[packed_location(v.first).row_major(x0, y0, w)] = n++;
+		}
+		double rows_kb = (container_bytes - before) / 1024.0;
+
+		// Interleaved codes of a rectangle aren't contiguous, the table spans from the least to the greatest
+		boost::uint32_t morton1 = morton0;
+		BOOST_FOREACH(const terrain_map::value_type & v, m.terrain) {
+			morton1 = std::max(morton1, packed_location(v.first).morton());
+		}
+		before = container_bytes;
+		dense_loc_table morton(morton1 - morton0 + 1, -1);
+		n = 0;
+		BOOST_FOREACH(const terrain_map::value_type & v, m.terrain) {
+			morton[packed_location(v.first).morton() - morton0] = n++;
+		}
+		double morton_kb = (container_bytes - before) / 1024.0;
+
+		// Every hex of the map and the ring around it, in a random order
+		std::vector<map_location> lookups;
+		for (int x = x0 - 1; x <= x1 + 1; ++x) {
+			for (int y = y0 - 1; y <= y1 + 1; ++y) {
+				lookups.push_back(make_loc(x, y));
+			}
+		}
+		boost::random::mt19937 gen(49);
+		for (size_t k = lookups.size(); k > 1; --k) {
+			boost::random::uniform_int_distribution<size_t> pick(0, k - 1);
+			std::swap(lookups[k - 1], lookups[pick(gen)]);
+		}
+		const double total = static_cast<double>(rounds) * lookups.size();
+
+		std::vector<int> found_ordered(lookups.size()), found_hashed(lookups.size()), found_rows(lookups.size()), found_morton(lookups.size());
+		bench_clock::time_point start = bench_clock::now();
+		for (int r = 0; r < rounds; ++r) {
+			for (size_t k = 0; k < lookups.size(); ++k) {
+				ordered_loc_table::const_iterator it = ordered.find(lookups[k]);
+				found_ordered[k] = it == ordered.end() ? -1 : it->second;
+			}
+		}
+		double ordered_ns = elapsed_ms(start) * 1e6 / total;
+		start = bench_clock::now();
+		for (int r = 0; r < rounds; ++r) {
+			for (size_t k = 0; k < lookups.size(); ++k) {
+				hashed_loc_table::const_iterator it = hashed.find(lookups[k]);
+				found_hashed[k] = it == hashed.end() ? -1 : it->second;
+			}
+		}
+		double hashed_ns = elapsed_ms(start) * 1e6 / total;
+		start = bench_clock::now();
+		for (int r = 0; r < rounds; ++r) {
+			for (size_t k = 0; k < lookups.size(); ++k) {
+				map_location loc = lookups[k];
+				bool inside = loc.x >= x0 && loc.x <= x1 && loc.y >= y0 && loc.y <= y1;
+				found_rows[k] = inside ? rows[packed_location(loc).row_major(x0, y0, w)] : -1;
+			}
+		}
+		double rows_ns = elapsed_ms(start) * 1e6 / total;
+		start = bench_clock::now();
+		for (int r = 0; r < rounds; ++r) {
+			for (size_t k = 0; k < lookups.size(); ++k) {
+				map_location loc = lookups[k];
+				bool inside = loc.x >= x0 && loc.x <= x1 && loc.y >= y0 && loc.y <= y1;
+				found_morton[k] = inside ? morton[packed_location(loc).morton() - morton0] : -1;
+			}
+		}
+		double morton_ns = elapsed_ms(start) * 1e6 / total;
+
+		int mismatches = 0;
+		for (size_t k = 0; k < lookups.size(); ++k) {
+			mismatches += found_hashed[k] != found_ordered[k] || found_rows[k] != found_ordered[k] || found_morton[k] != found_ordered[k];
+			packed_location p(lookups[k]);
+			mismatches += !(p.location() == lookups[k]) || packed_location::from_morton(p.morton()) != p;
+		}
+
+		failures += mismatches;
+		std::cout << std::left << std::setw(40) << m.name << std::right << std::setw(8) << m.terrain.size() << std::fixed << std::setprecision(1)
+			  << std::setw(10) << ordered_kb << std::setw(10) << hashed_kb << std::setw(10) << rows_kb << std::setw(10) << morton_kb
+			  << std::setw(10) << ordered_ns << std::setw(10) << hashed_ns << std::setw(10) << rows_ns << std::setw(10) << morton_ns
+			  << std::setw(12) << mismatches << "\n";
+	}
+
+	// The extremes of the packed range, and negative coordinates
+	int mismatches = 0;
+	static const int corners[] = { -32768, -1, 0, 1, 32767 };
+	BOOST_FOREACH(int x, corners) {
+		BOOST_FOREACH(int y, corners) {
+			packed_location p(make_loc(x, y));
+			mismatches += p.x() != x || p.y() != y || packed_location::from_morton(p.morton()) != p;
+		}
+	}
+	std::cout << "packing: " << (mismatches ? "WRONG" : "ok") << "\n";
+	return failures + mismatches ? 1 : 0;
+}
+
+////
+// regions: Hexes within a radius and rings, in closed form on the hex geometry and by the search
+// geometry falls back on, vs searching with neighbor sets.
+////
+
+// The old way: every hex within r steps of a, growing a set with the neighbor sets
+template<typename Neighbors>
+static loc_set within_by_sets(map_location a, size_t r, Neighbors neighbors) {
+	loc_set result, frontier;
+	result.insert(a);
+	frontier.insert(a);
+	for (size_t d = 0; d < r; ++d) {
+		loc_set next;
+		BOOST_FOREACH(map_location f, frontier) {
+			BOOST_FOREACH(map_location n, neighbors(f)) {
+				if (result.insert(n).second) {
+					next.insert(n);
+				}
+			}
+		}
+		frontier.swap(next);
+	}
+	return result;
+}
+
+static int bench_regions(int argc, char** argv) {
+	int centers = arg_or(argc, argv, 2, 2000);
+	int ntunnels = arg_or(argc, argv, 3, 20);
+
+	hex geom;
+	pathfind_context with_tunnels(geom);
+	boost::random::mt19937 gen(50);
+	boost::random::uniform_int_distribution<> coord(-40, 40);
+	for (int k = 0; k < ntunnels; ++k) {
+		with_tunnels.add_tunnel(make_loc(coord(gen), coord(gen)), make_loc(coord(gen), coord(gen)));
+	}
+	std::vector<map_location> starts;
+	for (int k = 0; k < centers; ++k) {
+		starts.push_back(make_loc(coord(gen), coord(gen)));
+	}
+
+	std::cout << std::left << std::setw(8) << "radius" << std::right << std::setw(8) << "hexes" << std::setw(12) << "sets" << std::setw(12) << "search"
+		  << std::setw(12) << "spiral" << std::setw(12) << "ring" << std::setw(12) << "tunnels" << std::setw(12) << "mismatches" << "  (ns per hex)\n";
+
+	int failures = 0;
+	static const size_t radii[] = { 0, 1, 2, 3, 5, 8, 12 };
+	BOOST_FOREACH(size_t r, radii) {
+		const size_t hexes = 1 + 3 * r * (r + 1);
+		const double total = static_cast<double>(centers) * hexes;
+		std::vector<map_location> buffer;
+
+		std::vector<loc_set> by_sets(starts.size());
+		bench_clock::time_point start = bench_clock::now();
+		for (size_t k = 0; k < starts.size(); ++k) {
+			by_sets[k] = within_by_sets(starts[k], r, boost::bind(&hex::neighbors, &geom, _1));
+		}
+		double sets_ns = elapsed_ms(start) * 1e6 / total;
+
+		start = bench_clock::now();
+		for (size_t k = 0; k < starts.size(); ++k) {
+			buffer.clear();
+			geom.geometry::get_spiral(starts[k], r, buffer);
+		}
+		double search_ns = elapsed_ms(start) * 1e6 / total;
+
+		start = bench_clock::now();
+		for (size_t k = 0; k < starts.size(); ++k) {
+			buffer.clear();
+			geom.get_spiral(starts[k], r, buffer);
+		}
+		double spiral_ns = elapsed_ms(start) * 1e6 / total;
+
+		start = bench_clock::now();
+		for (size_t k = 0; k < starts.size(); ++k) {
+			buffer.clear();
+			geom.get_ring(starts[k], r, buffer);
+		}
+		double ring_ns = elapsed_ms(start) * 1e6 / (static_cast<double>(centers) * (r ? 6 * r : 1));
+
+		start = bench_clock::now();
+		for (size_t k = 0; k < starts.size(); ++k) {
+			buffer.clear();
+			with_tunnels.get_spiral(starts[k], r, buffer);
+		}
+		double tunnels_ns = elapsed_ms(start) * 1e6 / total;
+
+		// The spiral is the set, ring by ring at the right distance, and the search finds the same rings
+		int mismatches = 0;
+		std::vector<map_location> searched, ring;
+		for (size_t k = 0; k < starts.size(); ++k) {
+			buffer.clear();
+			geom.get_spiral(starts[k], r, buffer);
+			mismatches += buffer.size() != hexes || loc_set(buffer.begin(), buffer.end()) != by_sets[k];
+			searched.clear();
+			geom.geometry::get_spiral(starts[k], r, searched);
+			mismatches += searched.size() != buffer.size();
+			size_t ring_begin = 0;
+			for (size_t d = 0; d <= r; ++d) {
+				size_t ring_end = 1 + 3 * d * (d + 1);
+				ring.clear();
+				geom.get_ring(starts[k], d, ring);
+				loc_set expected(buffer.begin() + ring_begin, buffer.begin() + ring_end);
+				mismatches += loc_set(ring.begin(), ring.end()) != expected;
+				if (ring_end <= searched.size()) {
+					mismatches += loc_set(searched.begin() + ring_begin, searched.begin() + ring_end) != expected;
+				}
+				BOOST_FOREACH(map_location l, ring) {
+					mismatches += geom.distance(starts[k], l) != d;
+				}
+				ring_begin = ring_end;
+			}
+
+			// Through the tunnels, against the sets of the context's neighbors
+			buffer.clear();
+			with_tunnels.get_spiral(starts[k], r, buffer);
+			loc_set expected = within_by_sets(starts[k], r, [&](map_location l) { return with_tunnels.neighbors(l); });
+			mismatches += buffer.size() != expected.size() || loc_set(buffer.begin(), buffer.end()) != expected;
+			ring.clear();
+			with_tunnels.get_ring(starts[k], r, ring);
+			loc_set inner = r ? within_by_sets(starts[k], r - 1, [&](map_location l) { return with_tunnels.neighbors(l); }) : loc_set();
+			mismatches += ring.size() != expected.size() - inner.size();
+			BOOST_FOREACH(map_location l, ring) {
+				mismatches += !expected.count(l) || inner.count(l);
+			}
+		}
+
+		failures += mismatches;
+		std::cout << std::left << std::setw(8) << r << std::right << std::setw(8) << hexes << std::fixed << std::setprecision(1)
+			  << std::setw(12) << sets_ns << std::setw(12) << search_ns << std::setw(12) << spiral_ns << std::setw(12) << ring_ns
+			  << std::setw(12) << tunnels_ns << std::setw(12) << mismatches << "\n";
+	}
+	return failures ? 1 : 0;
+}
+
+int main(int argc, char** argv) {
+	std::string mode = argc > 1 ? argv[1] : "";
+
+	if (mode == "pathfind") {
+		return bench_pathfind(argc, argv);
+	}
+	if (mode == "neighbors") {
+		return bench_neighbors(argc, argv);
+	}
+	if (mode == "astar") {
+		return bench_astar(argc, argv);
+	}
+	if (mode == "oracle") {
+		return bench_oracle(argc, argv);
+	}
+	if (mode == "reach") {
+		return bench_reach(argc, argv);
+	}
+	if (mode == "costs") {
+		return bench_costs(argc, argv);
+	}
+	if (mode == "repair") {
+		return bench_repair(argc, argv);
+	}
+	if (mode == "field") {
+		return bench_field(argc, argv);
+	}
+	if (mode == "paths") {
+		return bench_paths(argc, argv);
+	}
+	if (mode == "shroud") {
+		return bench_shroud(argc, argv);
+	}
+	if (mode == "vision") {
+		return bench_vision_walk(argc, argv);
+	}
+	if (mode == "allies") {
+		return bench_allies(argc, argv);
+	}
+	if (mode == "units") {
+		return bench_units(argc, argv);
+	}
+	if (mode == "terrain") {
+		return bench_terrain(argc, argv);
+	}
+	if (mode == "mapdata") {
+		return bench_mapdata(argc, argv);
+	}
+	if (mode == "locations") {
+		return bench_locations(argc, argv);
+	}
+	if (mode == "regions") {
+		return bench_regions(argc, argv);
+	}
+
+	std::cerr << "usage: " << argv[0] << " <mode> [args]    (run from the top of the tree, the maps are read from data/)\n"
+		  << "  pathfind [queries] [random_size] [units]  Dense pathfinder vs the map based one, checks they agree\n"
+		  << "  neighbors [size] [rounds]                 Neighbor iteration with and without allocation, checks hex adjacency\n"
+		  << "  astar [trials] [random_size]              Randomized check of A* against dijkstra, then timing on long paths\n"
+		  << "  oracle [trials] [size]                    Tunnel bookkeeping, landmark bounds and A* on maps with walls\n"
+		  << "  reach [units] [random_size] [threads]     Reachability for a side in one batch vs per unit, checks they agree\n"
+		  << "  costs [queries] [random_size]             Cost grids vs cost maps while the terrain changes, checks they agree\n"
+		  << "  repair [moves] [random_size] [units]      Trees repaired after each enemy move vs searched again, checks they agree\n"
+		  << "  field [sources] [random_size] [threads]   Distance fields from many sources vs merged trees, checks they agree\n"
+		  << "  paths [trials] [random_size]              All the paths of a query from the predecessor array vs the tree map, checks they agree\n"
+		  << "  shroud [rounds] [vision]                  Units walking through shroud on Wesbench_Shroud_Walk, bit planes vs maps\n"
+		  << "  vision [rounds]                           Units walking on Wesbench_Shroud_Walk, vision updated per move vs seen again\n"
+		  << "  allies [sides] [queries] [changes]        Alliances from the ally matrix vs split team strings cached by pair\n"
+		  << "  units [units] [steps] [random_size]       Unit lookups and steps on 8p_Mokena_Prairie, grid and hashed unit_map vs ordered\n"
+		  << "  terrain [rounds] [random_size] [queries]  Map data read into the grid of terrain codes vs the map of strings\n"
+		  << "  mapdata [rounds] [random_size]            The map_data decoder vs splitting into strings, on every scenario of data/\n"
+		  << "  locations [rounds] [random_size]          Tables keyed by location: ordered map vs hashed and dense on packed locations\n"
+		  << "  regions [centers] [tunnels]               Hexes within a radius and rings, closed form and search vs neighbor sets\n";
+	return 2;
+}
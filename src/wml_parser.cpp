@@ -39,7 +39,9 @@ namespace qi = boost::spirit::qi;
 //  Our WML grammar definition
 ///////////////////////////////////////////////////////////////////////////
 
-static std::ostream* errbuf = 0;
+// The grammar binds this stream when it is constructed. It is thread local so that
+// parsers constructed on different threads don't redirect each other's errors.
+static thread_local std::ostream* errbuf = 0;
 
 template <typename Iterator>
 struct whitespace {